@@ -0,0 +1,41 @@
+#!/bin/bash
+# End-to-end throughput of filterTable and tableDist over synthetic tables.
+#
+# USAGE: bench.sh BINDIR [ROWS COLS THREADS]
+#
+# Prints one tab-separated line per run: tool, arguments, seconds, MB/s and
+# rows/s.
+set -e
+
+BINDIR=${1:?USAGE: bench.sh BINDIR [ROWS COLS THREADS]}
+ROWS=${2:-200000}
+COLS=${3:-100}
+THREADS=${4:-1}
+TMPDIR=$(mktemp -d)
+trap 'rm -rf "$TMPDIR"' EXIT
+
+TABLE=$TMPDIR/synthetic.tab
+"$BINDIR/genTable" -r "$ROWS" -c "$COLS" -o "$TABLE"
+BYTES=$(wc -c < "$TABLE")
+
+run() {
+    local tool=$1
+    shift
+    local start end
+    start=$(date +%s.%N)
+    "$BINDIR/$tool" -r 1 -c 1 -t "$THREADS" -i "$TABLE" -o /dev/null "$@"
+    end=$(date +%s.%N)
+    awk -v tool="$tool" -v args="$*" -v start="$start" -v end="$end" \
+        -v bytes="$BYTES" -v rows="$ROWS" 'BEGIN {
+            secs = end - start
+            printf("%s\t%s\t%.3f\t%.2f MB/s\t%.0f rows/s\n", tool, args,
+                   secs, bytes / secs / 1e6, rows / secs)
+        }'
+}
+
+echo "# $ROWS rows, $COLS cols, $BYTES bytes, $THREADS threads"
+run filterTable -z 10
+run filterTable -m 5
+run tableDist -m
+run tableDist -C
+run tableDist -M 1
@@ -0,0 +1,311 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  bench_ktable.c
+ *
+ *    Description:  Micro-benchmarks of the ktable parsing and distance paths
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 12:05:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc 4.7+ or clang 3.2+
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "kdm.h"
+#include "ktable.h"
+#include "kpipeline.h"
+#include "kdist.h"
+#include "synth.h"
+
+/* Each benchmark repeats until it has run for at least this long */
+#define BENCH_MIN_SECS 0.5
+
+typedef struct _bench {
+    const char *name;
+    const char *unit;
+    double units;           /* Work units per iteration, e.g. bytes */
+    double secs;
+    size_t iters;
+} bench_t;
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* One line per benchmark: name, iterations, seconds per iteration and
+ * throughput, tab separated so runs can be diffed or plotted. */
+static void
+bench_report (const bench_t *b)
+{
+    double per_iter = b->secs / b->iters;
+    printf("%s\t%zu\t%.9f\t%.3f\t%s/s\n", b->name, b->iters, per_iter,
+            b->units / per_iter, b->unit);
+    fflush(stdout);
+}
+
+#define BENCH_LOOP(b, body) do {                                            \
+        double _start = now();                                              \
+        (b)->iters = 0;                                                     \
+        do {                                                                \
+            body;                                                           \
+            (b)->iters++;                                                   \
+            (b)->secs = now() - _start;                                     \
+        } while ((b)->secs < BENCH_MIN_SECS);                               \
+        bench_report(b);                                                    \
+    } while (0)
+
+static void
+noop_row (table_t *tab, void *data, char *line, cell_t *cells, size_t count)
+{
+}
+
+static void
+bench_count_columns (const char *line, size_t len)
+{
+    bench_t b = {"count_columns", "MB", len / 1e6, 0, 0};
+    volatile size_t cols = 0;
+    BENCH_LOOP(&b, cols += count_columns(line, "\t", len));
+}
+
+static void
+bench_iter_table (table_t *tab, size_t bytes, size_t rows)
+{
+    bench_t b = {"iter_table", "MB", bytes / 1e6, 0, 0};
+    bench_t r = {"iter_table_rows", "rows", rows, 0, 0};
+    pipeline_t *pl = pipeline_new();
+    pipeline_add_sink(pl, &noop_row, NULL);
+    BENCH_LOOP(&b, {
+        rewind(tab->fp);
+        tab->rows = 0;
+        pipeline_run(tab, pl);
+    });
+    r.iters = b.iters;
+    r.secs = b.secs;
+    bench_report(&r);
+    destroy_pipeline_t(pl);
+}
+
+static void
+bench_median (const cell_t *row, size_t count, cell_mode_t mode)
+{
+    bench_t b = {"median", "cells", count, 0, 0};
+    cell_t *scratch = km_calloc(count, sizeof(*scratch), &km_onerr_print_exit);
+    volatile uint64_t sink = 0;
+    BENCH_LOOP(&b, {
+        memcpy(scratch, row, count * sizeof(*scratch));
+        sink += median(scratch, count, mode).u;
+    });
+    km_free(scratch);
+}
+
+static void
+bench_kernel (const char *name, cell_t *row, size_t count, cell_mode_t mode,
+        cell_t (*calc)(cell_t, cell_t, cell_mode_t))
+{
+    bench_t b = {name, "pairs", (count * (count - 1)) / 2.0, 0, 0};
+    dist_mat_t mat;
+    memset(&mat, 0, sizeof(mat));
+    mat.samples = count;
+    mat.last = count;
+    mat.pairs = (count * (count + 1)) / 2;
+    mat.matrix = km_calloc(mat.pairs, sizeof(*mat.matrix),
+            &km_onerr_print_exit);
+    BENCH_LOOP(&b, do_pairwise(&mat, row, count, mode, calc));
+    km_free(mat.matrix);
+}
+
+/* As bench_kernel, with rows held in a narrow batch and added to the matrix
+ * whenever it fills, so each iteration costs a row's share of a flush */
+static void
+bench_narrow_kernel (const char *name, table_t *tab, cell_t *row,
+        size_t count, int binary)
+{
+    bench_t b = {name, "pairs", (count * (count - 1)) / 2.0, 0, 0};
+    dist_mat_t mat;
+    memset(&mat, 0, sizeof(mat));
+    mat.samples = count;
+    mat.last = count;
+    mat.pairs = (count * (count + 1)) / 2;
+    mat.matrix = km_calloc(mat.pairs, sizeof(*mat.matrix),
+            &km_onerr_print_exit);
+    mat.narrow = narrow_batch_new(table_arena(tab), count, binary);
+    BENCH_LOOP(&b, {
+        narrow_batch_add(mat.narrow, row, count);
+        if (mat.narrow->rows == mat.narrow->cap) {
+            narrow_batch_flush(&mat, 1);
+        }
+    });
+    km_free(mat.matrix);
+}
+
+static void
+bench_sparse_canberra (table_t *tab, cell_t *row, size_t count)
+{
+    bench_t b = {"sparse_canberra", "pairs", (count * (count - 1)) / 2.0,
+        0, 0};
+    dist_mat_t mat;
+    memset(&mat, 0, sizeof(mat));
+    mat.samples = count;
+    mat.last = count;
+    mat.pairs = (count * (count + 1)) / 2;
+    mat.matrix = km_calloc(mat.pairs, sizeof(*mat.matrix),
+            &km_onerr_print_exit);
+    canberra_sparse_alloc(table_arena(tab), &mat, count);
+    BENCH_LOOP(&b, canberra_sparse_row(&mat, row, count, NULL));
+    km_free(mat.matrix);
+}
+
+static void
+bench_print_dist_mat (table_t *tab, size_t samples)
+{
+    bench_t b = {"print_dist_mat", "MB", 0, 0, 0};
+    dist_mat_t *mat = arena_calloc(table_arena(tab), 1, sizeof(*mat));
+    FILE *outfp = tab->outfp;
+    size_t iii;
+    distmat_alloc(tab, mat, samples);
+    for (iii = 0; iii < mat->pairs; iii++) {
+        mat->matrix[iii].d = iii * 0.25l;
+    }
+    /* Measure the output size once, then time writes to the null device */
+    tab->data = mat;
+    tab->outfp = tmpfile();
+    print_dist_mat(tab, mat);
+    b.units = ftell(tab->outfp) / 1e6;
+    fclose(tab->outfp);
+    tab->outfp = outfp;
+    BENCH_LOOP(&b, print_dist_mat(tab, mat));
+    tab->data = NULL;
+}
+
+void
+print_usage()
+{
+    fprintf(stderr, "benchKtable\n\n");
+    fprintf(stderr, "Micro-benchmarks of ktable over a synthetic table.\n\n");
+    fprintf(stderr, "USAGE:\n\n");
+    fprintf(stderr, "benchKtable [-r ROWS -c COLS -z SPARSITY -S SEED -t THREADS -p SAMPLES]\n");
+    fprintf(stderr, "benchKtable -h\n\n");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "\t-r ROWS\t\tRows in the synthetic table (default 10000).\n");
+    fprintf(stderr, "\t-c COLS\t\tSample columns in the synthetic table (default 100).\n");
+    fprintf(stderr, "\t-z SPARSITY\tProbability that a cell is zero (default 0.5).\n");
+    fprintf(stderr, "\t-S SEED\t\tRandom seed (default 1).\n");
+    fprintf(stderr, "\t-t THREADS\tThreads for the iter_table benchmark (default 1).\n");
+    fprintf(stderr, "\t-p SAMPLES\tSamples in the print_dist_mat benchmark (default 500).\n");
+    fprintf(stderr, "\t-h \t\tPrint this help message.\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+    synth_opts_t opts;
+    table_t tab;
+    size_t bytes = 0;
+    size_t print_samples = 500;
+    size_t line_size = 1<<15;
+    ssize_t len = 0;
+    char *line = NULL;
+    scratch_t scratch;
+    cell_t *row = NULL;
+    int c = 0;
+
+    synth_opts_default(&opts);
+    memset(&tab, 0, sizeof(tab));
+    memset(&scratch, 0, sizeof(scratch));
+    while((c = getopt(argc, argv, "r:c:z:S:t:p:h")) >= 0) {
+        switch (c) {
+            case 'r':
+                opts.rows = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                opts.cols = strtoull(optarg, NULL, 10);
+                break;
+            case 'z':
+                opts.sparsity = strtod(optarg, NULL);
+                break;
+            case 'S':
+                opts.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                tab.threads = atoi(optarg);
+                break;
+            case 'p':
+                print_samples = strtoul(optarg, NULL, 10);
+                break;
+            case 'h':
+                print_usage();
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (opts.cols < 2) {
+        fprintf(stderr, "Need at least two columns\n");
+        exit(EXIT_FAILURE);
+    }
+
+    tab.fp = tmpfile();
+    tab.outfp = fopen("/dev/null", "w");
+    if (tab.fp == NULL || tab.outfp == NULL) {
+        fprintf(stderr, "Could not open benchmark files\n");
+        exit(EXIT_FAILURE);
+    }
+    tab.fname = strdup("synthetic");
+    tab.outfname = strdup("/dev/null");
+    tab.sep = strdup("\t");
+    tab.skiprow = 1;
+    tab.skipcol = 1;
+    tab.mode = D64;
+    bytes = synth_table(tab.fp, &opts);
+    printf("# %llu rows, %llu cols, sparsity %.2f, %zu bytes\n",
+            (unsigned long long)opts.rows, (unsigned long long)opts.cols,
+            opts.sparsity, bytes);
+    printf("#bench\titers\tsecs_per_iter\trate\tunit\n");
+
+    /* Grab the first data row for the per-row benchmarks */
+    rewind(tab.fp);
+    line = km_calloc(line_size, sizeof(*line), &km_onerr_print_exit);
+    km_readline_realloc(&line, tab.fp, &line_size, &km_onerr_print_exit);
+    len = km_readline_realloc(&line, tab.fp, &line_size, &km_onerr_print_exit);
+    tab.cols = opts.cols;
+    row = km_calloc(tab.cols, sizeof(*row), &km_onerr_print_exit);
+    scratch.arena = table_arena(&tab);
+    parse_row(&tab, line, &scratch, row);
+
+    bench_count_columns(line, len);
+    bench_iter_table(&tab, bytes, opts.rows);
+    bench_median(row, tab.cols, D64);
+    bench_kernel("calc_canberra", row, tab.cols, D64, &calc_canberra);
+    bench_kernel("calc_manhattan", row, tab.cols, D64, &calc_manhattan);
+    bench_kernel("calc_manhattan_binary", row, tab.cols, D64,
+            &calc_manhattan_binary);
+    bench_sparse_canberra(&tab, row, tab.cols);
+    bench_narrow_kernel("narrow_manhattan", &tab, row, tab.cols, 0);
+    bench_narrow_kernel("narrow_manhattan_binary", &tab, row, tab.cols, 1);
+    bench_print_dist_mat(&tab, print_samples);
+
+    km_free(row);
+    km_free(line);
+    km_free(tab.fname);
+    km_free(tab.outfname);
+    km_free(tab.sep);
+    fclose(tab.fp);
+    fclose(tab.outfp);
+    destroy_arena_t(tab.arena);
+    return EXIT_SUCCESS;
+}
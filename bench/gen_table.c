@@ -0,0 +1,107 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  gen_table.c
+ *
+ *    Description:  genTable: write a synthetic k-mer count table
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 12:05:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc 4.7+ or clang 3.2+
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "synth.h"
+
+void
+print_usage()
+{
+    fprintf(stderr, "genTable\n\n");
+    fprintf(stderr, "Write a deterministic synthetic k-mer count table.\n\n");
+    fprintf(stderr, "USAGE:\n\n");
+    fprintf(stderr, "genTable [-r ROWS -c COLS -z SPARSITY -m MEAN -d DIST -S SEED -k KEYLEN -H -o OUTFILE]\n");
+    fprintf(stderr, "genTable -h\n\n");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "\t-r ROWS\t\tNumber of data rows (default 10000).\n");
+    fprintf(stderr, "\t-c COLS\t\tNumber of sample columns (default 100).\n");
+    fprintf(stderr, "\t-z SPARSITY\tProbability that a cell is zero (default 0.5).\n");
+    fprintf(stderr, "\t-m MEAN\t\tMean of non-zero cells (default 20).\n");
+    fprintf(stderr, "\t-d DIST\t\t'geometric' (default) or 'uniform' non-zero cells.\n");
+    fprintf(stderr, "\t-S SEED\t\tRandom seed (default 1).\n");
+    fprintf(stderr, "\t-k KEYLEN\tLength of the k-mer key column, 0 for none (default 21).\n");
+    fprintf(stderr, "\t-H \t\tDon't write a header row.\n");
+    fprintf(stderr, "\t-o OUTFILE\tOutput to OUTFILE, not stdout (or '-' for stdout).\n");
+    fprintf(stderr, "\t-h \t\tPrint this help message.\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+    synth_opts_t opts;
+    FILE *outfp = stdout;
+    int c = 0;
+    synth_opts_default(&opts);
+    while((c = getopt(argc, argv, "r:c:z:m:d:S:k:Ho:h")) >= 0) {
+        switch (c) {
+            case 'r':
+                opts.rows = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                opts.cols = strtoull(optarg, NULL, 10);
+                break;
+            case 'z':
+                opts.sparsity = strtod(optarg, NULL);
+                break;
+            case 'm':
+                opts.mean = strtod(optarg, NULL);
+                break;
+            case 'd':
+                if (!synth_dist_from_str(&opts.dist, optarg)) {
+                    fprintf(stderr, "Unknown distribution '%s'\n", optarg);
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                opts.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                opts.keylen = strtoul(optarg, NULL, 10);
+                break;
+            case 'H':
+                opts.header = 0;
+                break;
+            case 'o':
+                if (strcmp(optarg, "-") != 0) {
+                    outfp = fopen(optarg, "w");
+                    if (outfp == NULL) {
+                        fprintf(stderr, "Could not open file '%s'\n%s\n",
+                                optarg, strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
+            case 'h':
+                print_usage();
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    synth_table(outfp, &opts);
+    if (outfp != stdout) {
+        fclose(outfp);
+    }
+    return EXIT_SUCCESS;
+}
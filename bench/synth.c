@@ -0,0 +1,143 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  synth.c
+ *
+ *    Description:  Deterministic synthetic k-mer count tables
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 12:05:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "synth.h"
+
+void
+synth_opts_default (synth_opts_t *opts)
+{
+    opts->rows = 10000;
+    opts->cols = 100;
+    opts->sparsity = 0.5;
+    opts->mean = 20.0;
+    opts->dist = SYNTH_GEOMETRIC;
+    opts->seed = 1;
+    opts->keylen = 21;
+    opts->header = 1;
+}
+
+int
+synth_dist_from_str (synth_dist_t *dist, const char *str)
+{
+    if (strcmp(str, "uniform") == 0) {
+        *dist = SYNTH_UNIFORM;
+    } else if (strcmp(str, "geometric") == 0) {
+        *dist = SYNTH_GEOMETRIC;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* splitmix64: the same seed gives the same table on every platform */
+uint64_t
+synth_rand (uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static inline double
+synth_unit (uint64_t *state)
+{
+    /* 53 random bits into (0, 1] */
+    return ((synth_rand(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+uint64_t
+synth_cell (uint64_t *state, const synth_opts_t *opts)
+{
+    if (synth_unit(state) <= opts->sparsity) {
+        return 0;
+    }
+    switch (opts->dist) {
+        case SYNTH_UNIFORM:
+            if (opts->mean <= 1.0) return 1;
+            return 1 + synth_rand(state) % (uint64_t)(2.0 * opts->mean - 1.0);
+        case SYNTH_GEOMETRIC:
+            if (opts->mean <= 1.0) return 1;
+            return 1 + (uint64_t)floor(log(synth_unit(state)) /
+                    log(1.0 - 1.0 / opts->mean));
+    }
+    return 0;
+}
+
+static inline char *
+synth_u64 (char *buf, uint64_t val)
+{
+    char tmp[24];
+    size_t len = 0;
+    do {
+        tmp[len++] = '0' + (val % 10);
+        val /= 10;
+    } while (val > 0);
+    while (len > 0) {
+        *buf++ = tmp[--len];
+    }
+    return buf;
+}
+
+/* Write a table to fp. Row keys are the row number spelt in base four as
+ * ACGT, so keys are unique and in sorted order. Returns bytes written. */
+size_t
+synth_table (FILE *fp, const synth_opts_t *opts)
+{
+    static const char bases[] = "ACGT";
+    uint64_t state = opts->seed;
+    size_t bytes = 0;
+    size_t bufsize = opts->keylen + 24 * (opts->cols + 1) + 2;
+    char *buf = malloc(bufsize);
+    uint64_t rrr, ccc;
+    if (buf == NULL) {
+        return 0;
+    }
+    if (opts->header) {
+        bytes += fprintf(fp, "Kmer");
+        for (ccc = 0; ccc < opts->cols; ccc++) {
+            bytes += fprintf(fp, "\tS%llu", (unsigned long long)ccc + 1);
+        }
+        bytes += fprintf(fp, "\n");
+    }
+    for (rrr = 0; rrr < opts->rows; rrr++) {
+        char *pos = buf;
+        if (opts->keylen > 0) {
+            uint64_t key = rrr;
+            size_t kkk;
+            for (kkk = opts->keylen; kkk > 0; kkk--) {
+                pos[kkk - 1] = bases[key & 3];
+                key >>= 2;
+            }
+            pos += opts->keylen;
+        }
+        for (ccc = 0; ccc < opts->cols; ccc++) {
+            if (ccc > 0 || opts->keylen > 0) {
+                *pos++ = '\t';
+            }
+            pos = synth_u64(pos, synth_cell(&state, opts));
+        }
+        *pos++ = '\n';
+        bytes += fwrite(buf, 1, pos - buf, fp);
+    }
+    free(buf);
+    return bytes;
+}
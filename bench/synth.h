@@ -0,0 +1,48 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  synth.h
+ *
+ *    Description:  Deterministic synthetic k-mer count tables
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 12:05:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Types */
+typedef enum _synth_dist {
+    SYNTH_UNIFORM = 0,      /* Uniform on [1, 2 * mean - 1] */
+    SYNTH_GEOMETRIC = 1,    /* Geometric on [1, inf) with the given mean */
+} synth_dist_t;
+
+typedef struct _synth_opts {
+    uint64_t rows;
+    uint64_t cols;
+    double sparsity;        /* Probability that a cell is zero */
+    double mean;            /* Mean of the non-zero cells */
+    synth_dist_t dist;
+    uint64_t seed;
+    size_t keylen;          /* Length of the k-mer row key, 0 for none */
+    int header;             /* Emit a header row of sample names */
+} synth_opts_t;
+
+/* Function prototypes */
+extern void synth_opts_default(synth_opts_t *opts);
+extern int synth_dist_from_str(synth_dist_t *dist, const char *str);
+extern uint64_t synth_rand(uint64_t *state);
+extern uint64_t synth_cell(uint64_t *state, const synth_opts_t *opts);
+extern size_t synth_table(FILE *fp, const synth_opts_t *opts);
+
+#endif /* SYNTH_H */
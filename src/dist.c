@@ -22,274 +22,766 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "kdm.h"
 #include "ktable.h"
+#include "kpipeline.h"
+#include "kdist.h"
 
-typedef struct _distmat {
-    size_t samples;
-    size_t pairs;
-    cell_t *matrix;
-    char **sample_names;
-} dist_mat_t;
+/* Long options without a short equivalent */
+#define OPT_PROGRESS 256
+#define OPT_STATS 257
+#define OPT_HUGEPAGES 258
+#define OPT_MEMLIMIT 259
+#define OPT_SKETCH 260
+#define OPT_COLUMNS 261
+#define OPT_SAMPLES 262
+#define OPT_IO 263
+#define OPT_RANGE 264
+#define OPT_COLLAPSE 265
+#define OPT_NORMALIZE 266
+#define OPT_TOTALS 267
+#define OPT_NARROW 268
+#define OPT_TILES 269
+#define OPT_SPARSE 270
+#define OPT_KNN 271
+#define OPT_CUTOFF 272
 
+/* Normalisation of each sample's cells by its total */
+#define DM_NORM_RELATIVE 1
+#define DM_NORM_HELLINGER 2
 
-void
-destroy_distmat_t(dist_mat_t *dm)
+static stage_row_fn dist_fn = NULL;
+/* Bytes of matrix to hold at once, 0 for no limit */
+static size_t mem_limit = 0;
+/* Sketch size for approximate distances, 0 for exact distances */
+static size_t sketch_k = 0;
+/* Edge list output: each sample's knn.k nearest, or with only a cutoff,
+ * every pair closer than it */
+static knn_set_t knn;
+static int edges = 0;
+/* Normalisation, if any, and sample totals from a tableStats sidecar */
+static int normalize = 0;
+typedef struct _dm_total {
+    char *name;
+    long double sum;
+} dm_total_t;
+static dm_total_t *totals = NULL;       /* In file order */
+static size_t n_totals = 0;
+static int totals_failed = 0;
+/* Hold integer rows in narrow batches for the Manhattan kernels */
+static int narrow = 0;
+/* Canberra distances from the pairs of each row's non-zero cells only */
+static int sparse = 0;
+/* Share one matrix between threads, which take tiles of it over a block of
+ * rows, rather than each filling its own matrix from a share of the rows */
+static int tiles = 0;
+static dist_tile_fn tile_fn = NULL;
+/* Rows of a block take at most this many bytes */
+#define DM_BLOCK_BYTES (16 << 20)
+
+typedef struct _dm_totals {
+    size_t n;
+    long double *sums;
+} dm_totals_t;
+
+static void
+dm_tile_canberra (dist_mat_t *mat, const dist_tile_t *tile, void *data)
 {
-    if ((dm) != NULL) {
-        km_free((dm)->matrix);
-        if ((dm)->sample_names) {
-            size_t iii;
-            for (iii = 0; iii < (dm)->samples; iii++) {
-                km_free((dm)->sample_names[iii]);
-            }
-            km_free((dm)->sample_names);
-        }
-        free(dm);
-    }
+    dist_block_t *blk = (dist_block_t *)data;
+    do_pairwise_tile(mat, blk->cells, blk->rows, normalize ? mat->scale : NULL,
+            tile, &calc_canberra);
 }
 
-#define	destroy_distmat_table_t(t) do {                                     \
-    if ((t) != NULL) {                                                      \
-        if ((t)->fname != NULL) free((t)->fname);                           \
-        if ((t)->outfname != NULL) free((t)->outfname);                     \
-        if ((t)->sep != NULL) free((t)->sep);                               \
-        if ((t)->fp != NULL) fclose((t)->fp);                               \
-        if ((t)->outfp != NULL) fclose((t)->outfp);                         \
-        if ((t)->data != NULL) destroy_distmat_t(((dist_mat_t *)((t)->data)));\
-        free((t));                                                          \
-    }} while (0)
-
-static cell_t binary_cutoff = {u : 1, i : 1, d : 1.0};
-
-#define __abs(a) (((a) > 0.0) ? (a) : (-(a)))
-#define	KM_ABS_DIFF(a, b) (__abs((a) - (b)))
-#define	KM_ABS_SUM(a, b) (__abs(a) + __abs(b))
-#define KM_BOOL_DIFF(a, b) (!(a) != !(b))
-#define KM_NO_DIVZERO_D64(a, b) (((b) == 0.0l)? 0.0l: (a) / (b))
-/* #define KM_NO_DIVZERO_D64(a, b) ((a) / (b)) */
-#define KM_NO_DIVZERO_I64(a, b) (((b) == 0ll)? 0ll: (a) / (b))
-#define KM_NO_DIVZERO_U64(a, b) (((b) == 0llu)? 0llu: (a) / (b))
-
-static inline cell_t
-calc_canberra (cell_t left, cell_t right, cell_mode_t mode)
+static void
+dm_tile_manhattan (dist_mat_t *mat, const dist_tile_t *tile, void *data)
 {
-    cell_t ret;
-    switch(mode) {
-        case U64:
-            ret.u = KM_NO_DIVZERO_U64(KM_ABS_DIFF(left.u, right.u),
-                    KM_ABS_SUM(left.u, right.u));
-            break;
-        case I64:
-            ret.i = KM_NO_DIVZERO_I64(KM_ABS_DIFF(left.i, right.i),
-                    KM_ABS_SUM(left.i, right.i));
-            break;
-        case D64:
-            ret.d = KM_NO_DIVZERO_D64(KM_ABS_DIFF(left.d, right.d),
-                    KM_ABS_SUM(left.d, right.d));
-            break;
-        default:
-            fprintf(stderr, "Bad switch value %i at %i in %s",
-                    mode, __LINE__, __FILE__);
-    }
-    return ret;
+    dist_block_t *blk = (dist_block_t *)data;
+    do_pairwise_tile(mat, blk->cells, blk->rows, normalize ? mat->scale : NULL,
+            tile, &calc_manhattan);
 }
 
-static inline cell_t
-calc_manhattan (cell_t left, cell_t right, cell_mode_t mode)
+static void
+dm_tile_manhattan_binary (dist_mat_t *mat, const dist_tile_t *tile,
+        void *data)
 {
-    cell_t ret;
-    switch(mode) {
-        case U64:
-            ret.u = KM_ABS_DIFF(left.u, right.u);
-            break;
-        case I64:
-            ret.i = KM_ABS_DIFF(left.i, right.i);
-            break;
-        case D64:
-            ret.d = KM_ABS_DIFF(left.d, right.d);
-            break;
-        default:
-            fprintf(stderr, "Bad switch value %i at %i in %s",
-                    mode, __LINE__, __FILE__);
-    }
-    return ret;
+    dist_block_t *blk = (dist_block_t *)data;
+    do_pairwise_tile(mat, blk->cells, blk->rows, normalize ? mat->scale : NULL,
+            tile, &calc_manhattan_binary);
 }
 
-static inline cell_t
-calc_manhattan_binary (cell_t left, cell_t right, cell_mode_t mode)
+/* Buffer for a pass's rows, as many as fit DM_BLOCK_BYTES */
+static void
+dm_block_alloc (arena_t *arena, dist_mat_t *mat, size_t count)
 {
-    cell_t ret;
-    switch(mode) {
-        case U64:
-            ret.u = KM_BOOL_DIFF((left.u > binary_cutoff.u),
-                    (right.u > binary_cutoff.u));
-            break;
-        case I64:
-            ret.i = KM_BOOL_DIFF((left.i > binary_cutoff.i),
-                    (right.i > binary_cutoff.i));
-            break;
-        case D64:
-            ret.d = KM_BOOL_DIFF((left.d > binary_cutoff.d),
-                    (right.d > binary_cutoff.d));
-            break;
+    dist_block_t *blk = arena_calloc(arena, 1, sizeof(*blk));
+    blk->cap = DM_BLOCK_BYTES / (count * sizeof(*blk->cells));
+    blk->cap = blk->cap < 16 ? 16 : blk->cap > 4096 ? 4096 : blk->cap;
+    blk->cells = arena_calloc(arena, blk->cap * count, sizeof(*blk->cells));
+    mat->block = blk;
+}
+
+/* Add the buffered rows to the matrix, tile by tile over every thread */
+static void
+dm_flush_tiles (table_t *tab, dist_mat_t *mat)
+{
+    narrow_batch_flush(mat, tab->threads);
+    if (mat->block != NULL && mat->block->rows > 0) {
+        distmat_run_tiles(mat, tab->threads, tile_fn, mat->block);
+        mat->block->rows = 0;
     }
-    return ret;
 }
 
 static inline void
-do_pairwise (void *data, cell_t *cells, size_t count, cell_mode_t mode,
+dm_pairwise (table_t *tab, dist_mat_t *mat, cell_t *cells, size_t count,
         cell_t (*calc)(cell_t, cell_t, cell_mode_t))
+{
+    size_t iii;
+    if (km_unlikely(mat->matrix == NULL)) {
+        if (normalize && mat->scale != NULL && mat->n_scale != count) {
+            fprintf(stderr, "%zu sample totals for %zu samples\n",
+                    mat->n_scale, count);
+            totals_failed = 1;
+        }
+        distmat_alloc(tab, mat, count);
+        if (normalize == DM_NORM_HELLINGER) {
+            /* Rows are square-rooted here; scaling happens in the kernel */
+            mat->row = arena_calloc(mat->arena != NULL ? mat->arena :
+                    table_arena(tab), count, sizeof(*mat->row));
+        }
+        if (narrow) {
+            mat->narrow = narrow_batch_new(mat->arena != NULL ? mat->arena :
+                    table_arena(tab), count, calc == &calc_manhattan_binary);
+        }
+        if (sparse) {
+            canberra_sparse_alloc(mat->arena != NULL ? mat->arena :
+                    table_arena(tab), mat, count);
+        }
+        if (tiles) {
+            dm_block_alloc(mat->arena != NULL ? mat->arena :
+                    table_arena(tab), mat, count);
+        }
+    }
+    if (mat->narrow != NULL && narrow_batch_add(mat->narrow, cells, count)) {
+        if (mat->narrow->rows == mat->narrow->cap) {
+            narrow_batch_flush(mat, tiles ? tab->threads : 1);
+        }
+        return;
+    }
+    if (!normalize && !tiles && !sparse) {
+        do_pairwise(mat, cells, count, tab->mode, calc);
+        return;
+    }
+    if (km_unlikely(normalize && (mat->scale == NULL || totals_failed))) {
+        return;
+    }
+    if (normalize == DM_NORM_HELLINGER) {
+        for (iii = 0; iii < count; iii++) {
+            mat->row[iii].d = sqrtl(cells[iii].d);
+        }
+        cells = mat->row;
+    }
+    if (sparse) {
+        canberra_sparse_row(mat, cells, count, normalize ? mat->scale : NULL);
+        return;
+    }
+    if (tiles) {
+        dist_block_t *blk = mat->block;
+        memcpy(blk->cells + blk->rows * count, cells, count * sizeof(*cells));
+        if (++blk->rows == blk->cap) {
+            dm_flush_tiles(tab, mat);
+        }
+        return;
+    }
+    do_pairwise_scaled(mat, cells, count, mat->scale, calc);
+}
+
+static void
+dm_canberra (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    dm_pairwise(tab, (dist_mat_t *)data, cells, count, &calc_canberra);
+}
+
+static void
+dm_manhattan (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    dm_pairwise(tab, (dist_mat_t *)data, cells, count, &calc_manhattan);
+}
+
+static void
+dm_manhattan_binary (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    dm_pairwise(tab, (dist_mat_t *)data, cells, count, &calc_manhattan_binary);
+}
+
+/* Each worker thread accumulates into a private matrix, summed at the end */
+static void *
+dm_partial_init (table_t *tab, void *data)
 {
     dist_mat_t *mat = (dist_mat_t *)data;
-    size_t aaa = 0, bbb = 0, iii = 0;
-    for (aaa = 0; aaa < count; aaa++) {
-        for (bbb = aaa + 1; bbb < count; bbb++) {
-            cell_t res = (*calc)(cells[aaa], cells[bbb], mode);
-            switch(mode) {
+    dist_mat_t *part = arena_calloc(table_arena(tab), 1, sizeof(*part));
+    part->first = mat->first;
+    part->budget = mat->budget;
+    part->arena = mat->arena;
+    part->scale = mat->scale;
+    part->n_scale = mat->n_scale;
+    return part;
+}
+
+static void
+dm_partial_merge (table_t *tab, void *data, void *partial)
+{
+    dist_mat_t *mat = (dist_mat_t *)data;
+    dist_mat_t *part = (dist_mat_t *)partial;
+    size_t iii;
+    narrow_batch_flush(part, 1);
+    if (part->matrix != NULL && mat->matrix == NULL) {
+        mat->samples = part->samples;
+        mat->pairs = part->pairs;
+        mat->last = part->last;
+        mat->matrix = part->matrix;
+        mat->nonzero = part->nonzero;
+        part->matrix = NULL;
+    } else if (part->matrix != NULL) {
+        for (iii = 0; part->nonzero != NULL && iii < mat->samples; iii++) {
+            mat->nonzero[iii] += part->nonzero[iii];
+        }
+        for (iii = 0; iii < mat->pairs; iii++) {
+            switch(tab->mode) {
                 case U64:
-                    mat->matrix[iii++].u += res.u;
+                    mat->matrix[iii].u += part->matrix[iii].u;
                     break;
                 case I64:
-                    mat->matrix[iii++].i += res.i;
+                    mat->matrix[iii].i += part->matrix[iii].i;
                     break;
                 case D64:
-                    mat->matrix[iii++].d += res.d;
+                    mat->matrix[iii].d += part->matrix[iii].d;
                     break;
             }
         }
     }
 }
 
-static inline void
-dm_canberra (table_t *tab, char *line, cell_t *cells, size_t count)
+/* Approximate mode: sketch the rows where each sample is non-zero */
+static void
+dm_sketch (table_t *tab, void *data, char *line, cell_t *cells, size_t count)
 {
-    dist_mat_t *mat = (dist_mat_t *)(tab->data);
-    assert(mat);
-    if (km_unlikely(mat->samples == 0)) {
-        mat->samples = count;
+    sketch_set_t *set = (sketch_set_t *)data;
+    uint64_t hash = 0;
+    size_t iii;
+    if (km_unlikely(set->hashes == NULL)) {
+        sketch_set_alloc(tab, set, count);
     }
-    if (km_unlikely(mat->pairs == 0)) {
-        mat->pairs = ((count * (count + 1)) / 2);
+    hash = sketch_row_hash(tab, line);
+    for (iii = 0; iii < count; iii++) {
+        if (cell_elem(cells[iii], tab->mode) != 0) {
+            sketch_add(set, iii, hash);
+        }
     }
-    if (km_unlikely(mat->matrix == NULL)) {
-        mat->matrix = km_calloc(mat->pairs, sizeof(*(mat->matrix)),
-                &km_onerr_print_exit);
-        for (size_t iii = 0; iii < mat->pairs; iii++)
-            mat->matrix[iii].d = 0.0l;
+}
+
+static void *
+dm_sketch_init (table_t *tab, void *data)
+{
+    sketch_set_t *set = arena_calloc(table_arena(tab), 1, sizeof(*set));
+    set->k = ((sketch_set_t *)data)->k;
+    return set;
+}
+
+static void
+dm_sketch_merge (table_t *tab, void *data, void *partial)
+{
+    sketch_set_t *set = (sketch_set_t *)data;
+    sketch_set_t *part = (sketch_set_t *)partial;
+    if (part->hashes == NULL) {
+        return;
+    }
+    if (set->hashes == NULL) {
+        *set = *part;
+    } else {
+        sketch_merge(set, part);
     }
-    do_pairwise(tab->data, cells, count, tab->mode, &calc_canberra);
 }
 
-static inline void
-dm_manhattan (table_t *tab, char *line, cell_t *cells, size_t count)
+/* Totals pass: sum each sample's parsed cells */
+static void
+dm_totals (table_t *tab, void *data, char *line, cell_t *cells, size_t count)
 {
-    dist_mat_t *mat = (dist_mat_t *)(tab->data);
-    if (km_unlikely(mat->samples == 0)) {
-        mat->samples = count;
+    dm_totals_t *tot = (dm_totals_t *)data;
+    size_t iii;
+    if (km_unlikely(tot->sums == NULL)) {
+        tot->n = count;
+        tot->sums = arena_calloc(table_arena(tab), count, sizeof(*tot->sums));
     }
-    if (km_unlikely(mat->pairs == 0)) {
-        mat->pairs = ((count * (count + 1)) / 2);
+    for (iii = 0; iii < count; iii++) {
+        tot->sums[iii] += cells[iii].d;
     }
-    if (km_unlikely(mat->matrix == NULL)) {
-        mat->matrix = km_calloc(mat->pairs, sizeof(*(mat->matrix)),
-                &km_onerr_print_exit);
+}
+
+/* Totals pass over unparsed rows: plain zeros, most cells of a count
+ * table, are skipped without converting them */
+static void
+dm_totals_lazy (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    dm_totals_t *tot = (dm_totals_t *)data;
+    row_cursor_t cur;
+    const char *tok = NULL;
+    size_t len = 0;
+    if (km_unlikely(tot->sums == NULL)) {
+        tot->n = count;
+        tot->sums = arena_calloc(table_arena(tab), count, sizeof(*tot->sums));
+    }
+    row_cursor_init(&cur, tab, line);
+    while ((tok = row_cursor_next(&cur, &len)) != NULL) {
+        size_t col = cur.cell - 1;
+        if (len == 1 && tok[0] == '0') continue;
+        if (tab->group_of != NULL) {
+            col = tab->group_of[col];
+        }
+        tot->sums[col] += strtold(tok, NULL);
     }
-    do_pairwise(tab->data, cells, count, tab->mode, &calc_manhattan);
 }
 
-static inline void
-dm_manhattan_binary (table_t *tab, char *line, cell_t *cells, size_t count)
+static void *
+dm_totals_init (table_t *tab, void *data)
+{
+    return arena_calloc(table_arena(tab), 1, sizeof(dm_totals_t));
+}
+
+static void
+dm_totals_merge (table_t *tab, void *data, void *partial)
 {
-    dist_mat_t *mat = (dist_mat_t *)(tab->data);
-    if (km_unlikely(mat->samples == 0)) {
-        mat->samples = count;
+    dm_totals_t *tot = (dm_totals_t *)data;
+    dm_totals_t *part = (dm_totals_t *)partial;
+    size_t iii;
+    if (part->sums == NULL) {
+        return;
     }
-    if (km_unlikely(mat->pairs == 0)) {
-        mat->pairs = ((count * (count + 1)) / 2);
+    if (tot->sums == NULL) {
+        *tot = *part;
+        return;
     }
-    if (km_unlikely(mat->matrix == NULL)) {
-        mat->matrix = km_calloc(mat->pairs, sizeof(*(mat->matrix)),
-                &km_onerr_print_exit);
+    for (iii = 0; iii < tot->n; iii++) {
+        tot->sums[iii] += part->sums[iii];
     }
-    do_pairwise(tab->data, cells, count, tab->mode, &calc_manhattan_binary);
 }
 
-void
-print_dist_mat (table_t *tab, dist_mat_t *mat)
+/* Per-sample factors from sample totals: 1/total for relative abundances,
+ * or 1/sqrt(total) for Hellinger, applied to square-rooted cells */
+static void
+dm_set_scale (table_t *tab, dist_mat_t *mat, const long double *sums,
+        size_t n)
 {
-    size_t rrr, ccc, iii=0;
-    for (rrr = 0; rrr < mat->samples; rrr++) {
-        if (rrr == 0) {
-            if (((dist_mat_t *)(tab->data))->sample_names != NULL) {
-                fprintf(tab->outfp, ".\t");
-                for (ccc = 0; ccc < mat->samples; ccc++) {
-                    fprintf(tab->outfp, "%s\t",
-                            ((dist_mat_t *)(tab->data))->sample_names[ccc]);
-                }
-                fprintf(tab->outfp, "\n");
-            }
+    size_t iii;
+    mat->scale = arena_calloc(table_arena(tab), n, sizeof(*mat->scale));
+    mat->n_scale = n;
+    for (iii = 0; iii < n; iii++) {
+        if (sums[iii] <= 0.0l) continue;
+        mat->scale[iii] = normalize == DM_NORM_HELLINGER ?
+            1.0l / sqrtl(sums[iii]) : 1.0l / sums[iii];
+    }
+}
+
+static int
+dm_total_cmp (const void *a, const void *b)
+{
+    return strcmp(((const dm_total_t *)a)->name,
+            ((const dm_total_t *)b)->name);
+}
+
+/* Read sample totals from tableStats output: a sample name and its sum
+ * leading each line, after a header */
+static int
+dm_load_totals (table_t *tab, const char *fname)
+{
+    FILE *fp = fopen(fname, "r");
+    char *line = NULL;
+    size_t size = 0, cap = 0;
+    ssize_t len = 0;
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n%s\n", fname,
+                strerror(errno));
+        return 0;
+    }
+    while ((len = km_readline_realloc(&line, fp, &size,
+                    &km_onerr_print_exit)) > 0) {
+        char *np = NULL;
+        char *name = strtok_r(line, "\t\r\n", &np);
+        char *sum = strtok_r(NULL, "\t\r\n", &np);
+        char *end = NULL;
+        long double total = 0.0l;
+        if (name == NULL || sum == NULL) continue;
+        total = strtold(sum, &end);
+        if (end == sum) {
+            if (n_totals == 0) continue;    /* The header */
+            fprintf(stderr, "Bad total '%s' for sample '%s'\n", sum, name);
+            break;
         }
-        if (((dist_mat_t *)(tab->data))->sample_names != NULL) {
-            fprintf(tab->outfp, "%s\t",
-                    ((dist_mat_t *)(tab->data))->sample_names[rrr]);
+        if (n_totals == cap) {
+            totals = arena_grow(table_arena(tab), totals,
+                    cap * sizeof(*totals),
+                    (cap > 0 ? 2 * cap : 64) * sizeof(*totals));
+            cap = cap > 0 ? 2 * cap : 64;
         }
-        for (ccc = 0; ccc < mat->samples; ccc++) {
-            if (rrr == ccc) fprintf(tab->outfp, "%Lf\t", 0.0l);
-            else if (ccc < rrr + 1) fprintf(tab->outfp, ".\t");
-            else fprintf(tab->outfp, "%Lf\t", mat->matrix[iii++].d);
+        totals[n_totals].name = arena_strdup(table_arena(tab), name);
+        totals[n_totals++].sum = total;
+    }
+    km_free(line);
+    fclose(fp);
+    if (len > 0 || n_totals == 0) {
+        fprintf(stderr, "No sample totals in '%s'\n", fname);
+        return 0;
+    }
+    return 1;
+}
+
+/* Match the samples named by the header to the sidecar's totals */
+static int
+dm_resolve_totals (table_t *tab, char **samples, size_t n)
+{
+    dist_mat_t *mat = (dist_mat_t *)tab->data;
+    dm_total_t *sorted = NULL;
+    long double *sums = NULL;
+    size_t iii;
+    if (totals == NULL) {
+        return 1;
+    }
+    sorted = km_calloc(n_totals, sizeof(*sorted), &km_onerr_print_exit);
+    memcpy(sorted, totals, n_totals * sizeof(*sorted));
+    qsort(sorted, n_totals, sizeof(*sorted), &dm_total_cmp);
+    sums = km_calloc(n > 0 ? n : 1, sizeof(*sums), &km_onerr_print_exit);
+    for (iii = 0; iii < n; iii++) {
+        dm_total_t key = {samples[iii], 0.0l};
+        dm_total_t *hit = bsearch(&key, sorted, n_totals, sizeof(*sorted),
+                &dm_total_cmp);
+        if (hit == NULL) {
+            fprintf(stderr, "No total for sample '%s'\n", samples[iii]);
+            totals_failed = 1;
+            break;
         }
-        fprintf(tab->outfp, "\n");
+        sums[iii] = hit->sum;
+    }
+    if (!totals_failed) {
+        dm_set_scale(tab, mat, sums, n);
     }
+    km_free(sorted);
+    km_free(sums);
+    return !totals_failed;
 }
 
+/* Sample names and the pointers to them share one arena allocation */
 int
 process_header (table_t *tab, char *line)
 {
+    size_t len = strlen(line) + 1;
     size_t col = 0;
     size_t sample = 0;
-    size_t n_alloced = 1<<4;
-    char **samples = km_calloc(n_alloced, sizeof(*samples),
-            &km_onerr_print_exit);
-    char *tok_line = strdup(line);
+    size_t n_samples = 0;
+    char **samples = NULL;
+    char *names = NULL;
     char *np = NULL;
-    char *tok = strtok_r(tok_line, tab->sep, &np);
-    do{
-        char *nl = NULL;
-        char *tok_cpy = NULL;
-        if (col++ < tab->skipcol) {
-            tok = strtok_r(NULL, tab->sep, &np);
-            continue;
-        }
-        if (sample + 1 >= n_alloced) {
-            size_t newsz = kmroundupz(n_alloced);
-            n_alloced = newsz;
-            samples = km_realloc(samples, n_alloced * sizeof(*samples),
-                    &km_onerr_print_exit);
-        }
-        tok_cpy = strdup(tok);
-        nl = strchr(tok_cpy, '\n');
-        if (nl != NULL) {
-            nl[0] = '\0';
-        }
-        samples[sample++] = tok_cpy;
+    char *tok = NULL;
+    char *nl = strchr(line, '\n');
+    if (tab->group_of != NULL) {
+        /* Collapsed samples are named after their groups */
+        ((dist_mat_t *)(tab->data))->sample_names = tab->group_names;
+        return dm_resolve_totals(tab, tab->group_names, tab->n_groups);
+    }
+    if (nl != NULL) {
+        len = nl - line + 1;
+    }
+    n_samples = count_columns(line, tab->sep, len - 1);
+    n_samples = n_samples > tab->skipcol ? n_samples - tab->skipcol : 0;
+    if (tab->columns != NULL && tab->n_columns < n_samples) {
+        n_samples = tab->n_columns;
+    }
+    samples = arena_alloc(table_arena(tab),
+            n_samples * sizeof(*samples) + len);
+    names = (char *)(samples + n_samples);
+    memcpy(names, line, len - 1);
+    names[len - 1] = '\0';
+    tok = strtok_r(names, tab->sep, &np);
+    while (tok != NULL && sample < n_samples) {
+        if (col++ >= tab->skipcol && (tab->columns == NULL ||
+                    tab->columns[sample] == col - 1 - tab->skipcol)) {
+            samples[sample++] = tok;
+        }
         tok = strtok_r(NULL, tab->sep, &np);
-    } while (tok != NULL);
-    km_free(tok_line);
+    }
     ((dist_mat_t *)(tab->data))->sample_names = samples;
+    return dm_resolve_totals(tab, samples, sample);
+}
+
+
+/* One pass building sketches, then distances computed as they are printed */
+static int
+calc_sketch_dist_of_table (table_t *tab)
+{
+    dist_mat_t *mat = arena_calloc(table_arena(tab), 1, sizeof(*mat));
+    sketch_set_t *set = arena_calloc(table_arena(tab), 1, sizeof(*set));
+    pipeline_t *pl = pipeline_new();
+    int res = 0;
+    set->k = sketch_k;
+    tab->data = mat;
+    tab->skipped_row_fn = &process_header;
+    /* Rows are keyed by their whole line if there are no key columns */
+    pl->need_lines = tab->skipcol > 0 ? 0 : 2;
+    pipeline_add_accumulate(pl, &dm_sketch, set, &dm_sketch_init,
+            &dm_sketch_merge);
+    res = pipeline_run(tab, pl);
+    destroy_pipeline_t(pl);
+    if (res != 0) {
+        return 0;
+    }
+    if (set->hashes != NULL) {
+        double start = tab->stats != NULL ? table_stats_now() : 0.0;
+        sketch_finish(set);
+        if (knn.k > 0) {
+            knn_set_alloc(tab, &knn, set->samples);
+            knn_add_sketches(&knn, set);
+            print_knn(tab, &knn);
+        } else if (edges) {
+            print_sketch_dist_edges(tab, set, knn.cutoff);
+        } else {
+            print_sketch_dist_mat(tab, set);
+        }
+        if (tab->stats != NULL) {
+            tab->stats->write_secs += table_stats_now() - start;
+        }
+    }
+    table_stats_finish(tab);
     return 1;
 }
 
+/* Print a finished band, or with --knn, add it to the neighbour lists,
+ * which are printed after the last band */
+static void
+dm_print_band (table_t *tab, dist_mat_t *mat)
+{
+    if (knn.k == 0 && edges) {
+        print_dist_edges(tab, mat, knn.cutoff);
+        return;
+    } else if (knn.k == 0) {
+        print_dist_mat(tab, mat);
+        return;
+    }
+    if (mat->matrix == NULL) {
+        return;
+    }
+    if (knn.heaps == NULL) {
+        knn_set_alloc(tab, &knn, mat->samples);
+    }
+    knn_add_band(&knn, mat);
+    if (mat->last >= mat->samples) {
+        print_knn(tab, &knn);
+    }
+}
+
+/* A first pass for each sample's total. Regular files are read lazily, then
+ * from origin again; anything else is parsed, and its cells cached. */
+static int
+dm_column_totals (table_t *tab, dist_mat_t *mat, FILE *cache, off_t origin)
+{
+    dm_totals_t *tot = arena_calloc(table_arena(tab), 1, sizeof(*tot));
+    pipeline_t *pl = pipeline_new();
+    int res = 0;
+    if (cache != NULL) {
+        pl->cache_out = cache;
+        pipeline_add_accumulate(pl, &dm_totals, tot, &dm_totals_init,
+                &dm_totals_merge);
+    } else {
+        pl->lazy = 1;
+        pipeline_add_accumulate(pl, &dm_totals_lazy, tot, &dm_totals_init,
+                &dm_totals_merge);
+    }
+    table_stats_pass(tab);
+    res = pipeline_run(tab, pl);
+    destroy_pipeline_t(pl);
+    if (res != 0) {
+        return 0;
+    }
+    dm_set_scale(tab, mat, tot->sums, tot->n);
+    tab->rows = 0;
+    if (cache != NULL) {
+        if (fflush(cache) != 0) {
+            return 0;
+        }
+        rewind(cache);
+    } else {
+        if (fseeko(tab->fp, origin, SEEK_SET) != 0) {
+            return 0;
+        }
+        /* Samples were named on this pass */
+        tab->skipped_row_fn = NULL;
+    }
+    return 1;
+}
 
+/* Passes over the table in all, once the number of samples is known */
+static unsigned
+dm_passes (dist_mat_t *mat, int totals_pass)
+{
+    size_t samples = mat->samples > 0 ? mat->samples : mat->n_scale;
+    if (samples == 0) {
+        return 0;
+    }
+    return (totals_pass ? 1 : 0) + distmat_bands(samples, mat->budget);
+}
+
+/*
+ * With --mem-limit, the matrix is built one band of rows at a time, each
+ * band being printed as soon as it is complete. Every band needs another
+ * pass over the table: regular files are re-read from where the first pass
+ * started, anything else (e.g. a pipe) is parsed once and its cells cached
+ * in a temporary file for the later passes.
+ */
 int
 calc_dist_matrix_of_table(table_t *tab)
 {
-    dist_mat_t *mat = km_calloc(1, sizeof(*mat), &km_onerr_print_exit);
+    dist_mat_t *mat = NULL;
+    pipeline_t *pl = NULL;
+    FILE *cache = NULL;
+    off_t origin = -1;
+    struct stat st;
+    size_t iii;
+    int multipass = 0;
+    int res = 0;
+    if (sketch_k > 0) {
+        return calc_sketch_dist_of_table(tab);
+    }
+    mat = arena_calloc(table_arena(tab), 1, sizeof(*mat));
+    pl = pipeline_new();
     tab->data = mat;
     tab->skipped_row_fn = &process_header;
-    iter_table(tab);
-    print_dist_mat(tab, mat);
+    /* Progress is then reported pass by pass */
+    multipass = tab->stats != NULL && (mem_limit > 0 ||
+            (normalize && totals == NULL));
+    if (mem_limit > 0 || (normalize && totals == NULL)) {
+        if (fstat(fileno(tab->fp), &st) == 0 && S_ISREG(st.st_mode)) {
+            origin = ftello(tab->fp);
+        }
+        if (origin < 0) {
+            cache = tmpfile();
+            if (cache == NULL) {
+                fprintf(stderr, "Could not create cell cache\n%s\n",
+                        strerror(errno));
+                destroy_pipeline_t(pl);
+                return 0;
+            }
+            pl->cache_out = cache;
+        }
+    }
+    if (mem_limit > 0) {
+        /* Every worker holds a partial band, unless they share tiles */
+        mat->budget = mem_limit / (tab->threads > 1 && !tiles ?
+                tab->threads : 1);
+    }
+    if (normalize && totals == NULL) {
+        if (!dm_column_totals(tab, mat, cache, origin)) {
+            destroy_pipeline_t(pl);
+            if (cache != NULL) {
+                fclose(cache);
+            }
+            return 0;
+        }
+        if (cache != NULL) {
+            pl->cache_out = NULL;
+            pl->cache_in = cache;
+        }
+    } else if (normalize && tab->skiprow == 0) {
+        /* Without a header, totals are taken in order */
+        long double *sums = arena_calloc(table_arena(tab), n_totals,
+                sizeof(*sums));
+        for (iii = 0; iii < n_totals; iii++) {
+            sums[iii] = totals[iii].sum;
+        }
+        dm_set_scale(tab, mat, sums, n_totals);
+    }
+    if (tiles) {
+        /* Rows are parsed in turn; threads share each block's tiles */
+        pipeline_add_accumulate(pl, dist_fn, mat, NULL, NULL);
+    } else {
+        pipeline_add_accumulate(pl, dist_fn, mat, &dm_partial_init,
+                &dm_partial_merge);
+    }
+    while (1) {
+        mat->arena = arena_new(0);
+        if (multipass) {
+            table_stats_pass(tab);
+            tab->stats->passes = dm_passes(mat, normalize && totals == NULL);
+        }
+        res = pipeline_run(tab, pl);
+        if (res != 0 || totals_failed) {
+            destroy_arena_t(mat->arena);
+            res = -1;
+            break;
+        }
+        if (multipass) {
+            tab->stats->passes = dm_passes(mat, normalize && totals == NULL);
+        }
+        /* A single worker's last rows may still be held */
+        if (tiles) {
+            dm_flush_tiles(tab, mat);
+        } else {
+            narrow_batch_flush(mat, 1);
+        }
+        canberra_sparse_finish(mat);
+        if (tab->stats != NULL) {
+            double start = table_stats_now();
+            dm_print_band(tab, mat);
+            tab->stats->write_secs += table_stats_now() - start;
+        } else {
+            dm_print_band(tab, mat);
+        }
+        destroy_arena_t(mat->arena);
+        if (mat->matrix == NULL || mat->last >= mat->samples) {
+            break;
+        }
+        /* Set up the next band's pass */
+        mat->matrix = NULL;
+        mat->row = NULL;
+        mat->narrow = NULL;
+        mat->block = NULL;
+        mat->nonzero = NULL;
+        mat->first = mat->last;
+        tab->rows = 0;
+        if (cache != NULL) {
+            if (fflush(cache) != 0) {
+                res = -1;
+                break;
+            }
+            rewind(cache);
+            pl->cache_out = NULL;
+            pl->cache_in = cache;
+        } else {
+            if (fseeko(tab->fp, origin, SEEK_SET) != 0) {
+                res = -1;
+                break;
+            }
+            tab->skipped_row_fn = NULL;
+        }
+    }
+    mat->arena = NULL;
+    mat->matrix = NULL;
+    mat->row = NULL;
+    mat->narrow = NULL;
+    mat->block = NULL;
+    mat->nonzero = NULL;
+    destroy_pipeline_t(pl);
+    if (cache != NULL) {
+        fclose(cache);
+    }
+    if (res != 0) {
+        return 0;
+    }
+    table_stats_finish(tab);
     return 1;
 }
 
@@ -299,7 +791,7 @@ print_usage()
     fprintf(stderr, "tableDist\n\n");
     fprintf(stderr, "Calculate a distance matrix between columns in a table.\n\n");
     fprintf(stderr, "USAGE:\n\n");
-    fprintf(stderr, "tableDist [-r ROWS -c COLS -i INFILE -o OUTFILE -s SEP] -C | -m | -M CUTOFF\n");
+    fprintf(stderr, "tableDist [-r ROWS -c COLS -i INFILE -o OUTFILE -s SEP -t THREADS --columns=LIST --samples=NAMES --io=MODE --range=ROWS --collapse=GROUPS --normalize=MODE --totals=FILE --narrow --tiles --sparse --knn=K --cutoff=D --progress --stats --hugepages=MODE --mem-limit=SIZE] -C | -m | -M CUTOFF | --sketch[=K]\n");
     fprintf(stderr, "tableDist -h\n\n");
     fprintf(stderr, "OPTIONS:\n");
     fprintf(stderr, "\t-C | -m | -M\t Use Canberra, Manhattan or Binary Manhattan distance measures.\n");
@@ -308,6 +800,50 @@ print_usage()
     fprintf(stderr, "\t-s SEP\t\tUse string SEP as field seperator, not \"\\t\".\n");
     fprintf(stderr, "\t-i INFILE\tInput from INFILE, not stdin (or '-' for stdin).\n");
     fprintf(stderr, "\t-o OUTFILE\tOutput to OUTFILE, not stdout (or '-' for stdout).\n");
+    fprintf(stderr, "\t-t THREADS\tUse THREADS worker threads (default 1).\n");
+    fprintf(stderr, "\t--columns=LIST\tOnly use the data columns in LIST, e.g. 1,4-6,\n");
+    fprintf(stderr, "\t\t\tcounted from 1 after the COLS skipped by -c.\n");
+    fprintf(stderr, "\t--samples=NAMES\tOnly use the samples named in NAMES, a comma-separated\n");
+    fprintf(stderr, "\t\t\tlist or @FILE with one name per line, as found in the\n");
+    fprintf(stderr, "\t\t\theader (the last row skipped by -r).\n");
+    fprintf(stderr, "\t--normalize=MODE\tDivide each sample's cells by its total ('relative'),\n");
+    fprintf(stderr, "\t\t\tor take the square root of that ('hellinger'), before\n");
+    fprintf(stderr, "\t\t\tcomputing distances. Totals take a first pass, unless\n");
+    fprintf(stderr, "\t\t\tgiven by --totals.\n");
+    fprintf(stderr, "\t--totals=FILE\tRead sample totals from FILE, the output of tableStats\n");
+    fprintf(stderr, "\t\t\ton the same table and samples.\n");
+    fprintf(stderr, "\t--narrow\tWith -m or -M, hold rows of counts below 2^32 in batches\n");
+    fprintf(stderr, "\t\t\tof 1, 2 or 4 bytes per cell, as narrow as fits, for\n");
+    fprintf(stderr, "\t\t\tfaster, still exact, kernels. Other rows are as usual.\n");
+    fprintf(stderr, "\t--sparse\tWith -C, only compare the non-zero cells of each row,\n");
+    fprintf(stderr, "\t\t\tin double precision: distances are within rows * 1e-15.\n");
+    fprintf(stderr, "\t--tiles\tWith THREADS, share one matrix, buffering blocks of rows\n");
+    fprintf(stderr, "\t\t\tand splitting each block's pairs into tiles between\n");
+    fprintf(stderr, "\t\t\tthreads, rather than giving each thread its own matrix.\n");
+    fprintf(stderr, "\t\t\tBetter for many samples and few rows.\n");
+    fprintf(stderr, "\t--knn=K\t\tPrint each sample's K nearest samples, as lines of sample,\n");
+    fprintf(stderr, "\t\t\tneighbour and distance, not the matrix.\n");
+    fprintf(stderr, "\t--cutoff=D\tOnly print distances below D. Alone, prints every pair\n");
+    fprintf(stderr, "\t\t\tcloser than D once, as with --knn; with --knn, limits the\n");
+    fprintf(stderr, "\t\t\tneighbours to those closer than D.\n");
+    fprintf(stderr, "\t--collapse=GROUPS\tSum samples into groups before computing distances,\n");
+    fprintf(stderr, "\t\t\tgiven as 'G1=S1,S2;G2=S3,S4' or @FILE with a sample and its\n");
+    fprintf(stderr, "\t\t\tgroup per line, named as in the header. Other samples are\n");
+    fprintf(stderr, "\t\t\tkept as they are; distances are between groups.\n");
+    fprintf(stderr, "\t--io=MODE\tRead input with a read-ahead 'thread' (default) or in\n");
+    fprintf(stderr, "\t\t\t'sync' with parsing.\n");
+    fprintf(stderr, "\t--range=ROWS\tOnly use data rows ROWS, e.g. 1001-2000 or 1001+1000,\n");
+    fprintf(stderr, "\t\t\tcounted from 1. Uses INFILE" TABLE_INDEX_SUFFIX " from tableIndex if present.\n");
+    fprintf(stderr, "\t--progress\tReport progress and throughput to stderr.\n");
+    fprintf(stderr, "\t--stats\t\tPrint a JSON run summary to stderr when done.\n");
+    fprintf(stderr, "\t--hugepages=MODE\tBack the distance matrix with 'thp' (transparent)\n");
+    fprintf(stderr, "\t\t\tor 'hugetlb' (reserved) huge pages, or 'none'.\n");
+    fprintf(stderr, "\t--mem-limit=SIZE\tHold at most SIZE bytes (e.g. 512M, 4G) of\n");
+    fprintf(stderr, "\t\t\tmatrix at once, making several passes over the table.\n");
+    fprintf(stderr, "\t--sketch[=K]\tApproximate Jaccard distances between the sets of rows\n");
+    fprintf(stderr, "\t\t\twhere samples are non-zero, from bottom-K MinHash sketches\n");
+    fprintf(stderr, "\t\t\tin one pass (default K=256). Rows are identified by their\n");
+    fprintf(stderr, "\t\t\tskipped columns. Standard error is at most 1/(2*sqrt(K)).\n");
     fprintf(stderr, "\t-h \t\tPrint this help message.\n");
 }
 
@@ -315,33 +851,59 @@ int
 parse_args (int argc, char *argv[], table_t *tab)
 {
     unsigned char haveflags = 0;
+    knn.cutoff = HUGE_VALL;
     /*
         1 1 1 1 1 1 1 1
-            | | | | | \- method
-            | | | | \--- out fname
-            | | | \----- in fname
-            | | \------- cols to skip
-            | \--------- rows to skip
-            \----------- Field sep
+          | | | | | | \- method
+          | | | | | \--- out fname
+          | | | | \----- in fname
+          | | | \------- cols to skip
+          | | \--------- rows to skip
+          | \----------- Field sep
+          \------------- threads
     */
-    char c = '\0';
-    while((c = getopt(argc, argv, "mCM:r:c:o:i:s:h")) >= 0) {
+    static struct option long_opts[] = {
+        {"progress", no_argument, NULL, OPT_PROGRESS},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"hugepages", required_argument, NULL, OPT_HUGEPAGES},
+        {"mem-limit", required_argument, NULL, OPT_MEMLIMIT},
+        {"sketch", optional_argument, NULL, OPT_SKETCH},
+        {"columns", required_argument, NULL, OPT_COLUMNS},
+        {"samples", required_argument, NULL, OPT_SAMPLES},
+        {"io", required_argument, NULL, OPT_IO},
+        {"range", required_argument, NULL, OPT_RANGE},
+        {"collapse", required_argument, NULL, OPT_COLLAPSE},
+        {"normalize", required_argument, NULL, OPT_NORMALIZE},
+        {"totals", required_argument, NULL, OPT_TOTALS},
+        {"narrow", no_argument, NULL, OPT_NARROW},
+        {"tiles", no_argument, NULL, OPT_TILES},
+        {"sparse", no_argument, NULL, OPT_SPARSE},
+        {"knn", required_argument, NULL, OPT_KNN},
+        {"cutoff", required_argument, NULL, OPT_CUTOFF},
+        {NULL, 0, NULL, 0}
+    };
+    char *end = NULL;
+    int c = 0;
+    while((c = getopt_long(argc, argv, "mCM:r:c:o:i:s:t:h", long_opts, NULL)) >= 0) {
         switch (c) {
             case 'm':
                 haveflags |= 1;
-                tab->row_fn = &dm_manhattan;
+                dist_fn = &dm_manhattan;
+                tile_fn = &dm_tile_manhattan;
                 tab->mode = D64;
                 break;
             case 'M':
                 haveflags |= 1;
-                tab->row_fn = &dm_manhattan_binary;
+                dist_fn = &dm_manhattan_binary;
+                tile_fn = &dm_tile_manhattan_binary;
                 tab->mode = D64;
                 binary_cutoff.d = strtold(optarg, NULL);
                 break;
             case 'C':
                 haveflags |= 1;
                 tab->mode = D64;
-                tab->row_fn = &dm_canberra;
+                dist_fn = &dm_canberra;
+                tile_fn = &dm_tile_canberra;
                 break;
             case 'o':
                 haveflags |= 2;
@@ -363,9 +925,112 @@ parse_args (int argc, char *argv[], table_t *tab)
                 haveflags |= 32;
                 tab->sep = strdup(optarg);
                 break;
+            case 't':
+                haveflags |= 64;
+                tab->threads = atoi(optarg);
+                break;
+            case OPT_PROGRESS:
+            case OPT_STATS:
+                if (tab->stats == NULL) {
+                    table_stats_new(tab);
+                }
+                if (c == OPT_PROGRESS) tab->stats->progress = 1;
+                else tab->stats->summary = 1;
+                break;
+            case OPT_HUGEPAGES:
+                if (!arena_pages_from_str(&tab->pages, optarg)) {
+                    fprintf(stderr, "Unknown huge page mode '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_MEMLIMIT:
+                if (!strtosize(optarg, &mem_limit)) {
+                    fprintf(stderr, "Bad memory limit '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_SKETCH:
+                haveflags |= 1;
+                sketch_k = optarg != NULL ? strtoul(optarg, NULL, 10) :
+                        SKETCH_DEFAULT_K;
+                if (sketch_k == 0) {
+                    fprintf(stderr, "Bad sketch size '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_COLUMNS:
+                if (!table_select_columns(tab, optarg)) {
+                    fprintf(stderr, "Bad column list '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_IO:
+                if (!reader_mode_from_str(&tab->io, optarg)) {
+                    fprintf(stderr, "Unknown input mode '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_SAMPLES:
+                if (!table_select_names(tab, optarg)) {
+                    fprintf(stderr, "No samples in '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_RANGE:
+                if (!table_select_range(tab, optarg)) {
+                    fprintf(stderr, "Bad row range '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_COLLAPSE:
+                if (!table_collapse_columns(tab, optarg)) {
+                    fprintf(stderr, "Bad sample groups '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_NORMALIZE:
+                if (strcmp(optarg, "relative") == 0) {
+                    normalize = DM_NORM_RELATIVE;
+                } else if (strcmp(optarg, "hellinger") == 0) {
+                    normalize = DM_NORM_HELLINGER;
+                } else {
+                    fprintf(stderr, "Unknown normalisation '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_TOTALS:
+                if (!dm_load_totals(tab, optarg)) {
+                    return 0;
+                }
+                break;
+            case OPT_NARROW:
+                narrow = 1;
+                break;
+            case OPT_TILES:
+                tiles = 1;
+                break;
+            case OPT_SPARSE:
+                sparse = 1;
+                break;
+            case OPT_KNN:
+                knn.k = strtoul(optarg, NULL, 10);
+                if (knn.k == 0) {
+                    fprintf(stderr, "Bad neighbour count '%s'\n", optarg);
+                    return 0;
+                }
+                edges = 1;
+                break;
+            case OPT_CUTOFF:
+                knn.cutoff = strtold(optarg, &end);
+                if (end == optarg || *end != '\0') {
+                    fprintf(stderr, "Bad distance cutoff '%s'\n", optarg);
+                    return 0;
+                }
+                edges = 1;
+                break;
             case 'h':
                 print_usage();
-                destroy_distmat_table_t(tab);
+                destroy_table_t(tab);
                 exit(EXIT_SUCCESS);
         }
     }
@@ -386,6 +1051,10 @@ parse_args (int argc, char *argv[], table_t *tab)
                 strerror(errno));
         return 0;
     }
+    if (tab->range_first > 0) {
+        /* Jump to the range with the table's index, if it has one */
+        table_index_open(tab, NULL);
+    }
     /* Setup output fp */
     if ((!(haveflags & 2)) || tab->outfname == NULL || \
             strncmp(tab->outfname, "-", 1) == 0) {
@@ -404,6 +1073,26 @@ parse_args (int argc, char *argv[], table_t *tab)
         fprintf(stderr, "[parse_args] Required arguments missing\n");
         return 0;
     }
+    if (normalize && sketch_k > 0) {
+        fprintf(stderr, "[parse_args] Sketches can't be normalised\n");
+        return 0;
+    }
+    if (narrow && (normalize || sketch_k > 0 || dist_fn == &dm_canberra)) {
+        fprintf(stderr, "[parse_args] --narrow needs -m or -M, unnormalised\n");
+        return 0;
+    }
+    if (sparse && (dist_fn != &dm_canberra || sketch_k > 0 || tiles)) {
+        fprintf(stderr, "[parse_args] --sparse needs -C, without --tiles\n");
+        return 0;
+    }
+    if (tiles && sketch_k > 0) {
+        fprintf(stderr, "[parse_args] Sketches aren't built in tiles\n");
+        return 0;
+    }
+    if (totals != NULL && !normalize) {
+        fprintf(stderr, "[parse_args] --totals needs --normalize\n");
+        return 0;
+    }
     return 1; /* Successful */
 }
 
@@ -426,16 +1115,16 @@ main (int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
     if (!parse_args(argc, argv, tab)) {
-        destroy_distmat_table_t(tab);
+        destroy_table_t(tab);
         fprintf(stderr, "Cannot parse arguments.\n");
         print_usage();
         exit(EXIT_FAILURE);
     }
     if (!calc_dist_matrix_of_table(tab)) {
-        destroy_distmat_table_t(tab);
+        destroy_table_t(tab);
         fprintf(stderr, "Error during distance matrix calculation.\n");
         exit(EXIT_FAILURE);
     }
-    destroy_distmat_table_t(tab);
+    destroy_table_t(tab);
     return EXIT_SUCCESS;
 } /* ----------  end of function main  ---------- */
@@ -22,63 +22,291 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <inttypes.h>
 
 #include "kdm.h"
 #include "ktable.h"
+#include "kpipeline.h"
+#include "kexpr.h"
+#include "kkeyset.h"
+
+/* Long options without a short equivalent */
+#define OPT_PROGRESS 256
+#define OPT_STATS 257
+#define OPT_COLUMNS 258
+#define OPT_SAMPLES 259
+#define OPT_IO 260
+#define OPT_RANGE 261
+#define OPT_KEEP_KEYS 262
+#define OPT_DROP_KEYS 263
+#define OPT_BLOOM 264
+#define OPT_COLLAPSE 265
+#define OPT_ANNOTATE 266
+
+/* Output of --annotate */
+#define FT_ANNOTATE_TEXT 1
+#define FT_ANNOTATE_BINARY 2
 
 typedef struct _ft {
     cell_t threshold;
+    stage_filter_fn filter;
+    expr_t *expr;
+    const char *expr_src;
+    keyset_t *keys;
+    const char *keys_src;
+    int drop_keys;
+    double bloom_fpr;
+    int annotate;
+    size_t header_rows;
 } ft_t;
 
-static inline void
-ft_median (table_t *tab, char *line, cell_t *cells, size_t count)
+/* A binary annotation: nonzero, sum, min, max, median and mean, each in 8
+ * bytes, with cells as integers or doubles as the table's cells are */
+typedef union _ft_word {
+    uint64_t u;
+    int64_t i;
+    double d;
+} ft_word_t;
+
+#define FT_ANNOTATION_WORDS 6
+
+/* Each worker's filters get the options and their own scratch space, from
+ * the table's arena */
+typedef struct _ft_local {
+    ft_t *ft;
+    scratch_t scratch;
+} ft_local_t;
+
+static void *
+ft_local_init (table_t *tab, void *data)
 {
-    cell_t med = median(cells, count, tab->mode);
+    ft_local_t *local = arena_calloc(table_arena(tab), 1, sizeof(*local));
+    local->ft = (ft_t *)data;
+    local->scratch.arena = table_arena(tab);
+    return local;
+}
+
+/* Collapsed rows are printed from their cells, which median() reorders, so
+ * it is given a copy */
+static int
+ft_median (table_t *tab, void *data, char *line, cell_t *cells, size_t count)
+{
+    ft_local_t *local = (ft_local_t *)data;
+    ft_t *ft = local->ft;
+    cell_t med;
+    if (tab->collapse != NULL) {
+        cell_t *copy = scratch_reserve(&local->scratch,
+                count * sizeof(*cells));
+        memcpy(copy, cells, count * sizeof(*cells));
+        cells = copy;
+    }
+    med = median(cells, count, tab->mode);
     switch(tab->mode) {
         case U64:
-            if (med.u >= ((ft_t *)tab->data)->threshold.u) fprintf(tab->outfp, "%s", line);
+            return med.u >= ft->threshold.u;
+        case I64:
+            return med.i >= ft->threshold.i;
+        case D64:
+            return med.d >= ft->threshold.d;
+    }
+    return 0;
+}
+
+/* Runs lazily: tokens are only converted when they are not plainly zero
+ * or non-zero, and the row is abandoned once it has enough non-zeros */
+static int
+ft_num_nonzero (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    ft_t *ft = (ft_t *)data;
+    row_cursor_t cur;
+    const char *tok = NULL;
+    size_t len = 0;
+    size_t passes = 0;
+    row_cursor_init(&cur, tab, line);
+    while (passes < ft->threshold.u &&
+            (tok = row_cursor_next(&cur, &len)) != NULL) {
+        if (token_is_positive(tab, tok, len)) passes++;
+    }
+    return passes >= ft->threshold.u;
+}
+
+/* As ft_num_nonzero, on the cells of a collapsed row */
+static int
+ft_num_nonzero_cells (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    ft_t *ft = (ft_t *)data;
+    size_t passes = 0;
+    size_t iii;
+    for (iii = 0; iii < count && passes < ft->threshold.u; iii++) {
+        switch (tab->mode) {
+            case U64:
+                passes += cells[iii].u > 0;
+                break;
+            case I64:
+                passes += cells[iii].i > 0;
+                break;
+            case D64:
+                passes += cells[iii].d > 0.0;
+                break;
+        }
+    }
+    return passes >= ft->threshold.u;
+}
+
+static int
+ft_expr (table_t *tab, void *data, char *line, cell_t *cells, size_t count)
+{
+    ft_local_t *local = (ft_local_t *)data;
+    return expr_eval(local->ft->expr, cells, count, tab->mode,
+            &local->scratch);
+}
+
+/* Runs before the row is parsed, so dropped rows are never parsed */
+static int
+ft_key (table_t *tab, void *data, char *line, cell_t *cells, size_t count)
+{
+    ft_t *ft = (ft_t *)data;
+    return keyset_has_row(ft->keys, tab, line) != ft->drop_keys;
+}
+
+static void
+ft_print_line (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    fprintf(tab->outfp, "%s", line);
+}
+
+static void
+ft_print_cell (table_t *tab, cell_t cell)
+{
+    switch (tab->mode) {
+        case U64:
+            fprintf(tab->outfp, "%"PRIu64, cell.u);
             break;
         case I64:
-            if (med.i >= ((ft_t *)tab->data)->threshold.i) fprintf(tab->outfp, "%s", line);
+            fprintf(tab->outfp, "%"PRId64, cell.i);
             break;
         case D64:
-            if (med.d >= ((ft_t *)tab->data)->threshold.d) fprintf(tab->outfp, "%s", line);
+            fprintf(tab->outfp, "%.17Lg", cell.d);
             break;
     }
 }
 
-static inline void
-ft_num_nonzero (table_t *tab, char *line, cell_t *cells, size_t count)
+/* Collapsed rows are printed from their cells, after the row's key */
+static void
+ft_print_cells (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
 {
-    size_t iii = 0;
-    size_t passes = 0;
-    switch(tab->mode) {
+    size_t key_len = 0;
+    const char *key = table_row_key(tab, line, &key_len);
+    size_t iii;
+    if (tab->skipcol > 0) {
+        fwrite(key, 1, key_len, tab->outfp);
+    }
+    for (iii = 0; iii < count; iii++) {
+        if (iii > 0 || tab->skipcol > 0) {
+            fputs(tab->sep, tab->outfp);
+        }
+        ft_print_cell(tab, cells[iii]);
+    }
+    fputc('\n', tab->outfp);
+}
+
+static ft_word_t
+ft_cell_word (table_t *tab, cell_t cell)
+{
+    ft_word_t word;
+    switch (tab->mode) {
         case U64:
-            while ((iii < count) && (passes < ((ft_t *)tab->data)->threshold.u)) {
-                if (cells[iii++].u > 0ull) passes++;
-            }
-            if (passes >= ((ft_t *)tab->data)->threshold.u) fprintf(tab->outfp, "%s", line);
+            word.u = cell.u;
             break;
         case I64:
-            while ((iii < count) && (passes < ((ft_t *)tab->data)->threshold.i)) {
-                if (cells[iii++].i > 0ll) passes++;
-            }
-            if (passes >= ((ft_t *)tab->data)->threshold.i) fprintf(tab->outfp, "%s", line);
+            word.i = cell.i;
             break;
         case D64:
-            while ((iii < count) && (passes < ((ft_t *)tab->data)->threshold.d)) {
-                if (cells[iii++].d > 0.0L) passes++;
-            }
-            if (passes >= ((ft_t *)tab->data)->threshold.d) fprintf(tab->outfp, "%s", line);
+            word.d = (double)cell.d;
             break;
     }
+    return word;
+}
+
+/* Print a row's statistics in place of the row. Its cells are done with,
+ * so median() may reorder them. */
+static void
+ft_print_annotation (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    ft_t *ft = (ft_t *)data;
+    row_summary_t sum;
+    row_summary(cells, count, tab->mode, &sum);
+    if (ft->annotate == FT_ANNOTATE_BINARY) {
+        ft_word_t rec[FT_ANNOTATION_WORDS];
+        rec[0].u = sum.nonzero;
+        rec[1] = ft_cell_word(tab, sum.sum);
+        rec[2] = ft_cell_word(tab, sum.min);
+        rec[3] = ft_cell_word(tab, sum.max);
+        rec[4] = ft_cell_word(tab, sum.median);
+        rec[5].d = sum.mean;
+        fwrite(rec, sizeof(*rec), FT_ANNOTATION_WORDS, tab->outfp);
+        return;
+    }
+    if (tab->skipcol > 0) {
+        size_t key_len = 0;
+        const char *key = table_row_key(tab, line, &key_len);
+        fwrite(key, 1, key_len, tab->outfp);
+        fputs(tab->sep, tab->outfp);
+    }
+    fprintf(tab->outfp, "%"PRIu64"%s", sum.nonzero, tab->sep);
+    ft_print_cell(tab, sum.sum);
+    fputs(tab->sep, tab->outfp);
+    ft_print_cell(tab, sum.min);
+    fputs(tab->sep, tab->outfp);
+    ft_print_cell(tab, sum.max);
+    fputs(tab->sep, tab->outfp);
+    ft_print_cell(tab, sum.median);
+    /* As tableStats, enough digits for the data but not its rounding */
+    fprintf(tab->outfp, "%s%.15g\n", tab->sep, sum.mean);
 }
 
 int
 filter_table(table_t *tab)
 {
-    iter_table(tab);
-    return 1;
+    ft_t *ft = (ft_t *)tab->data;
+    pipeline_t *pl = pipeline_new();
+    stage_filter_fn filter = ft->filter;
+    int res = 0;
+    if ((tab->collapse != NULL || ft->annotate) &&
+            filter == &ft_num_nonzero) {
+        filter = &ft_num_nonzero_cells;
+    }
+    if (ft->keys != NULL) {
+        pipeline_add_line_filter(pl, &ft_key, ft);
+    }
+    if (filter == &ft_median || filter == &ft_expr) {
+        pipeline_add_filter_local(pl, filter, ft, &ft_local_init);
+    } else if (filter != NULL) {
+        pipeline_add_filter(pl, filter, ft);
+    }
+    if (ft->annotate) {
+        /* Rows are summarised from their cells; lines are only needed for
+         * their keys */
+        pipeline_add_sink(pl, &ft_print_annotation, ft);
+    } else if (tab->collapse != NULL) {
+        /* Rows are summed into groups, so must be parsed, and are printed
+         * from their keys and cells */
+        pipeline_add_sink(pl, &ft_print_cells, NULL);
+    } else {
+        /* Without a filter on cells, rows need not be parsed at all */
+        pl->lazy = ft->filter == NULL || ft->filter == &ft_num_nonzero;
+        pl->need_lines = 1;
+        pipeline_add_sink(pl, &ft_print_line, NULL);
+    }
+    res = pipeline_run(tab, pl);
+    destroy_pipeline_t(pl);
+    table_stats_finish(tab);
+    return res == 0;
 }
 
 void
@@ -87,23 +315,89 @@ print_usage()
     fprintf(stderr, "filterTable\n\n");
     fprintf(stderr, "Filter a large table row-wise.\n\n");
     fprintf(stderr, "USAGE:\n\n");
-    fprintf(stderr, "filterTable [-r ROWS -c COLS -i INFILE -o OUTFILE -s SEP] -m | -z THRESH\n");
+    fprintf(stderr, "filterTable [-r ROWS -c COLS -i INFILE -o OUTFILE -s SEP -t THREADS --columns=LIST --samples=NAMES --io=MODE --range=ROWS --collapse=GROUPS --bloom[=FPR] --progress --stats -g NAME=LIST] -m THRESH | -z THRESH | -e EXPR | --keep-keys=KEYS | --drop-keys=KEYS | --annotate[=FORMAT]\n");
     fprintf(stderr, "filterTable -h\n\n");
     fprintf(stderr, "OPTIONS:\n");
     fprintf(stderr, "\t-m THRESH\tUse median method of filtering, with threshold THRESH.\n");
     fprintf(stderr, "\t-z THRESH\tUse number of non-zero cells to filter, with threshold THRESH.\n");
+    fprintf(stderr, "\t-e EXPR\t\tKeep rows matching EXPR, e.g. 'nonzero >= 5 and median >= 2'.\n");
+    fprintf(stderr, "\t\t\tAggregates: nonzero sum mean median min max, each of the\n");
+    fprintf(stderr, "\t\t\twhole row or of a group, e.g. sum(A). Operators: < <= > >=\n");
+    fprintf(stderr, "\t\t\t== != and or not ( ).\n");
+    fprintf(stderr, "\t--keep-keys=KEYS\tKeep only rows whose key (the COLS skipped by -c) is in\n");
+    fprintf(stderr, "\t\t\tKEYS, a comma-separated list or @FILE with one key per line.\n");
+    fprintf(stderr, "\t--drop-keys=KEYS\tDrop rows whose key is in KEYS. Either may be combined\n");
+    fprintf(stderr, "\t\t\twith -m, -z or -e; rows dropped by key are not parsed.\n");
+    fprintf(stderr, "\t--bloom[=FPR]\tHold KEYS in a Bloom filter with false positive rate FPR\n");
+    fprintf(stderr, "\t\t\t(default %g), about 1.44*log2(1/FPR) bits per key.\n", KEYSET_BLOOM_FPR);
+    fprintf(stderr, "\t--annotate[=FORMAT]\tPrint each kept row's key and its non-zero count,\n");
+    fprintf(stderr, "\t\t\tsum, min, max, median and mean instead of the row, as\n");
+    fprintf(stderr, "\t\t\t'text' (default) or 'binary': %d 8-byte words per row,\n", FT_ANNOTATION_WORDS);
+    fprintf(stderr, "\t\t\tthe count and mean as unsigned and double, the rest as\n");
+    fprintf(stderr, "\t\t\tthe cells are. May be combined with -m, -z or -e.\n");
+    fprintf(stderr, "\t-g NAME=LIST\tDefine group NAME as the columns in LIST, e.g. A=1-4,9,\n");
+    fprintf(stderr, "\t\t\tcounted from 1 among the columns in use. May be repeated.\n");
     fprintf(stderr, "\t-r ROWS\t\tSkip ROWS rows from start of table.\n");
     fprintf(stderr, "\t-c COLS\t\tSkip COLS columns from start of each row.\n");
     fprintf(stderr, "\t-s SEP\t\tUse string SEP as field seperator, not \"\\t\".\n");
     fprintf(stderr, "\t-i INFILE\tInput from INFILE, not stdin (or '-' for stdin).\n");
     fprintf(stderr, "\t-o OUTFILE\tOutput to OUTFILE, not stdout (or '-' for stdout).\n");
+    fprintf(stderr, "\t-t THREADS\tUse THREADS worker threads (default 1).\n");
+    fprintf(stderr, "\t--columns=LIST\tOnly consider the data columns in LIST, e.g. 1,4-6,\n");
+    fprintf(stderr, "\t\t\tcounted from 1 after the COLS skipped by -c.\n");
+    fprintf(stderr, "\t--samples=NAMES\tOnly consider the samples named in NAMES, a comma-separated\n");
+    fprintf(stderr, "\t\t\tlist or @FILE with one name per line, as found in the\n");
+    fprintf(stderr, "\t\t\theader (the last row skipped by -r).\n");
+    fprintf(stderr, "\t--collapse=GROUPS\tSum samples into groups, given as 'G1=S1,S2;G2=S3,S4'\n");
+    fprintf(stderr, "\t\t\tor @FILE with a sample and its group per line, named as in\n");
+    fprintf(stderr, "\t\t\tthe header. Other samples are kept as they are. Filters\n");
+    fprintf(stderr, "\t\t\tthen see, and output has, one column per group.\n");
+    fprintf(stderr, "\t--io=MODE\tRead input with a read-ahead 'thread' (default) or in\n");
+    fprintf(stderr, "\t\t\t'sync' with parsing.\n");
+    fprintf(stderr, "\t--range=ROWS\tOnly use data rows ROWS, e.g. 1001-2000 or 1001+1000,\n");
+    fprintf(stderr, "\t\t\tcounted from 1. Uses INFILE" TABLE_INDEX_SUFFIX " from tableIndex if present.\n");
+    fprintf(stderr, "\t--progress\tReport progress and throughput to stderr.\n");
+    fprintf(stderr, "\t--stats\t\tPrint a JSON run summary to stderr when done.\n");
     fprintf(stderr, "\t-h \t\tPrint this help message.\n");
 }
 
 int
 print_header (table_t *tab, char *hdr)
 {
-    fprintf(tab->outfp, "%s", hdr);
+    ft_t *ft = (ft_t *)tab->data;
+    size_t key_len = 0;
+    const char *key = NULL;
+    size_t iii;
+    if (ft->annotate) {
+        /* Annotations have one header, naming the statistics */
+        if (ft->annotate == FT_ANNOTATE_TEXT &&
+                ++ft->header_rows == tab->skiprow) {
+            key = table_row_key(tab, hdr, &key_len);
+            if (tab->skipcol > 0) {
+                fwrite(key, 1, key_len, tab->outfp);
+                fputs(tab->sep, tab->outfp);
+            }
+            fprintf(tab->outfp, "nonzero%ssum%smin%smax%smedian%smean\n",
+                    tab->sep, tab->sep, tab->sep, tab->sep, tab->sep);
+        }
+        return 1;
+    }
+    if (tab->group_of == NULL) {
+        fprintf(tab->outfp, "%s", hdr);
+        return 1;
+    }
+    /* The header of a collapsed table names its groups */
+    key = table_row_key(tab, hdr, &key_len);
+    if (tab->skipcol > 0) {
+        fwrite(key, 1, key_len, tab->outfp);
+    }
+    for (iii = 0; iii < tab->n_groups; iii++) {
+        if (iii > 0 || tab->skipcol > 0) {
+            fputs(tab->sep, tab->outfp);
+        }
+        fputs(tab->group_names[iii], tab->outfp);
+    }
+    fputc('\n', tab->outfp);
     return 1;
 }
 
@@ -111,30 +405,58 @@ int
 parse_args (int argc, char *argv[], table_t *tab)
 {
     assert(tab);
-    tab->data = km_calloc(1, sizeof(ft_t), &km_onerr_print_exit);
+    tab->data = arena_calloc(table_arena(tab), 1, sizeof(ft_t));
     unsigned char haveflags = 0;
     /*
         1 1 1 1 1 1 1 1
-            | | | | | \- method
-            | | | | \--- out fname
-            | | | \----- in fname
-            | | \------- cols to skip
-            | \--------- rows to skip
-            \----------- Field sep
+          | | | | | | \- method
+          | | | | | \--- out fname
+          | | | | \----- in fname
+          | | | \------- cols to skip
+          | | \--------- rows to skip
+          | \----------- Field sep
+          \------------- threads
     */
-    char c = '\0';
-    while((c = getopt(argc, argv, "m:z:r:c:o:i:s:h")) >= 0) {
+    static struct option long_opts[] = {
+        {"progress", no_argument, NULL, OPT_PROGRESS},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"columns", required_argument, NULL, OPT_COLUMNS},
+        {"samples", required_argument, NULL, OPT_SAMPLES},
+        {"io", required_argument, NULL, OPT_IO},
+        {"range", required_argument, NULL, OPT_RANGE},
+        {"keep-keys", required_argument, NULL, OPT_KEEP_KEYS},
+        {"drop-keys", required_argument, NULL, OPT_DROP_KEYS},
+        {"bloom", optional_argument, NULL, OPT_BLOOM},
+        {"collapse", required_argument, NULL, OPT_COLLAPSE},
+        {"annotate", optional_argument, NULL, OPT_ANNOTATE},
+        {NULL, 0, NULL, 0}
+    };
+    int c = 0;
+    ft_t *ft = (ft_t *)tab->data;
+    ft->expr = expr_new(table_arena(tab));
+    while((c = getopt_long(argc, argv, "m:z:e:g:r:c:o:i:s:t:h", long_opts, NULL)) >= 0) {
         switch (c) {
             case 'm':
                 haveflags |= 1;
-                tab->row_fn = &ft_median;
+                ((ft_t *)tab->data)->filter = &ft_median;
                 strtocellt(&(((ft_t *)tab->data)->threshold), optarg, NULL, U64);
                 break;
             case 'z':
                 haveflags |= 1;
-                tab->row_fn = &ft_num_nonzero;
+                ((ft_t *)tab->data)->filter = &ft_num_nonzero;
                 strtocellt(&(((ft_t *)tab->data)->threshold), optarg, NULL, U64);
                 break;
+            case 'e':
+                haveflags |= 1;
+                ft->filter = &ft_expr;
+                ft->expr_src = optarg;
+                break;
+            case 'g':
+                if (!expr_add_group(ft->expr, optarg)) {
+                    fprintf(stderr, "Bad group '%s'\n", optarg);
+                    return 0;
+                }
+                break;
             case 'o':
                 haveflags |= 2;
                 tab->outfname = strdup(optarg);
@@ -155,6 +477,77 @@ parse_args (int argc, char *argv[], table_t *tab)
                 haveflags |= 32;
                 tab->sep = strdup(optarg);
                 break;
+            case 't':
+                haveflags |= 64;
+                tab->threads = atoi(optarg);
+                break;
+            case OPT_PROGRESS:
+            case OPT_STATS:
+                if (tab->stats == NULL) {
+                    table_stats_new(tab);
+                }
+                if (c == OPT_PROGRESS) tab->stats->progress = 1;
+                else tab->stats->summary = 1;
+                break;
+            case OPT_COLUMNS:
+                if (!table_select_columns(tab, optarg)) {
+                    fprintf(stderr, "Bad column list '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_IO:
+                if (!reader_mode_from_str(&tab->io, optarg)) {
+                    fprintf(stderr, "Unknown input mode '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_SAMPLES:
+                if (!table_select_names(tab, optarg)) {
+                    fprintf(stderr, "No samples in '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_KEEP_KEYS:
+            case OPT_DROP_KEYS:
+                haveflags |= 1;
+                ft->keys_src = optarg;
+                ft->drop_keys = c == OPT_DROP_KEYS;
+                break;
+            case OPT_BLOOM:
+                ft->bloom_fpr = KEYSET_BLOOM_FPR;
+                if (optarg != NULL) {
+                    ft->bloom_fpr = strtod(optarg, NULL);
+                    if (ft->bloom_fpr <= 0.0 || ft->bloom_fpr >= 1.0) {
+                        fprintf(stderr, "Bad false positive rate '%s'\n",
+                                optarg);
+                        return 0;
+                    }
+                }
+                break;
+            case OPT_RANGE:
+                if (!table_select_range(tab, optarg)) {
+                    fprintf(stderr, "Bad row range '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_COLLAPSE:
+                if (!table_collapse_columns(tab, optarg)) {
+                    fprintf(stderr, "Bad sample groups '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_ANNOTATE:
+                haveflags |= 1;
+                if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                    ft->annotate = FT_ANNOTATE_TEXT;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    ft->annotate = FT_ANNOTATE_BINARY;
+                } else {
+                    fprintf(stderr, "Unknown annotation format '%s'\n",
+                            optarg);
+                    return 0;
+                }
+                break;
             case 'h':
                 print_usage();
                 destroy_table_t(tab);
@@ -178,6 +571,10 @@ parse_args (int argc, char *argv[], table_t *tab)
                 strerror(errno));
         return 0;
     }
+    if (tab->range_first > 0) {
+        /* Jump to the range with the table's index, if it has one */
+        table_index_open(tab, NULL);
+    }
     /* Setup output fp */
     if ((!(haveflags & 2)) || tab->outfname == NULL || \
             strncmp(tab->outfname, "-", 1) == 0) {
@@ -196,6 +593,18 @@ parse_args (int argc, char *argv[], table_t *tab)
         fprintf(stderr, "[parse_args] Required arguments missing\n");
         return 0;
     }
+    /* Groups may be given after the expression that uses them */
+    if (ft->filter == &ft_expr && !expr_compile(ft->expr, ft->expr_src)) {
+        return 0;
+    }
+    /* Keys are hashed as rows are, so need -c and -s */
+    if (ft->keys_src != NULL) {
+        ft->keys = keyset_load(tab, ft->keys_src, ft->bloom_fpr);
+        if (ft->keys == NULL) {
+            fprintf(stderr, "No keys in '%s'\n", ft->keys_src);
+            return 0;
+        }
+    }
     return 1; /* Successful */
 }
 
@@ -0,0 +1,262 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  karena.c
+ *
+ *    Description:  Bump allocator for per-run table state
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 14:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "kdm.h"
+#include "karena.h"
+
+#define ARENA_HEADER ARENA_ROUND(sizeof(arena_block_t))
+#define arena_block_data(b) ((char *)(b) + ARENA_HEADER)
+
+arena_t *
+arena_new (size_t block_size)
+{
+    arena_t *arena = km_calloc(1, sizeof(*arena), &km_onerr_print_exit);
+    arena->block_size = block_size > 0 ? block_size : ARENA_BLOCK_SIZE;
+    pthread_mutex_init(&arena->lock, NULL);
+    return arena;
+}
+
+void
+destroy_arena_t (arena_t *arena)
+{
+    if (arena != NULL) {
+        arena_block_t *block = arena->blocks;
+        while (block != NULL) {
+            arena_block_t *next = block->next;
+            if (block->mapped > 0) {
+                munmap(block, block->mapped);
+            } else {
+                free(block);
+            }
+            block = next;
+        }
+        pthread_mutex_destroy(&arena->lock);
+        free(arena);
+    }
+}
+
+/* Blocks come from calloc and space is never handed out twice, so every
+ * allocation is already zeroed */
+static arena_block_t *
+arena_new_block (size_t size)
+{
+    arena_block_t *block = km_calloc(1, ARENA_HEADER + size,
+            &km_onerr_print_exit);
+    block->size = size;
+    return block;
+}
+
+static void *
+arena_alloc_locked (arena_t *arena, size_t size)
+{
+    arena_block_t *block = arena->blocks;
+    void *ptr = NULL;
+    size = ARENA_ROUND(size > 0 ? size : 1);
+    if (size > arena->block_size / 4) {
+        /* Large requests get their own block, kept behind the current one
+         * so that it can keep filling */
+        block = arena_new_block(size);
+        block->used = size;
+        if (arena->blocks == NULL) {
+            arena->blocks = block;
+        } else {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        }
+        return arena_block_data(block);
+    }
+    if (block == NULL || block->used + size > block->size) {
+        block = arena_new_block(arena->block_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    ptr = arena_block_data(block) + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void *
+arena_alloc (arena_t *arena, size_t size)
+{
+    void *ptr = NULL;
+    pthread_mutex_lock(&arena->lock);
+    ptr = arena_alloc_locked(arena, size);
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+void *
+arena_calloc (arena_t *arena, size_t nmemb, size_t size)
+{
+    if (size > 0 && nmemb > SIZE_MAX / size) {
+        km_onerr_print_exit("arena_calloc overflow", __FILE__, __LINE__);
+        return NULL;
+    }
+    return arena_alloc(arena, nmemb * size);
+}
+
+/* Grow ptr, the arena's most recent allocation, in place when it still
+ * fits; otherwise copy it into a new allocation. The old space is not
+ * reclaimed until the arena is destroyed. */
+void *
+arena_grow (arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    arena_block_t *block = NULL;
+    void *new_ptr = NULL;
+    if (new_size <= old_size && ptr != NULL) {
+        return ptr;
+    }
+    pthread_mutex_lock(&arena->lock);
+    block = arena->blocks;
+    if (ptr != NULL && block != NULL &&
+            (char *)ptr + ARENA_ROUND(old_size) ==
+            arena_block_data(block) + block->used &&
+            (char *)ptr - arena_block_data(block) + ARENA_ROUND(new_size) <=
+            block->size) {
+        block->used = (char *)ptr - arena_block_data(block) +
+                ARENA_ROUND(new_size);
+        pthread_mutex_unlock(&arena->lock);
+        return ptr;
+    }
+    new_ptr = arena_alloc_locked(arena, new_size);
+    pthread_mutex_unlock(&arena->lock);
+    if (ptr != NULL && old_size > 0) {
+        memcpy(new_ptr, ptr, old_size);
+    }
+    return new_ptr;
+}
+
+char *
+arena_strdup (arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+int
+arena_pages_from_str (arena_pages_t *pages, const char *str)
+{
+    if (strcmp(str, "thp") == 0) {
+        *pages = ARENA_PAGES_THP;
+    } else if (strcmp(str, "hugetlb") == 0) {
+        *pages = ARENA_PAGES_HUGETLB;
+    } else if (strcmp(str, "none") == 0) {
+        *pages = ARENA_PAGES_DEFAULT;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* The kernel's default huge page size, per /proc/meminfo */
+static size_t
+arena_huge_page_size (void)
+{
+    size_t kb = 0;
+    char line[256];
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (fp == NULL) {
+        return 2<<20;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb > 0 ? kb << 10 : 2<<20;
+}
+
+/* A zeroed, page-backed block of its own for a large array such as a
+ * distance matrix. Pages are not populated until first written, so the
+ * first thread to touch each page decides which NUMA node holds it. If no
+ * hugetlb pages are reserved, falls back to transparent huge pages. */
+void *
+arena_alloc_pages (arena_t *arena, size_t size, arena_pages_t pages)
+{
+    arena_block_t *block = NULL;
+    size_t len = ARENA_HEADER + ARENA_ROUND(size > 0 ? size : 1);
+    size_t page = sysconf(_SC_PAGESIZE);
+    void *map = MAP_FAILED;
+    static int warned = 0;
+#ifdef MAP_HUGETLB
+    if (pages == ARENA_PAGES_HUGETLB) {
+        size_t huge = arena_huge_page_size();
+        size_t huge_len = ((len + huge - 1) / huge) * huge;
+        map = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED) {
+            len = huge_len;
+        } else {
+            if (!warned) {
+                fprintf(stderr, "[arena] No hugetlb pages available, "
+                        "using transparent huge pages\n");
+                warned = 1;
+            }
+            pages = ARENA_PAGES_THP;
+        }
+    }
+#endif
+    if (map == MAP_FAILED) {
+        len = ((len + page - 1) / page) * page;
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            km_onerr_print_exit("arena_alloc_pages mmap", __FILE__,
+                    __LINE__);
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (pages == ARENA_PAGES_THP) {
+            madvise(map, len, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    block = (arena_block_t *)map;
+    block->size = len - ARENA_HEADER;
+    block->used = block->size;
+    block->mapped = len;
+    pthread_mutex_lock(&arena->lock);
+    if (arena->blocks == NULL) {
+        arena->blocks = block;
+    } else {
+        block->next = arena->blocks->next;
+        arena->blocks->next = block;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return arena_block_data(block);
+}
+
+/* Fault in every page of ptr from the calling thread, placing them on its
+ * NUMA node under the default first-touch policy */
+void
+arena_touch (void *ptr, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    volatile char *pos = (volatile char *)ptr;
+    size_t iii;
+    for (iii = 0; iii < size; iii += page) {
+        pos[iii] = pos[iii];
+    }
+}
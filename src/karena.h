@@ -0,0 +1,71 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  karena.h
+ *
+ *    Description:  Bump allocator for per-run table state
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 14:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef KARENA_H
+#define KARENA_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Allocations are carved out of large blocks and never freed one by one;
+ * destroy_arena_t releases everything at once. Requests bigger than a
+ * quarter of a block get a block of their own. Allocation takes a lock, so
+ * worker threads may share an arena, but it is meant for setup-time state,
+ * not for anything allocated per row.
+ */
+
+/* Types */
+typedef enum _arena_pages {
+    ARENA_PAGES_DEFAULT = 0,
+    ARENA_PAGES_THP = 1,        /* madvise(MADV_HUGEPAGE) */
+    ARENA_PAGES_HUGETLB = 2,    /* MAP_HUGETLB, needs reserved huge pages */
+} arena_pages_t;
+
+typedef struct _arena_block {
+    struct _arena_block *next;
+    size_t size;
+    size_t used;
+    size_t mapped;              /* Length of the mmap()ed block, or 0 */
+} arena_block_t;
+
+typedef struct _arena {
+    arena_block_t *blocks;
+    size_t block_size;
+    pthread_mutex_t lock;
+} arena_t;
+
+/* Default block size, and alignment of every allocation (for cell_t) */
+#define ARENA_BLOCK_SIZE (1<<20)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
+/* Function prototypes */
+extern arena_t *arena_new(size_t block_size);
+extern void destroy_arena_t(arena_t *arena);
+extern void *arena_alloc(arena_t *arena, size_t size);
+extern void *arena_calloc(arena_t *arena, size_t nmemb, size_t size);
+extern void *arena_grow(arena_t *arena, void *ptr, size_t old_size,
+        size_t new_size);
+extern char *arena_strdup(arena_t *arena, const char *str);
+extern void *arena_alloc_pages(arena_t *arena, size_t size,
+        arena_pages_t pages);
+extern void arena_touch(void *ptr, size_t size);
+extern int arena_pages_from_str(arena_pages_t *pages, const char *str);
+
+#endif /* KARENA_H */
@@ -0,0 +1,391 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kcolstats.c
+ *
+ *    Description:  Mergeable one-pass statistics of table columns
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 22:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <math.h>
+
+#include "kcolstats.h"
+
+/* KLL sketches */
+
+typedef struct _kll_item {
+    double value;
+    uint64_t weight;
+} kll_item_t;
+
+static int
+double_cmp (const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int
+kll_item_cmp (const void *a, const void *b)
+{
+    return double_cmp(&((const kll_item_t *)a)->value,
+            &((const kll_item_t *)b)->value);
+}
+
+static inline uint64_t
+kll_random (kll_t *kll)
+{
+    kll->rng ^= kll->rng << 13;
+    kll->rng ^= kll->rng >> 7;
+    kll->rng ^= kll->rng << 17;
+    return kll->rng;
+}
+
+/* Capacity of level h: k at the top, shrinking by 2/3 per level below */
+static uint32_t
+kll_capacity (const kll_t *kll, uint32_t h)
+{
+    double cap = kll->k * pow(2.0 / 3.0, kll->n_levels - h - 1);
+    return cap > 2.0 ? (uint32_t)ceil(cap) : 2;
+}
+
+static void
+kll_grow (kll_t *kll)
+{
+    uint32_t h = kll->n_levels++;
+    kll->levels = km_realloc(kll->levels,
+            kll->n_levels * sizeof(*kll->levels), &km_onerr_print_exit);
+    kll->lens = km_realloc(kll->lens, kll->n_levels * sizeof(*kll->lens),
+            &km_onerr_print_exit);
+    kll->caps = km_realloc(kll->caps, kll->n_levels * sizeof(*kll->caps),
+            &km_onerr_print_exit);
+    kll->levels[h] = NULL;
+    kll->lens[h] = 0;
+    kll->caps[h] = 0;
+    kll->max_size = 0;
+    for (h = 0; h < kll->n_levels; h++) {
+        kll->max_size += kll_capacity(kll, h);
+    }
+}
+
+static void
+kll_push (kll_t *kll, uint32_t h, const double *items, uint32_t n)
+{
+    if (kll->lens[h] + n > kll->caps[h]) {
+        size_t newsz = kll->lens[h] + n;
+        newsz = kmroundupz(newsz);
+        kll->levels[h] = km_realloc(kll->levels[h],
+                newsz * sizeof(*kll->levels[h]), &km_onerr_print_exit);
+        kll->caps[h] = newsz;
+    }
+    memcpy(kll->levels[h] + kll->lens[h], items, n * sizeof(*items));
+    kll->lens[h] += n;
+    kll->size += n;
+}
+
+/* Promote every other item of level h, bar the largest if there is an odd
+ * number, so the total weight is unchanged */
+static void
+kll_compact (kll_t *kll, uint32_t h)
+{
+    double *items = kll->levels[h];
+    uint32_t len = kll->lens[h];
+    uint32_t even = len & ~1u;
+    uint32_t iii, jjj;
+    if (h + 1 >= kll->n_levels) {
+        kll_grow(kll);
+        items = kll->levels[h];
+    }
+    qsort(items, len, sizeof(*items), &double_cmp);
+    for (iii = kll_random(kll) & 1, jjj = 0; iii < even; iii += 2) {
+        items[jjj++] = items[iii];
+    }
+    kll->lens[h] = 0;
+    kll->size -= even;
+    kll_push(kll, h + 1, items, jjj);
+    if (even < len) {
+        items[0] = items[even];
+        kll->lens[h] = 1;
+    }
+}
+
+/* Compact the lowest full levels until the sketch is under its size */
+static void
+kll_compress (kll_t *kll)
+{
+    uint32_t h;
+    while (kll->size >= kll->max_size) {
+        for (h = 0; h < kll->n_levels; h++) {
+            if (kll->lens[h] >= kll_capacity(kll, h)) {
+                kll_compact(kll, h);
+                break;
+            }
+        }
+    }
+}
+
+void
+kll_init (kll_t *kll, uint32_t k, uint64_t seed)
+{
+    memset(kll, 0, sizeof(*kll));
+    kll->k = k > 0 ? k : KLL_DEFAULT_K;
+    kll->rng = seed * 0x9e3779b97f4a7c15ull + 1;
+    kll_grow(kll);
+}
+
+void
+kll_free (kll_t *kll)
+{
+    uint32_t h;
+    for (h = 0; h < kll->n_levels; h++) {
+        km_free(kll->levels[h]);
+    }
+    km_free(kll->levels);
+    km_free(kll->lens);
+    km_free(kll->caps);
+    kll->n_levels = 0;
+}
+
+void
+kll_add (kll_t *kll, double x)
+{
+    kll_push(kll, 0, &x, 1);
+    kll->n++;
+    if (kll->size >= kll->max_size) {
+        kll_compress(kll);
+    }
+}
+
+void
+kll_merge (kll_t *kll, const kll_t *other)
+{
+    uint32_t h;
+    while (kll->n_levels < other->n_levels) {
+        kll_grow(kll);
+    }
+    for (h = 0; h < other->n_levels; h++) {
+        if (other->lens[h] > 0) {
+            kll_push(kll, h, other->levels[h], other->lens[h]);
+        }
+    }
+    kll->n += other->n;
+    kll_compress(kll);
+}
+
+/* The smallest held item whose weighted rank reaches q of all items */
+double
+kll_quantile (const kll_t *kll, double q)
+{
+    kll_item_t *items = NULL;
+    uint64_t target = 0, seen = 0;
+    double value = 0.0;
+    uint32_t h, iii, n = 0;
+    if (kll->n == 0) {
+        return NAN;
+    }
+    items = km_calloc(kll->size, sizeof(*items), &km_onerr_print_exit);
+    for (h = 0; h < kll->n_levels; h++) {
+        for (iii = 0; iii < kll->lens[h]; iii++) {
+            items[n].value = kll->levels[h][iii];
+            items[n++].weight = (uint64_t)1 << h;
+        }
+    }
+    qsort(items, n, sizeof(*items), &kll_item_cmp);
+    q = q < 0.0 ? 0.0 : q > 1.0 ? 1.0 : q;
+    target = (uint64_t)ceil(q * kll->n);
+    for (iii = 0; iii < n; iii++) {
+        seen += items[iii].weight;
+        value = items[iii].value;
+        if (seen >= target) break;
+    }
+    km_free(items);
+    return value;
+}
+
+/* Column statistics */
+
+/* Arrays live in the table's arena, as partials are made per thread and
+ * merged once; only the sketches' levels are on the heap */
+void
+col_stats_alloc (table_t *tab, col_stats_t *st, size_t n_cols)
+{
+    arena_t *arena = table_arena(tab);
+    size_t iii;
+    st->n_cols = n_cols;
+    st->rows = 0;
+    st->sum = arena_calloc(arena, n_cols, sizeof(*st->sum));
+    st->min = arena_calloc(arena, n_cols, sizeof(*st->min));
+    st->max = arena_calloc(arena, n_cols, sizeof(*st->max));
+    st->nonzero = arena_calloc(arena, n_cols, sizeof(*st->nonzero));
+    st->mean = arena_calloc(arena, n_cols, sizeof(*st->mean));
+    st->m2 = arena_calloc(arena, n_cols, sizeof(*st->m2));
+    st->row = arena_calloc(arena, n_cols, sizeof(*st->row));
+    st->sketches = NULL;
+    if (st->k > 0) {
+        st->sketches = arena_calloc(arena, n_cols, sizeof(*st->sketches));
+        for (iii = 0; iii < n_cols; iii++) {
+            kll_init(&st->sketches[iii], st->k, iii);
+        }
+    }
+}
+
+void
+col_stats_free (col_stats_t *st)
+{
+    size_t iii;
+    if (st->sketches != NULL) {
+        for (iii = 0; iii < st->n_cols; iii++) {
+            kll_free(&st->sketches[iii]);
+        }
+        st->sketches = NULL;
+    }
+}
+
+/* Fold in a row. Each pass is over one contiguous array, so vectorises. */
+void
+col_stats_add (table_t *tab, col_stats_t *st, const cell_t *cells)
+{
+    const size_t n = st->n_cols;
+    double *restrict row = st->row;
+    double *restrict mean = st->mean;
+    double *restrict m2 = st->m2;
+    double inv = 0.0;
+    size_t iii;
+    st->rows++;
+    inv = 1.0 / st->rows;
+    switch (tab->mode) {
+        case U64:
+            for (iii = 0; iii < n; iii++) {
+                uint64_t x = cells[iii].u;
+                st->sum[iii].u += x;
+                st->nonzero[iii] += x != 0;
+                if (st->rows == 1 || x < st->min[iii].u) st->min[iii].u = x;
+                if (st->rows == 1 || x > st->max[iii].u) st->max[iii].u = x;
+                row[iii] = (double)x;
+            }
+            break;
+        case I64:
+            for (iii = 0; iii < n; iii++) {
+                int64_t x = cells[iii].i;
+                st->sum[iii].i += x;
+                st->nonzero[iii] += x != 0;
+                if (st->rows == 1 || x < st->min[iii].i) st->min[iii].i = x;
+                if (st->rows == 1 || x > st->max[iii].i) st->max[iii].i = x;
+                row[iii] = (double)x;
+            }
+            break;
+        case D64:
+            for (iii = 0; iii < n; iii++) {
+                long double x = cells[iii].d;
+                st->sum[iii].d += x;
+                st->nonzero[iii] += x != 0.0;
+                if (st->rows == 1 || x < st->min[iii].d) st->min[iii].d = x;
+                if (st->rows == 1 || x > st->max[iii].d) st->max[iii].d = x;
+                row[iii] = (double)x;
+            }
+            break;
+    }
+    for (iii = 0; iii < n; iii++) {
+        double delta = row[iii] - mean[iii];
+        mean[iii] += delta * inv;
+        m2[iii] += delta * (row[iii] - mean[iii]);
+    }
+    if (st->sketches != NULL) {
+        for (iii = 0; iii < n; iii++) {
+            kll_add(&st->sketches[iii], row[iii]);
+        }
+    }
+}
+
+/* Fold other, over other rows, into st. Other's sketches are freed. */
+void
+col_stats_merge (table_t *tab, col_stats_t *st, col_stats_t *other)
+{
+    double na = st->rows, nb = other->rows, n = na + nb;
+    size_t iii;
+    if (other->n_cols == 0 || other->rows == 0) {
+        col_stats_free(other);
+        return;
+    }
+    if (st->n_cols == 0 || st->rows == 0) {
+        col_stats_free(st);
+        *st = *other;
+        other->sketches = NULL;
+        return;
+    }
+    for (iii = 0; iii < st->n_cols; iii++) {
+        double delta = other->mean[iii] - st->mean[iii];
+        st->mean[iii] += delta * nb / n;
+        st->m2[iii] += other->m2[iii] + delta * delta * na * nb / n;
+        st->nonzero[iii] += other->nonzero[iii];
+        switch (tab->mode) {
+            case U64:
+                st->sum[iii].u += other->sum[iii].u;
+                if (other->min[iii].u < st->min[iii].u) {
+                    st->min[iii] = other->min[iii];
+                }
+                if (other->max[iii].u > st->max[iii].u) {
+                    st->max[iii] = other->max[iii];
+                }
+                break;
+            case I64:
+                st->sum[iii].i += other->sum[iii].i;
+                if (other->min[iii].i < st->min[iii].i) {
+                    st->min[iii] = other->min[iii];
+                }
+                if (other->max[iii].i > st->max[iii].i) {
+                    st->max[iii] = other->max[iii];
+                }
+                break;
+            case D64:
+                st->sum[iii].d += other->sum[iii].d;
+                if (other->min[iii].d < st->min[iii].d) {
+                    st->min[iii] = other->min[iii];
+                }
+                if (other->max[iii].d > st->max[iii].d) {
+                    st->max[iii] = other->max[iii];
+                }
+                break;
+        }
+        if (st->sketches != NULL && other->sketches != NULL) {
+            kll_merge(&st->sketches[iii], &other->sketches[iii]);
+        }
+    }
+    st->rows += other->rows;
+    col_stats_free(other);
+}
+
+/* Mean of a column, from its total, so it doesn't depend on how rows were
+ * shared between threads */
+long double
+col_stats_mean (table_t *tab, const col_stats_t *st, size_t col)
+{
+    if (st->rows == 0) {
+        return 0.0L;
+    }
+    switch (tab->mode) {
+        case U64:
+            return (long double)st->sum[col].u / st->rows;
+        case I64:
+            return (long double)st->sum[col].i / st->rows;
+        case D64:
+            return st->sum[col].d / st->rows;
+    }
+    return 0.0L;
+}
+
+/* Sample variance of a column */
+double
+col_stats_var (const col_stats_t *st, size_t col)
+{
+    return st->rows > 1 ? st->m2[col] / (st->rows - 1) : 0.0;
+}
@@ -0,0 +1,88 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kcolstats.h
+ *
+ *    Description:  Mergeable one-pass statistics of table columns
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 22:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef KCOLSTATS_H
+#define KCOLSTATS_H
+
+#include <stdint.h>
+
+#include "ktable.h"
+
+/*
+ * Every column gets its total, non-zero count, minimum and maximum, and a
+ * running mean and sum of squared deviations (Welford), updated a whole row
+ * at a time. The running mean only serves the squared deviations; the mean
+ * reported is the total over the row count. Two sets of statistics over
+ * disjoint rows merge, the moments by Chan et al.'s pairwise update, so
+ * threads can each fold a share of the rows and be merged once input is
+ * exhausted.
+ *
+ * Quantiles come from a KLL sketch per column: a stack of compactors, the
+ * one at height h holding items of weight 2^h. A full compactor is sorted
+ * and every other item, from a random offset, promoted to the next. Level
+ * capacities shrink geometrically (by 2/3) below the top, which holds k
+ * items, so a sketch of n items holds O(k + log(n/k)) of them, and the rank
+ * of any quantile is within about 1.7/k of n with high probability (e.g.
+ * 1% for the default k = 200). Sketches merge by concatenating levels and
+ * compacting again.
+ */
+
+/* Types */
+typedef struct _kll {
+    uint64_t n;                 /* Items added */
+    uint64_t rng;
+    uint32_t k;
+    uint32_t n_levels;
+    uint32_t size;              /* Items held, over all levels */
+    uint32_t max_size;          /* Sum of level capacities */
+    double **levels;
+    uint32_t *lens;
+    uint32_t *caps;             /* Allocated length of each level */
+} kll_t;
+
+typedef struct _col_stats {
+    size_t n_cols;
+    uint64_t rows;
+    uint32_t k;                 /* Quantile sketch size, or 0 for none */
+    cell_t *sum;
+    cell_t *min;
+    cell_t *max;
+    uint64_t *nonzero;
+    double *mean;               /* Running mean, for m2 */
+    double *m2;
+    double *row;                /* The row being added, as doubles */
+    kll_t *sketches;
+} col_stats_t;
+
+#define KLL_DEFAULT_K 200
+
+/* Function prototypes */
+extern void kll_init(kll_t *kll, uint32_t k, uint64_t seed);
+extern void kll_free(kll_t *kll);
+extern void kll_add(kll_t *kll, double x);
+extern void kll_merge(kll_t *kll, const kll_t *other);
+extern double kll_quantile(const kll_t *kll, double q);
+extern void col_stats_alloc(table_t *tab, col_stats_t *st, size_t n_cols);
+extern void col_stats_free(col_stats_t *st);
+extern void col_stats_add(table_t *tab, col_stats_t *st, const cell_t *cells);
+extern void col_stats_merge(table_t *tab, col_stats_t *st,
+        col_stats_t *other);
+extern long double col_stats_mean(table_t *tab, const col_stats_t *st,
+        size_t col);
+extern double col_stats_var(const col_stats_t *st, size_t col);
+
+#endif /* KCOLSTATS_H */
@@ -0,0 +1,765 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kdist.c
+ *
+ *    Description:  Distance matrices and pairwise distance kernels
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 11:40:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include <math.h>
+#include <pthread.h>
+
+#include "kdist.h"
+#include "kprof.h"
+
+cell_t binary_cutoff = {u : 1, i : 1, d : 1.0};
+
+/* Narrow batches */
+
+narrow_batch_t *
+narrow_batch_new (arena_t *arena, size_t samples, int binary)
+{
+    narrow_batch_t *nb = arena_calloc(arena, 1, sizeof(*nb));
+    size_t cap = NARROW_BATCH_BYTES / ((samples > 0 ? samples : 1) * 4);
+    /* Whole AVX2 registers of rows, and few enough that sums of 2-byte
+     * cells fit 4-byte lanes */
+    cap = cap < 32 ? 32 : cap > 4096 ? 4096 : cap & ~(size_t)31;
+    nb->samples = samples;
+    nb->cap = cap;
+    nb->width = 1;
+    nb->binary = binary;
+    /* Room for the widest cells, so batches widen in place */
+    nb->cells = arena_alloc(arena, samples * cap * 4);
+    return nb;
+}
+
+static inline uint32_t
+narrow_get (const narrow_batch_t *nb, size_t width, size_t idx)
+{
+    switch (width) {
+        case 1: return ((const uint8_t *)nb->cells)[idx];
+        case 2: return ((const uint16_t *)nb->cells)[idx];
+        default: return ((const uint32_t *)nb->cells)[idx];
+    }
+}
+
+static inline void
+narrow_set (narrow_batch_t *nb, size_t width, size_t idx, uint32_t x)
+{
+    switch (width) {
+        case 1: ((uint8_t *)nb->cells)[idx] = x; break;
+        case 2: ((uint16_t *)nb->cells)[idx] = x; break;
+        default: ((uint32_t *)nb->cells)[idx] = x; break;
+    }
+}
+
+/* Widen the held cells, last first as each moves up in the buffer */
+static void
+narrow_widen (narrow_batch_t *nb, size_t width)
+{
+    size_t sss, rrr;
+    for (sss = nb->samples; sss-- > 0;) {
+        for (rrr = nb->rows; rrr-- > 0;) {
+            size_t idx = sss * nb->cap + rrr;
+            narrow_set(nb, width, idx, narrow_get(nb, nb->width, idx));
+        }
+    }
+    nb->width = width;
+}
+
+/* Add a row of D64 cells to nb. Returns 0, adding nothing, if a cell isn't
+ * a non-negative integer below 2^32; otherwise the row is held exactly. */
+int
+narrow_batch_add (narrow_batch_t *nb, const cell_t *cells, size_t count)
+{
+    size_t rrr = nb->rows;
+    size_t width = nb->width;
+    uint32_t max = 0;
+    size_t sss;
+    if (nb->binary) {
+        for (sss = 0; sss < count; sss++) {
+            ((uint8_t *)nb->cells)[sss * nb->cap + rrr] =
+                cells[sss].d > binary_cutoff.d;
+        }
+        nb->rows++;
+        return 1;
+    }
+    for (sss = 0; sss < count; sss++) {
+        long double x = cells[sss].d;
+        if (!(x >= 0.0l && x <= (long double)UINT32_MAX) ||
+                x != (long double)(uint32_t)x) {
+            return 0;
+        }
+        if ((uint32_t)x > max) max = (uint32_t)x;
+    }
+    while (max > (width < 4 ? (1u << (8 * width)) - 1 : UINT32_MAX)) {
+        width *= 2;
+    }
+    if (width > nb->width) {
+        narrow_widen(nb, width);
+    }
+    switch (width) {
+        case 1:
+            for (sss = 0; sss < count; sss++) {
+                ((uint8_t *)nb->cells)[sss * nb->cap + rrr] = cells[sss].d;
+            }
+            break;
+        case 2:
+            for (sss = 0; sss < count; sss++) {
+                ((uint16_t *)nb->cells)[sss * nb->cap + rrr] = cells[sss].d;
+            }
+            break;
+        default:
+            for (sss = 0; sss < count; sss++) {
+                ((uint32_t *)nb->cells)[sss * nb->cap + rrr] = cells[sss].d;
+            }
+            break;
+    }
+    nb->rows++;
+    return 1;
+}
+
+/* Sums of absolute differences of n cells. Single-byte cells use psadbw,
+ * 32 lanes at a time; 2-byte cells 16 at a time, summed in 4-byte lanes. */
+static inline uint64_t
+narrow_sad_u8 (const uint8_t *a, const uint8_t *b, size_t n)
+{
+    uint64_t sum = 0;
+    size_t iii = 0;
+#ifdef __AVX2__
+    __m256i acc = _mm256_setzero_si256();
+    for (; iii + 32 <= n; iii += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + iii));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + iii));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(x, y));
+    }
+    sum = (uint64_t)_mm256_extract_epi64(acc, 0) +
+        (uint64_t)_mm256_extract_epi64(acc, 1) +
+        (uint64_t)_mm256_extract_epi64(acc, 2) +
+        (uint64_t)_mm256_extract_epi64(acc, 3);
+#endif
+    for (; iii < n; iii++) {
+        sum += a[iii] > b[iii] ? a[iii] - b[iii] : b[iii] - a[iii];
+    }
+    return sum;
+}
+
+static inline uint64_t
+narrow_sad_u16 (const uint16_t *a, const uint16_t *b, size_t n)
+{
+    uint64_t sum = 0;
+    size_t iii = 0;
+#ifdef __AVX2__
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    uint32_t lanes[8];
+    size_t lll;
+    for (; iii + 16 <= n; iii += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + iii));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + iii));
+        __m256i d = _mm256_sub_epi16(_mm256_max_epu16(x, y),
+                _mm256_min_epu16(x, y));
+        acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(d, zero));
+        acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(d, zero));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    for (lll = 0; lll < 8; lll++) {
+        sum += lanes[lll];
+    }
+#endif
+    for (; iii < n; iii++) {
+        sum += a[iii] > b[iii] ? a[iii] - b[iii] : b[iii] - a[iii];
+    }
+    return sum;
+}
+
+static inline uint64_t
+narrow_sad_u32 (const uint32_t *a, const uint32_t *b, size_t n)
+{
+    uint64_t sum = 0;
+    size_t iii;
+    for (iii = 0; iii < n; iii++) {
+        sum += a[iii] > b[iii] ? a[iii] - b[iii] : b[iii] - a[iii];
+    }
+    return sum;
+}
+
+static inline uint64_t
+narrow_sad (const narrow_batch_t *nb, size_t aaa, size_t bbb)
+{
+    size_t off_a = aaa * nb->cap, off_b = bbb * nb->cap;
+    switch (nb->width) {
+        case 1:
+            return narrow_sad_u8((const uint8_t *)nb->cells + off_a,
+                    (const uint8_t *)nb->cells + off_b, nb->rows);
+        case 2:
+            return narrow_sad_u16((const uint16_t *)nb->cells + off_a,
+                    (const uint16_t *)nb->cells + off_b, nb->rows);
+        default:
+            return narrow_sad_u32((const uint32_t *)nb->cells + off_a,
+                    (const uint32_t *)nb->cells + off_b, nb->rows);
+    }
+}
+
+/* Add a tile's distances over the held rows to mat. Each sample a of the
+ * tile is compared with sample b while b's cells are in cache. Sums are
+ * exact integers, as are the matrix's for counts. */
+void
+narrow_batch_tile (dist_mat_t *mat, const dist_tile_t *tile, void *data)
+{
+    narrow_batch_t *nb = (narrow_batch_t *)data;
+    size_t aaa, bbb;
+    for (bbb = tile->b0; bbb < tile->b1; bbb++) {
+        for (aaa = tile->a0; aaa < tile->a1 && aaa < bbb; aaa++) {
+            mat->matrix[distmat_base(mat, aaa) + bbb].d +=
+                (long double)narrow_sad(nb, aaa, bbb);
+        }
+    }
+}
+
+/* Add the held rows' distances to mat's band and empty its batch */
+void
+narrow_batch_flush (dist_mat_t *mat, size_t threads)
+{
+    narrow_batch_t *nb = mat->narrow;
+    if (nb == NULL || nb->rows == 0) {
+        return;
+    }
+    distmat_run_tiles(mat, threads, &narrow_batch_tile, nb);
+    nb->rows = 0;
+    nb->width = 1;
+}
+
+/* Sparse Canberra distances */
+
+/*
+ * A pair of zeros adds nothing to a Canberra distance, and a zero against
+ * anything else adds exactly 1. So for two samples a and b, with n_a and
+ * n_b non-zero rows, the distance is n_a + n_b plus, over the rows where
+ * both are non-zero, (|x - y| / (|x| + |y|) - 2). Rows add only that last
+ * term, for the pairs of their non-zero cells, and count each sample's
+ * non-zero rows; canberra_sparse_finish adds the counts once every row is
+ * in. Divisions are in double precision, a row's worth at a time so they
+ * vectorise: each term is within a few units in the last place of a double
+ * (under 1e-15, relative) of calc_canberra's, so a distance over R rows is
+ * within R * 1e-15 of its sum.
+ */
+
+/* Give mat its non-zero counts and row buffers, from arena */
+void
+canberra_sparse_alloc (arena_t *arena, dist_mat_t *mat, size_t samples)
+{
+    mat->nonzero = arena_calloc(arena, samples, sizeof(*mat->nonzero));
+    mat->nz_idx = arena_alloc(arena, samples * sizeof(*mat->nz_idx));
+    mat->nz_val = arena_alloc(arena, samples * sizeof(*mat->nz_val));
+    mat->nz_frac = arena_alloc(arena, samples * sizeof(*mat->nz_frac));
+}
+
+void
+canberra_sparse_row (dist_mat_t *mat, const cell_t *cells, size_t count,
+        const long double *scale)
+{
+    size_t *restrict sparse_idx = mat->nz_idx;
+    double *restrict sparse_val = mat->nz_val;
+    double *restrict sparse_frac = mat->nz_frac;
+    size_t iii, jjj, nz = 0;
+    for (iii = 0; iii < count; iii++) {
+        long double x = scale != NULL ? cells[iii].d * scale[iii] :
+            cells[iii].d;
+        if (x != 0.0l) {
+            sparse_idx[nz] = iii;
+            sparse_val[nz++] = x;
+            mat->nonzero[iii]++;
+        }
+    }
+    for (iii = 0; iii < nz && sparse_idx[iii] < mat->last; iii++) {
+        const double *val = sparse_val + iii + 1;
+        const size_t *idx = sparse_idx + iii + 1;
+        const size_t n = nz - iii - 1;
+        const double left = sparse_val[iii];
+        const double left_abs = fabs(left);
+        size_t base = 0;
+        if (sparse_idx[iii] < mat->first) continue;
+        for (jjj = 0; jjj < n; jjj++) {
+            sparse_frac[jjj] = fabs(left - val[jjj]) /
+                (left_abs + fabs(val[jjj]));
+        }
+        base = distmat_base(mat, sparse_idx[iii]);
+        for (jjj = 0; jjj < n; jjj++) {
+            mat->matrix[base + idx[jjj]].d += sparse_frac[jjj] - 2.0l;
+        }
+    }
+}
+
+/* Add each pair's non-zero counts to the band, once all rows are in */
+void
+canberra_sparse_finish (dist_mat_t *mat)
+{
+    size_t aaa, bbb, iii = 0;
+    if (mat->nonzero == NULL || mat->matrix == NULL) {
+        return;
+    }
+    for (aaa = mat->first; aaa < mat->last; aaa++) {
+        for (bbb = aaa + 1; bbb < mat->samples; bbb++) {
+            mat->matrix[iii++].d += (long double)(mat->nonzero[aaa] +
+                    mat->nonzero[bbb]);
+        }
+    }
+}
+
+/* Tiles */
+
+/*
+ * The band's triangle of pairs is cut into square tiles, which are shared
+ * out between the workers' deques in order, so each starts on a contiguous
+ * run of tiles. Owners take tiles from the back of their own deque, and
+ * once it is empty steal from the front of the others', which evens out
+ * the triangle's unequal rows. Tiles are disjoint, so workers write their
+ * parts of the one matrix without atomics; only the deques take locks.
+ */
+typedef struct _tile_deque {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;                /* Holds tiles [head, tail) */
+} tile_deque_t;
+
+typedef struct _tile_exec {
+    dist_mat_t *mat;
+    dist_tile_t *tiles;
+    tile_deque_t *deques;
+    size_t n_workers;
+    dist_tile_fn fn;
+    void *data;
+} tile_exec_t;
+
+typedef struct _tile_worker {
+    tile_exec_t *ex;
+    size_t id;
+    pthread_t thread;
+} tile_worker_t;
+
+/* The tiles of side side over mat's band, in order; returns their number */
+static size_t
+distmat_tiles (const dist_mat_t *mat, size_t side, dist_tile_t *tiles)
+{
+    size_t a0, b0, n = 0;
+    for (a0 = mat->first; a0 < mat->last; a0 += side) {
+        size_t a1 = a0 + side < mat->last ? a0 + side : mat->last;
+        for (b0 = a0; b0 < mat->samples; b0 += side) {
+            size_t b1 = b0 + side < mat->samples ? b0 + side : mat->samples;
+            if (b1 <= a0 + 1) continue;     /* No b > a */
+            if (tiles != NULL) {
+                tiles[n].a0 = a0;
+                tiles[n].a1 = a1;
+                tiles[n].b0 = b0;
+                tiles[n].b1 = b1;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+static int
+tile_pop (tile_deque_t *dq, size_t *tile)
+{
+    int got = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+        *tile = --dq->tail;
+        got = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return got;
+}
+
+static int
+tile_steal (tile_exec_t *ex, size_t thief, size_t *tile)
+{
+    size_t iii;
+    for (iii = 1; iii < ex->n_workers; iii++) {
+        tile_deque_t *dq = &ex->deques[(thief + iii) % ex->n_workers];
+        int got = 0;
+        pthread_mutex_lock(&dq->lock);
+        if (dq->head < dq->tail) {
+            *tile = dq->head++;
+            got = 1;
+        }
+        pthread_mutex_unlock(&dq->lock);
+        if (got) return 1;
+    }
+    return 0;
+}
+
+/* No tiles are made once work starts, so a worker that finds every deque
+ * empty is done */
+static void *
+tile_worker (void *arg)
+{
+    tile_worker_t *w = (tile_worker_t *)arg;
+    tile_exec_t *ex = w->ex;
+    size_t tile = 0;
+    while (tile_pop(&ex->deques[w->id], &tile) ||
+            tile_steal(ex, w->id, &tile)) {
+        (*ex->fn)(ex->mat, &ex->tiles[tile], ex->data);
+    }
+    return NULL;
+}
+
+/* Apply fn to every tile of mat's band with threads workers, the calling
+ * thread among them. Tiles shrink from DIST_TILE_SIDE until each worker
+ * has a few to start with. */
+void
+distmat_run_tiles (dist_mat_t *mat, size_t threads, dist_tile_fn fn,
+        void *data)
+{
+    tile_exec_t ex;
+    tile_worker_t *workers = NULL;
+    size_t side = DIST_TILE_SIDE;
+    size_t n_tiles = 0, iii;
+    if (threads < 1) threads = 1;
+    while (side > 8 && distmat_tiles(mat, side, NULL) < 4 * threads) {
+        side /= 2;
+    }
+    n_tiles = distmat_tiles(mat, side, NULL);
+    if (n_tiles == 0) {
+        return;
+    }
+    ex.mat = mat;
+    ex.fn = fn;
+    ex.data = data;
+    ex.n_workers = threads < n_tiles ? threads : n_tiles;
+    ex.tiles = km_calloc(n_tiles, sizeof(*ex.tiles), &km_onerr_print_exit);
+    distmat_tiles(mat, side, ex.tiles);
+    if (ex.n_workers == 1) {
+        for (iii = 0; iii < n_tiles; iii++) {
+            (*fn)(mat, &ex.tiles[iii], data);
+        }
+        km_free(ex.tiles);
+        return;
+    }
+    ex.deques = km_calloc(ex.n_workers, sizeof(*ex.deques),
+            &km_onerr_print_exit);
+    workers = km_calloc(ex.n_workers, sizeof(*workers), &km_onerr_print_exit);
+    for (iii = 0; iii < ex.n_workers; iii++) {
+        pthread_mutex_init(&ex.deques[iii].lock, NULL);
+        ex.deques[iii].head = n_tiles * iii / ex.n_workers;
+        ex.deques[iii].tail = n_tiles * (iii + 1) / ex.n_workers;
+        workers[iii].ex = &ex;
+        workers[iii].id = iii;
+    }
+    for (iii = 1; iii < ex.n_workers; iii++) {
+        pthread_create(&workers[iii].thread, NULL, &tile_worker,
+                &workers[iii]);
+    }
+    tile_worker(&workers[0]);
+    for (iii = 1; iii < ex.n_workers; iii++) {
+        pthread_join(workers[iii].thread, NULL);
+    }
+    for (iii = 0; iii < ex.n_workers; iii++) {
+        pthread_mutex_destroy(&ex.deques[iii].lock);
+    }
+    km_free(workers);
+    km_free(ex.deques);
+    km_free(ex.tiles);
+}
+
+/* End of the band of rows starting at first that fits budget (always at
+ * least one row), with its number of pairs in *pairs */
+static size_t
+distmat_band (size_t first, size_t samples, size_t budget, size_t *pairs)
+{
+    size_t last;
+    *pairs = 0;
+    for (last = first; last < samples; last++) {
+        size_t row_pairs = samples - 1 - last;
+        if (budget > 0 && last > first &&
+                (*pairs + row_pairs) * sizeof(cell_t) > budget) {
+            break;
+        }
+        *pairs += row_pairs;
+    }
+    return last;
+}
+
+/* Number of bands, so of passes, distmat_alloc makes of samples rows */
+size_t
+distmat_bands (size_t samples, size_t budget)
+{
+    size_t first = 0, pairs = 0, bands = 0;
+    do {
+        first = distmat_band(first, samples, budget, &pairs);
+        bands++;
+    } while (first < samples);
+    return bands;
+}
+
+/* Size mat for samples columns, choosing the band of rows starting at
+ * mat->first that fits mat->budget (always at least one row), and give it
+ * a zeroed matrix, backed by huge pages if tab->pages asks for them */
+void
+distmat_alloc (table_t *tab, dist_mat_t *mat, size_t samples)
+{
+    arena_t *arena = mat->arena != NULL ? mat->arena : table_arena(tab);
+    size_t bytes = 0;
+    mat->samples = samples;
+    mat->last = distmat_band(mat->first, samples, mat->budget, &mat->pairs);
+    bytes = mat->pairs * sizeof(*mat->matrix);
+    if (tab->pages != ARENA_PAGES_DEFAULT) {
+        mat->matrix = arena_alloc_pages(arena, bytes, tab->pages);
+    } else {
+        mat->matrix = arena_calloc(arena, mat->pairs, sizeof(*mat->matrix));
+    }
+    if (tab->threads > 1) {
+        /* Per-thread partials are allocated by the worker that fills them;
+         * fault them in now so they land on that worker's NUMA node */
+        arena_touch(mat->matrix, bytes);
+    }
+}
+
+/* Print mat's band of rows, with the header before the first row */
+void
+print_dist_mat (table_t *tab, dist_mat_t *mat)
+{
+    size_t rrr, ccc, iii=0;
+    KPROF_DECL(mark);
+    KPROF_BEGIN(mark);
+    for (rrr = mat->first; rrr < mat->last; rrr++) {
+        if (rrr == 0) {
+            if (((dist_mat_t *)(tab->data))->sample_names != NULL) {
+                fprintf(tab->outfp, ".\t");
+                for (ccc = 0; ccc < mat->samples; ccc++) {
+                    fprintf(tab->outfp, "%s\t",
+                            ((dist_mat_t *)(tab->data))->sample_names[ccc]);
+                }
+                fprintf(tab->outfp, "\n");
+            }
+        }
+        if (((dist_mat_t *)(tab->data))->sample_names != NULL) {
+            fprintf(tab->outfp, "%s\t",
+                    ((dist_mat_t *)(tab->data))->sample_names[rrr]);
+        }
+        for (ccc = 0; ccc < mat->samples; ccc++) {
+            if (rrr == ccc) fprintf(tab->outfp, "%Lf\t", 0.0l);
+            else if (ccc < rrr + 1) fprintf(tab->outfp, ".\t");
+            else fprintf(tab->outfp, "%Lf\t", mat->matrix[iii++].d);
+        }
+        fprintf(tab->outfp, "\n");
+        KPROF_LAP(KPROF_WRITE, mark);
+    }
+}
+
+/* Print estimated Jaccard distances between the finished sketches in set,
+ * laid out as print_dist_mat does. Rows are computed as they are printed,
+ * so no matrix is held. */
+void
+print_sketch_dist_mat (table_t *tab, sketch_set_t *set)
+{
+    char **names = ((dist_mat_t *)(tab->data))->sample_names;
+    size_t rrr, ccc;
+    KPROF_DECL(mark);
+    KPROF_BEGIN(mark);
+    for (rrr = 0; rrr < set->samples; rrr++) {
+        if (rrr == 0 && names != NULL) {
+            fprintf(tab->outfp, ".\t");
+            for (ccc = 0; ccc < set->samples; ccc++) {
+                fprintf(tab->outfp, "%s\t", names[ccc]);
+            }
+            fprintf(tab->outfp, "\n");
+        }
+        if (names != NULL) {
+            fprintf(tab->outfp, "%s\t", names[rrr]);
+        }
+        for (ccc = 0; ccc < set->samples; ccc++) {
+            if (rrr == ccc) fprintf(tab->outfp, "%Lf\t", 0.0l);
+            else if (ccc < rrr + 1) fprintf(tab->outfp, ".\t");
+            else fprintf(tab->outfp, "%Lf\t",
+                    (long double)sketch_jaccard_dist(set, rrr, ccc));
+        }
+        fprintf(tab->outfp, "\n");
+        KPROF_LAP(KPROF_WRITE, mark);
+    }
+}
+
+/* Edge lists */
+
+/* A sample's name from the header, else its column number, counted from 1
+ * after the skipped columns */
+static void
+print_sample (table_t *tab, size_t sample)
+{
+    char **names = ((dist_mat_t *)(tab->data))->sample_names;
+    if (names != NULL) {
+        fputs(names[sample], tab->outfp);
+    } else {
+        fprintf(tab->outfp, "%zu", (tab->columns != NULL ?
+                    tab->columns[sample] : sample) + 1);
+    }
+}
+
+static void
+print_edge (table_t *tab, size_t a, size_t b, long double dist)
+{
+    print_sample(tab, a);
+    fputc('\t', tab->outfp);
+    print_sample(tab, b);
+    fprintf(tab->outfp, "\t%Lf\n", dist);
+}
+
+/* Edges order by distance, ties by sample, so output is deterministic */
+static inline int
+edge_less (const dist_edge_t *a, const dist_edge_t *b)
+{
+    return a->dist < b->dist || (a->dist == b->dist && a->sample < b->sample);
+}
+
+static int
+edge_cmp (const void *a, const void *b)
+{
+    return edge_less(a, b) ? -1 : edge_less(b, a) ? 1 : 0;
+}
+
+/* sample's k nearest are held as a max-heap, the furthest at the root */
+static void
+knn_push (knn_set_t *set, size_t sample, size_t other, long double dist)
+{
+    dist_edge_t *heap = set->heaps + sample * set->k;
+    dist_edge_t edge = {dist, other};
+    size_t len = set->lens[sample];
+    size_t iii = 0;
+    if (!(dist < set->cutoff)) {
+        return;
+    }
+    if (len < set->k) {
+        /* Sift up */
+        iii = set->lens[sample]++;
+        while (iii > 0 && edge_less(&heap[(iii - 1) / 2], &edge)) {
+            heap[iii] = heap[(iii - 1) / 2];
+            iii = (iii - 1) / 2;
+        }
+        heap[iii] = edge;
+        return;
+    }
+    if (!edge_less(&edge, &heap[0])) {
+        return;
+    }
+    /* Replace the root and sift down */
+    while (2 * iii + 1 < len) {
+        size_t child = 2 * iii + 1;
+        if (child + 1 < len && edge_less(&heap[child], &heap[child + 1])) {
+            child++;
+        }
+        if (!edge_less(&edge, &heap[child])) break;
+        heap[iii] = heap[child];
+        iii = child;
+    }
+    heap[iii] = edge;
+}
+
+/* set->k and set->cutoff are set beforehand */
+void
+knn_set_alloc (table_t *tab, knn_set_t *set, size_t samples)
+{
+    arena_t *arena = table_arena(tab);
+    set->samples = samples;
+    set->lens = arena_calloc(arena, samples, sizeof(*set->lens));
+    set->heaps = arena_calloc(arena, samples * set->k, sizeof(*set->heaps));
+}
+
+/* Offer each pair of mat's band to both samples' heaps */
+void
+knn_add_band (knn_set_t *set, dist_mat_t *mat)
+{
+    size_t aaa, bbb, iii = 0;
+    for (aaa = mat->first; aaa < mat->last; aaa++) {
+        for (bbb = aaa + 1; bbb < mat->samples; bbb++) {
+            long double dist = mat->matrix[iii++].d;
+            knn_push(set, aaa, bbb, dist);
+            knn_push(set, bbb, aaa, dist);
+        }
+    }
+}
+
+void
+knn_add_sketches (knn_set_t *set, sketch_set_t *sketches)
+{
+    size_t aaa, bbb;
+    for (aaa = 0; aaa < sketches->samples; aaa++) {
+        for (bbb = aaa + 1; bbb < sketches->samples; bbb++) {
+            long double dist = sketch_jaccard_dist(sketches, aaa, bbb);
+            knn_push(set, aaa, bbb, dist);
+            knn_push(set, bbb, aaa, dist);
+        }
+    }
+}
+
+/* Print each sample's neighbours, nearest first, as an edge list */
+void
+print_knn (table_t *tab, knn_set_t *set)
+{
+    size_t sss, iii;
+    KPROF_DECL(mark);
+    KPROF_BEGIN(mark);
+    fprintf(tab->outfp, "sample\tneighbour\tdistance\n");
+    for (sss = 0; sss < set->samples; sss++) {
+        dist_edge_t *heap = set->heaps + sss * set->k;
+        qsort(heap, set->lens[sss], sizeof(*heap), &edge_cmp);
+        for (iii = 0; iii < set->lens[sss]; iii++) {
+            print_edge(tab, sss, heap[iii].sample, heap[iii].dist);
+        }
+        KPROF_LAP(KPROF_WRITE, mark);
+    }
+}
+
+/* Print the pairs of mat's band closer than cutoff, each once, with the
+ * header before the first band */
+void
+print_dist_edges (table_t *tab, dist_mat_t *mat, long double cutoff)
+{
+    size_t aaa, bbb, iii = 0;
+    KPROF_DECL(mark);
+    KPROF_BEGIN(mark);
+    if (mat->first == 0) {
+        fprintf(tab->outfp, "sample\tneighbour\tdistance\n");
+    }
+    for (aaa = mat->first; aaa < mat->last; aaa++) {
+        for (bbb = aaa + 1; bbb < mat->samples; bbb++) {
+            long double dist = mat->matrix[iii++].d;
+            if (dist < cutoff) {
+                print_edge(tab, aaa, bbb, dist);
+            }
+        }
+        KPROF_LAP(KPROF_WRITE, mark);
+    }
+}
+
+void
+print_sketch_dist_edges (table_t *tab, sketch_set_t *set, long double cutoff)
+{
+    size_t aaa, bbb;
+    KPROF_DECL(mark);
+    KPROF_BEGIN(mark);
+    fprintf(tab->outfp, "sample\tneighbour\tdistance\n");
+    for (aaa = 0; aaa < set->samples; aaa++) {
+        for (bbb = aaa + 1; bbb < set->samples; bbb++) {
+            long double dist = sketch_jaccard_dist(set, aaa, bbb);
+            if (dist < cutoff) {
+                print_edge(tab, aaa, bbb, dist);
+            }
+        }
+        KPROF_LAP(KPROF_WRITE, mark);
+    }
+}
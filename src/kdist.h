@@ -0,0 +1,293 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kdist.h
+ *
+ *    Description:  Distance matrices and pairwise distance kernels
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 11:40:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef KDIST_H
+#define KDIST_H
+
+#include "ktable.h"
+#include "ksketch.h"
+
+/* Types */
+/* Rows of small non-negative integer counts, held sample by sample (the
+ * rows of sample s at s * cap) in the narrowest of 1, 2 or 4 bytes per cell
+ * that fits every row so far, widened in place when a row doesn't fit. For
+ * binary distances, cells hold whether each count passed the cutoff. */
+typedef struct _narrow_batch {
+    size_t samples;
+    size_t cap;                 /* Rows held before a flush */
+    size_t rows;
+    size_t width;               /* Bytes per cell */
+    int binary;
+    void *cells;
+} narrow_batch_t;
+
+/* Whole rows, one after another, buffered to be shared out as tiles */
+typedef struct _dist_block {
+    cell_t *cells;
+    size_t rows;
+    size_t cap;
+} dist_block_t;
+
+/* matrix holds the pairs (a, b > a) for a in the band [first, last) of
+ * sample rows, row by row. With a budget in bytes, distmat_alloc makes the
+ * band as many rows as fit, so large matrices are built over several
+ * passes; matrices come from arena if set, else the table's arena. */
+typedef struct _distmat {
+    size_t samples;
+    size_t pairs;
+    size_t first;
+    size_t last;
+    size_t budget;
+    arena_t *arena;
+    cell_t *matrix;
+    char **sample_names;
+    long double *scale;         /* Per-sample factor for cells, or NULL */
+    size_t n_scale;
+    cell_t *row;                /* A row transformed before comparison (e.g.
+                                   square-rooted), or NULL */
+    narrow_batch_t *narrow;     /* Rows yet to be added to matrix, or NULL */
+    dist_block_t *block;        /* Rows yet to be added as tiles, or NULL */
+    uint64_t *nonzero;          /* Rows where each sample is non-zero, for
+                                   sparse Canberra distances, or NULL */
+    size_t *nz_idx;             /* A row's non-zero cells, gathered */
+    double *nz_val;
+    double *nz_frac;
+} dist_mat_t;
+
+/* The pairs (a, b > a) with a in [a0, a1) and b in [b0, b1) */
+typedef struct _dist_tile {
+    size_t a0;
+    size_t a1;
+    size_t b0;
+    size_t b1;
+} dist_tile_t;
+
+/* Each sample's k nearest others (within a cutoff), kept as a max-heap of
+ * at most k edges per sample while distances are added, band by band */
+typedef struct _dist_edge {
+    long double dist;
+    size_t sample;
+} dist_edge_t;
+
+typedef struct _knn_set {
+    size_t samples;
+    size_t k;
+    long double cutoff;         /* Only distances below this are kept */
+    size_t *lens;
+    dist_edge_t *heaps;         /* samples * k */
+} knn_set_t;
+
+/* Add a tile's distances over some buffered rows (data) to mat */
+typedef void (*dist_tile_fn)(dist_mat_t *mat, const dist_tile_t *tile,
+        void *data);
+
+/* Cells of a narrow batch take at most this many bytes */
+#define NARROW_BATCH_BYTES (16 << 20)
+/* Samples along each side of a tile, at most */
+#define DIST_TILE_SIDE 64
+
+/* Cells above this count as present in binary distances */
+extern cell_t binary_cutoff;
+
+/* Macros */
+#define __abs(a) (((a) > 0.0) ? (a) : (-(a)))
+#define	KM_ABS_DIFF(a, b) (__abs((a) - (b)))
+#define	KM_ABS_SUM(a, b) (__abs(a) + __abs(b))
+#define KM_BOOL_DIFF(a, b) (!(a) != !(b))
+#define KM_NO_DIVZERO_D64(a, b) (((b) == 0.0l)? 0.0l: (a) / (b))
+/* #define KM_NO_DIVZERO_D64(a, b) ((a) / (b)) */
+#define KM_NO_DIVZERO_I64(a, b) (((b) == 0ll)? 0ll: (a) / (b))
+#define KM_NO_DIVZERO_U64(a, b) (((b) == 0llu)? 0llu: (a) / (b))
+
+/* Kernels */
+static inline cell_t
+calc_canberra (cell_t left, cell_t right, cell_mode_t mode)
+{
+    cell_t ret;
+    switch(mode) {
+        case U64:
+            ret.u = KM_NO_DIVZERO_U64(KM_ABS_DIFF(left.u, right.u),
+                    KM_ABS_SUM(left.u, right.u));
+            break;
+        case I64:
+            ret.i = KM_NO_DIVZERO_I64(KM_ABS_DIFF(left.i, right.i),
+                    KM_ABS_SUM(left.i, right.i));
+            break;
+        case D64:
+            ret.d = KM_NO_DIVZERO_D64(KM_ABS_DIFF(left.d, right.d),
+                    KM_ABS_SUM(left.d, right.d));
+            break;
+        default:
+            fprintf(stderr, "Bad switch value %i at %i in %s",
+                    mode, __LINE__, __FILE__);
+    }
+    return ret;
+}
+
+static inline cell_t
+calc_manhattan (cell_t left, cell_t right, cell_mode_t mode)
+{
+    cell_t ret;
+    switch(mode) {
+        case U64:
+            ret.u = KM_ABS_DIFF(left.u, right.u);
+            break;
+        case I64:
+            ret.i = KM_ABS_DIFF(left.i, right.i);
+            break;
+        case D64:
+            ret.d = KM_ABS_DIFF(left.d, right.d);
+            break;
+        default:
+            fprintf(stderr, "Bad switch value %i at %i in %s",
+                    mode, __LINE__, __FILE__);
+    }
+    return ret;
+}
+
+static inline cell_t
+calc_manhattan_binary (cell_t left, cell_t right, cell_mode_t mode)
+{
+    cell_t ret;
+    switch(mode) {
+        case U64:
+            ret.u = KM_BOOL_DIFF((left.u > binary_cutoff.u),
+                    (right.u > binary_cutoff.u));
+            break;
+        case I64:
+            ret.i = KM_BOOL_DIFF((left.i > binary_cutoff.i),
+                    (right.i > binary_cutoff.i));
+            break;
+        case D64:
+            ret.d = KM_BOOL_DIFF((left.d > binary_cutoff.d),
+                    (right.d > binary_cutoff.d));
+            break;
+    }
+    return ret;
+}
+
+static inline void
+do_pairwise (void *data, cell_t *cells, size_t count, cell_mode_t mode,
+        cell_t (*calc)(cell_t, cell_t, cell_mode_t))
+{
+    dist_mat_t *mat = (dist_mat_t *)data;
+    size_t aaa = 0, bbb = 0, iii = 0;
+    for (aaa = mat->first; aaa < mat->last; aaa++) {
+        for (bbb = aaa + 1; bbb < count; bbb++) {
+            cell_t res = (*calc)(cells[aaa], cells[bbb], mode);
+            switch(mode) {
+                case U64:
+                    mat->matrix[iii++].u += res.u;
+                    break;
+                case I64:
+                    mat->matrix[iii++].i += res.i;
+                    break;
+                case D64:
+                    mat->matrix[iii++].d += res.d;
+                    break;
+            }
+        }
+    }
+}
+
+/* As do_pairwise, but with each sample's cells multiplied by its scale (e.g.
+ * the reciprocal of its total) as they are compared, so normalised rows are
+ * never stored. Cells must be D64. */
+static inline void
+do_pairwise_scaled (void *data, cell_t *cells, size_t count,
+        const long double *scale,
+        cell_t (*calc)(cell_t, cell_t, cell_mode_t))
+{
+    dist_mat_t *mat = (dist_mat_t *)data;
+    size_t aaa = 0, bbb = 0, iii = 0;
+    for (aaa = mat->first; aaa < mat->last; aaa++) {
+        cell_t left;
+        left.d = cells[aaa].d * scale[aaa];
+        for (bbb = aaa + 1; bbb < count; bbb++) {
+            cell_t right;
+            right.d = cells[bbb].d * scale[bbb];
+            mat->matrix[iii++].d += (*calc)(left, right, D64).d;
+        }
+    }
+}
+
+/* Index into mat->matrix of the pair (a, b) less b: row a of the band starts
+ * after sum(samples - 1 - k) for k in [first, a). Unsigned, so it may wrap
+ * below zero; adding b > a wraps it back. */
+static inline size_t
+distmat_base (const dist_mat_t *mat, size_t a)
+{
+    size_t rows = a - mat->first;
+    return rows * (mat->samples - 1) - (rows * (a - 1 + mat->first)) / 2 -
+        (a + 1);
+}
+
+/* As do_pairwise_scaled (with scale, or NULL for none), for one tile of the
+ * matrix but each of n_rows rows, stored one after another. The tile's part
+ * of the matrix stays in cache while the rows stream past. Cells must be
+ * D64; each pair sums rows in order, just as do_pairwise does. */
+static inline void
+do_pairwise_tile (dist_mat_t *mat, const cell_t *rows, size_t n_rows,
+        const long double *scale, const dist_tile_t *tile,
+        cell_t (*calc)(cell_t, cell_t, cell_mode_t))
+{
+    size_t rrr = 0, aaa = 0, bbb = 0;
+    for (rrr = 0; rrr < n_rows; rrr++) {
+        const cell_t *cells = rows + rrr * mat->samples;
+        for (aaa = tile->a0; aaa < tile->a1; aaa++) {
+            size_t base = distmat_base(mat, aaa);
+            cell_t left = cells[aaa];
+            if (scale != NULL) left.d *= scale[aaa];
+            for (bbb = tile->b0 > aaa ? tile->b0 : aaa + 1; bbb < tile->b1;
+                    bbb++) {
+                cell_t right = cells[bbb];
+                if (scale != NULL) right.d *= scale[bbb];
+                mat->matrix[base + bbb].d += (*calc)(left, right, D64).d;
+            }
+        }
+    }
+}
+
+/* Function prototypes */
+extern void distmat_run_tiles(dist_mat_t *mat, size_t threads,
+        dist_tile_fn fn, void *data);
+extern void distmat_alloc(table_t *tab, dist_mat_t *mat, size_t samples);
+extern size_t distmat_bands(size_t samples, size_t budget);
+extern narrow_batch_t *narrow_batch_new(arena_t *arena, size_t samples,
+        int binary);
+extern int narrow_batch_add(narrow_batch_t *nb, const cell_t *cells,
+        size_t count);
+extern void narrow_batch_tile(dist_mat_t *mat, const dist_tile_t *tile,
+        void *data);
+extern void narrow_batch_flush(dist_mat_t *mat, size_t threads);
+extern void canberra_sparse_alloc(arena_t *arena, dist_mat_t *mat,
+        size_t samples);
+extern void canberra_sparse_row(dist_mat_t *mat, const cell_t *cells,
+        size_t count, const long double *scale);
+extern void canberra_sparse_finish(dist_mat_t *mat);
+extern void print_dist_mat(table_t *tab, dist_mat_t *mat);
+extern void print_sketch_dist_mat(table_t *tab, sketch_set_t *set);
+extern void knn_set_alloc(table_t *tab, knn_set_t *set, size_t samples);
+extern void knn_add_band(knn_set_t *set, dist_mat_t *mat);
+extern void knn_add_sketches(knn_set_t *set, sketch_set_t *sketches);
+extern void print_knn(table_t *tab, knn_set_t *set);
+extern void print_dist_edges(table_t *tab, dist_mat_t *mat,
+        long double cutoff);
+extern void print_sketch_dist_edges(table_t *tab, sketch_set_t *set,
+        long double cutoff);
+
+#endif /* KDIST_H */
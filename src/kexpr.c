@@ -0,0 +1,397 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kexpr.c
+ *
+ *    Description:  Compiled row filter expressions
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 17:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "kexpr.h"
+
+/* Parse tree, only used while compiling */
+typedef enum _expr_node_kind {
+    NODE_TEST = 0,
+    NODE_AND = 1,
+    NODE_OR = 2,
+    NODE_NOT = 3,
+} expr_node_kind_t;
+
+typedef struct _expr_node {
+    expr_node_kind_t kind;
+    struct _expr_node *left;
+    struct _expr_node *right;
+    expr_test_t test;
+    size_t n_tests;
+} expr_node_t;
+
+typedef struct _expr_parser {
+    expr_t *expr;
+    const char *src;
+    const char *pos;
+    const char *err;
+} expr_parser_t;
+
+static const char *agg_names[] = {
+    "nonzero", "sum", "mean", "median", "min", "max",
+};
+
+expr_t *
+expr_new (arena_t *arena)
+{
+    expr_t *expr = arena_calloc(arena, 1, sizeof(*expr));
+    expr->arena = arena;
+    return expr;
+}
+
+/* Define a group of columns as "NAME=LIST", with LIST as for
+ * parse_column_list, counted among the columns in use */
+int
+expr_add_group (expr_t *expr, const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    expr_group_t *group = NULL;
+    size_t iii;
+    if (eq == NULL || eq == spec) {
+        return 0;
+    }
+    for (iii = 0; spec + iii < eq; iii++) {
+        if (!isalnum((unsigned char)spec[iii]) && spec[iii] != '_') {
+            return 0;
+        }
+    }
+    expr->groups = arena_grow(expr->arena, expr->groups,
+            expr->n_groups * sizeof(*expr->groups),
+            (expr->n_groups + 1) * sizeof(*expr->groups));
+    group = &expr->groups[expr->n_groups];
+    group->name = arena_calloc(expr->arena, eq - spec + 1, 1);
+    memcpy(group->name, spec, eq - spec);
+    if (!parse_column_list(expr->arena, eq + 1, &group->cols,
+                &group->n_cols)) {
+        return 0;
+    }
+    expr->n_groups++;
+    return 1;
+}
+
+static void
+parse_space (expr_parser_t *p)
+{
+    while (isspace((unsigned char)*p->pos)) p->pos++;
+}
+
+/* Consume word (case-insensitively) if it is next and not part of a
+ * longer identifier */
+static int
+parse_word (expr_parser_t *p, const char *word)
+{
+    size_t len = strlen(word);
+    parse_space(p);
+    if (strncasecmp(p->pos, word, len) == 0 &&
+            !isalnum((unsigned char)p->pos[len]) && p->pos[len] != '_') {
+        p->pos += len;
+        return 1;
+    }
+    return 0;
+}
+
+static int
+parse_sym (expr_parser_t *p, const char *sym)
+{
+    size_t len = strlen(sym);
+    parse_space(p);
+    if (strncmp(p->pos, sym, len) == 0) {
+        p->pos += len;
+        return 1;
+    }
+    return 0;
+}
+
+static expr_node_t *
+parse_fail (expr_parser_t *p, const char *err)
+{
+    if (p->err == NULL) {
+        p->err = err;
+    }
+    return NULL;
+}
+
+static expr_node_t *
+new_node (expr_parser_t *p, expr_node_kind_t kind, expr_node_t *left,
+        expr_node_t *right)
+{
+    expr_node_t *node = arena_calloc(p->expr->arena, 1, sizeof(*node));
+    node->kind = kind;
+    node->left = left;
+    node->right = right;
+    node->n_tests = (left ? left->n_tests : 0) + (right ? right->n_tests : 0);
+    return node;
+}
+
+/* Index of an aggregate, shared with any identical one already used */
+static ssize_t
+intern_agg (expr_t *expr, expr_agg_kind_t kind, expr_group_t *group)
+{
+    size_t iii;
+    for (iii = 0; iii < expr->n_aggs; iii++) {
+        if (expr->aggs[iii].kind == kind && expr->aggs[iii].group == group) {
+            return iii;
+        }
+    }
+    if (expr->n_aggs == EXPR_MAX_AGGS) {
+        return -1;
+    }
+    expr->aggs = arena_grow(expr->arena, expr->aggs,
+            expr->n_aggs * sizeof(*expr->aggs),
+            (expr->n_aggs + 1) * sizeof(*expr->aggs));
+    expr->aggs[expr->n_aggs].kind = kind;
+    expr->aggs[expr->n_aggs].group = group;
+    return expr->n_aggs++;
+}
+
+static expr_node_t *parse_or(expr_parser_t *p);
+
+/* aggregate ['(' group ')'] op number */
+static expr_node_t *
+parse_test (expr_parser_t *p)
+{
+    expr_node_t *node = NULL;
+    expr_group_t *group = NULL;
+    expr_agg_kind_t kind = EXPR_NONZERO;
+    expr_op_t op = EXPR_EQ;
+    ssize_t agg = -1;
+    char *end = NULL;
+    size_t iii;
+    for (iii = 0; iii < sizeof(agg_names) / sizeof(*agg_names); iii++) {
+        if (parse_word(p, agg_names[iii])) break;
+    }
+    if (iii == sizeof(agg_names) / sizeof(*agg_names)) {
+        return parse_fail(p, "expected an aggregate (nonzero, sum, mean, "
+                "median, min or max)");
+    }
+    kind = (expr_agg_kind_t)iii;
+    if (parse_sym(p, "(")) {
+        for (iii = 0; iii < p->expr->n_groups; iii++) {
+            if (parse_word(p, p->expr->groups[iii].name)) {
+                group = &p->expr->groups[iii];
+                break;
+            }
+        }
+        if (group == NULL) {
+            return parse_fail(p, "unknown group");
+        }
+        if (!parse_sym(p, ")")) {
+            return parse_fail(p, "expected ')'");
+        }
+    }
+    if (parse_sym(p, "<=")) op = EXPR_LE;
+    else if (parse_sym(p, ">=")) op = EXPR_GE;
+    else if (parse_sym(p, "==")) op = EXPR_EQ;
+    else if (parse_sym(p, "!=")) op = EXPR_NE;
+    else if (parse_sym(p, "<")) op = EXPR_LT;
+    else if (parse_sym(p, ">")) op = EXPR_GT;
+    else if (parse_sym(p, "=")) op = EXPR_EQ;
+    else return parse_fail(p, "expected a comparison operator");
+    agg = intern_agg(p->expr, kind, group);
+    if (agg < 0) {
+        return parse_fail(p, "too many distinct aggregates");
+    }
+    node = new_node(p, NODE_TEST, NULL, NULL);
+    node->n_tests = 1;
+    node->test.agg = agg;
+    node->test.op = op;
+    parse_space(p);
+    node->test.value = strtold(p->pos, &end);
+    if (end == p->pos) {
+        return parse_fail(p, "expected a number");
+    }
+    p->pos = end;
+    return node;
+}
+
+static expr_node_t *
+parse_not (expr_parser_t *p)
+{
+    expr_node_t *node = NULL;
+    if (parse_word(p, "not") || (parse_space(p), p->pos[0] == '!' &&
+                p->pos[1] != '=' && parse_sym(p, "!"))) {
+        node = parse_not(p);
+        return node != NULL ? new_node(p, NODE_NOT, node, NULL) : NULL;
+    }
+    if (parse_sym(p, "(")) {
+        node = parse_or(p);
+        if (node != NULL && !parse_sym(p, ")")) {
+            return parse_fail(p, "expected ')'");
+        }
+        return node;
+    }
+    return parse_test(p);
+}
+
+static expr_node_t *
+parse_and (expr_parser_t *p)
+{
+    expr_node_t *left = parse_not(p);
+    while (left != NULL && (parse_word(p, "and") || parse_sym(p, "&&"))) {
+        expr_node_t *right = parse_not(p);
+        if (right == NULL) return NULL;
+        left = new_node(p, NODE_AND, left, right);
+    }
+    return left;
+}
+
+static expr_node_t *
+parse_or (expr_parser_t *p)
+{
+    expr_node_t *left = parse_and(p);
+    while (left != NULL && (parse_word(p, "or") || parse_sym(p, "||"))) {
+        expr_node_t *right = parse_and(p);
+        if (right == NULL) return NULL;
+        left = new_node(p, NODE_OR, left, right);
+    }
+    return left;
+}
+
+/* Lay out node's tests from index at, jumping to on_true or on_false once
+ * its value is known. Tests are numbered in source order, so the right
+ * operand of and/or starts left->n_tests after the left one. */
+static void
+emit (expr_t *expr, expr_node_t *node, int at, int on_true, int on_false)
+{
+    switch (node->kind) {
+        case NODE_TEST:
+            expr->tests[at] = node->test;
+            expr->tests[at].on_true = on_true;
+            expr->tests[at].on_false = on_false;
+            break;
+        case NODE_AND:
+            emit(expr, node->left, at, at + node->left->n_tests, on_false);
+            emit(expr, node->right, at + node->left->n_tests, on_true,
+                    on_false);
+            break;
+        case NODE_OR:
+            emit(expr, node->left, at, on_true, at + node->left->n_tests);
+            emit(expr, node->right, at + node->left->n_tests, on_true,
+                    on_false);
+            break;
+        case NODE_NOT:
+            emit(expr, node->left, at, on_false, on_true);
+            break;
+    }
+}
+
+/* Compile src into expr's test program. Groups must already be added.
+ * Reports syntax errors to stderr and returns 0. */
+int
+expr_compile (expr_t *expr, const char *src)
+{
+    expr_parser_t p = {expr, src, src, NULL};
+    expr_node_t *root = parse_or(&p);
+    if (root != NULL) {
+        parse_space(&p);
+        if (*p.pos != '\0') {
+            parse_fail(&p, "unexpected trailing text");
+            root = NULL;
+        }
+    }
+    if (root == NULL) {
+        fprintf(stderr, "Bad filter expression: %s\n  %s\n  %*s^\n",
+                p.err, src, (int)(p.pos - src), "");
+        return 0;
+    }
+    expr->n_tests = root->n_tests;
+    expr->tests = arena_calloc(expr->arena, expr->n_tests,
+            sizeof(*expr->tests));
+    emit(expr, root, 0, EXPR_ACCEPT, EXPR_REJECT);
+    return 1;
+}
+
+/* Median needs a scratch copy, as median() reorders its input */
+static long double
+expr_agg_value (expr_agg_t *agg, cell_t *cells, size_t count,
+        cell_mode_t mode, scratch_t *scratch)
+{
+    size_t n = agg->group != NULL ? agg->group->n_cols : count;
+    size_t used = 0;
+    long double acc = 0.0L;
+    cell_t *median_buf = NULL;
+    size_t iii;
+    if (agg->kind == EXPR_MEDIAN) {
+        median_buf = scratch_reserve(scratch, n * sizeof(*median_buf));
+    }
+    for (iii = 0; iii < n; iii++) {
+        size_t col = agg->group != NULL ? agg->group->cols[iii] : iii;
+        long double val = 0.0L;
+        if (col >= count) break;
+        val = cell_elem(cells[col], mode);
+        switch (agg->kind) {
+            case EXPR_NONZERO:
+                acc += val > 0.0L;
+                break;
+            case EXPR_SUM:
+            case EXPR_MEAN:
+                acc += val;
+                break;
+            case EXPR_MIN:
+                if (used == 0 || val < acc) acc = val;
+                break;
+            case EXPR_MAX:
+                if (used == 0 || val > acc) acc = val;
+                break;
+            case EXPR_MEDIAN:
+                median_buf[used] = cells[col];
+                break;
+        }
+        used++;
+    }
+    if (agg->kind == EXPR_MEAN && used > 0) {
+        acc /= used;
+    } else if (agg->kind == EXPR_MEDIAN && used > 0) {
+        acc = cell_elem(median(median_buf, used, mode), mode);
+    }
+    return acc;
+}
+
+/* Run expr's program over a row's cells, with scratch (one per thread) for
+ * medians. Returns non-zero to keep it. */
+int
+expr_eval (expr_t *expr, cell_t *cells, size_t count, cell_mode_t mode,
+        scratch_t *scratch)
+{
+    long double vals[EXPR_MAX_AGGS];
+    uint64_t have = 0;
+    int pc = 0;
+    while (pc >= 0) {
+        expr_test_t *test = &expr->tests[pc];
+        long double val;
+        int pass = 0;
+        if (!(have & (1ull << test->agg))) {
+            vals[test->agg] = expr_agg_value(&expr->aggs[test->agg], cells,
+                    count, mode, scratch);
+            have |= 1ull << test->agg;
+        }
+        val = vals[test->agg];
+        switch (test->op) {
+            case EXPR_LT: pass = val < test->value; break;
+            case EXPR_LE: pass = val <= test->value; break;
+            case EXPR_GT: pass = val > test->value; break;
+            case EXPR_GE: pass = val >= test->value; break;
+            case EXPR_EQ: pass = val == test->value; break;
+            case EXPR_NE: pass = val != test->value; break;
+        }
+        pc = pass ? test->on_true : test->on_false;
+    }
+    return pc == EXPR_ACCEPT;
+}
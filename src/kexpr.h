@@ -0,0 +1,100 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kexpr.h
+ *
+ *    Description:  Compiled row filter expressions
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 17:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef KEXPR_H
+#define KEXPR_H
+
+#include "ktable.h"
+
+/*
+ * A filter expression combines comparisons of per-row aggregates with and,
+ * or and not, e.g.
+ *
+ *     nonzero >= 5 and median >= 2 and sum(A) > 100
+ *
+ * Aggregates are nonzero (count of cells above zero), sum, mean, median,
+ * min and max, over the whole row or over a named group of its columns.
+ * Operators are < <= > >= == !=, combined with and/&&, or/||, not/! and
+ * parentheses.
+ *
+ * An expression is compiled once into a flat program of tests, each
+ * naming the test to run next when it passes and when it fails, so
+ * evaluation short-circuits without recursion. Each distinct aggregate is
+ * computed at most once per row, and only when a test first needs it.
+ */
+
+/* Types */
+typedef enum _expr_agg_kind {
+    EXPR_NONZERO = 0,
+    EXPR_SUM = 1,
+    EXPR_MEAN = 2,
+    EXPR_MEDIAN = 3,
+    EXPR_MIN = 4,
+    EXPR_MAX = 5,
+} expr_agg_kind_t;
+
+typedef enum _expr_op {
+    EXPR_LT = 0,
+    EXPR_LE = 1,
+    EXPR_GT = 2,
+    EXPR_GE = 3,
+    EXPR_EQ = 4,
+    EXPR_NE = 5,
+} expr_op_t;
+
+typedef struct _expr_group {
+    char *name;
+    size_t *cols;
+    size_t n_cols;
+} expr_group_t;
+
+typedef struct _expr_agg {
+    expr_agg_kind_t kind;
+    expr_group_t *group;        /* NULL for the whole row */
+} expr_agg_t;
+
+typedef struct _expr_test {
+    size_t agg;
+    expr_op_t op;
+    long double value;
+    int on_true;                /* Next test, or EXPR_ACCEPT/EXPR_REJECT */
+    int on_false;
+} expr_test_t;
+
+typedef struct _expr {
+    arena_t *arena;
+    expr_group_t *groups;
+    size_t n_groups;
+    expr_agg_t *aggs;
+    size_t n_aggs;
+    expr_test_t *tests;
+    size_t n_tests;
+} expr_t;
+
+#define EXPR_ACCEPT (-1)
+#define EXPR_REJECT (-2)
+/* Distinct aggregates allowed in one expression */
+#define EXPR_MAX_AGGS 64
+
+/* Function prototypes */
+extern expr_t *expr_new(arena_t *arena);
+extern int expr_add_group(expr_t *expr, const char *spec);
+extern int expr_compile(expr_t *expr, const char *src);
+extern int expr_eval(expr_t *expr, cell_t *cells, size_t count,
+        cell_mode_t mode, scratch_t *scratch);
+
+#endif /* KEXPR_H */
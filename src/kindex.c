@@ -0,0 +1,279 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kindex.c
+ *
+ *    Description:  Sidecar row offset and key indices of tables
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 19:40:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ktable.h"
+#include "ksketch.h"
+
+/*
+ * An index file holds, after its header, the byte offset of data rows 0,
+ * stride, 2*stride, ... (n_marks of them), then one (hash, row) pair per
+ * data row, sorted, if the table has key columns. Seeking to a row means
+ * jumping to the mark at or before it and reading on at most stride - 1
+ * lines; a key lookup is a binary search, then a seek. The table's size
+ * and modification time are kept to spot stale indices.
+ */
+
+#define INDEX_MAGIC "KTIDX\0\0\1"
+
+typedef struct _index_header {
+    char magic[8];
+    uint64_t stride;
+    uint64_t n_rows;
+    uint64_t skiprow;
+    uint64_t skipcol;
+    char sep[8];
+    uint64_t n_marks;
+    uint64_t n_keys;
+    uint64_t table_size;
+    uint64_t table_mtime;
+} index_header_t;
+
+static int
+index_key_cmp (const void *a, const void *b)
+{
+    const table_index_key_t *x = (const table_index_key_t *)a;
+    const table_index_key_t *y = (const table_index_key_t *)b;
+    if (x->hash != y->hash) {
+        return (x->hash > y->hash) - (x->hash < y->hash);
+    }
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+static char *
+index_default_fname (table_t *tab)
+{
+    size_t len = strlen(tab->fname);
+    char *fname = arena_alloc(table_arena(tab),
+            len + sizeof(TABLE_INDEX_SUFFIX));
+    memcpy(fname, tab->fname, len);
+    memcpy(fname + len, TABLE_INDEX_SUFFIX, sizeof(TABLE_INDEX_SUFFIX));
+    return fname;
+}
+
+/* Index tab, a regular file, in one pass from its current position,
+ * writing to fname (or the table's name plus TABLE_INDEX_SUFFIX). Key
+ * hashes are only kept if tab has key columns. Returns 0 on failure. */
+int
+table_index_build (table_t *tab, const char *fname, uint64_t stride)
+{
+    index_header_t hdr;
+    struct stat st;
+    reader_t *reader = NULL;
+    FILE *out = NULL;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len = 0;
+    uint64_t offset = 0;
+    uint64_t row = 0;
+    uint64_t *marks = NULL;
+    size_t marks_cap = 0;
+    table_index_key_t *keys = NULL;
+    size_t keys_cap = 0;
+    int ok = 0;
+    if (fstat(fileno(tab->fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Can only index a regular file, not %s\n",
+                tab->fname);
+        return 0;
+    }
+    if (fname == NULL) {
+        fname = index_default_fname(tab);
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.stride = stride > 0 ? stride : TABLE_INDEX_STRIDE;
+    hdr.skiprow = tab->skiprow;
+    hdr.skipcol = tab->skipcol;
+    strncpy(hdr.sep, tab->sep, sizeof(hdr.sep) - 1);
+    hdr.table_size = st.st_size;
+    hdr.table_mtime = st.st_mtime;
+    offset = ftello(tab->fp);
+    table_stats_start(tab);
+    reader = reader_new(tab->fp, tab->io);
+    while ((len = reader != NULL ? reader_getline(reader, &line, &size) :
+                km_readline_realloc(&line, tab->fp, &size,
+                    &km_onerr_print_exit)) > 0) {
+        if (row++ < tab->skiprow) {
+            offset += len;
+            continue;
+        }
+        if (hdr.n_rows % hdr.stride == 0) {
+            if (hdr.n_marks == marks_cap) {
+                marks_cap = marks_cap > 0 ? 2 * marks_cap : 1024;
+                marks = km_realloc(marks, marks_cap * sizeof(*marks),
+                        &km_onerr_print_exit);
+            }
+            marks[hdr.n_marks++] = offset;
+        }
+        if (tab->skipcol > 0) {
+            if (hdr.n_keys == keys_cap) {
+                keys_cap = keys_cap > 0 ? 2 * keys_cap : 1024;
+                keys = km_realloc(keys, keys_cap * sizeof(*keys),
+                        &km_onerr_print_exit);
+            }
+            keys[hdr.n_keys].hash = sketch_row_hash(tab, line);
+            keys[hdr.n_keys].row = hdr.n_rows;
+            hdr.n_keys++;
+        }
+        hdr.n_rows++;
+        offset += len;
+        if (tab->stats != NULL) {
+            tab->stats->bytes += len;
+            tab->rows = hdr.n_rows;
+            table_stats_tick(tab);
+        }
+    }
+    destroy_reader_t(reader);
+    km_free(line);
+    qsort(keys, hdr.n_keys, sizeof(*keys), &index_key_cmp);
+    out = fopen(fname, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n%s\n", fname,
+                strerror(errno));
+        goto done;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+            fwrite(marks, sizeof(*marks), hdr.n_marks, out) != hdr.n_marks ||
+            fwrite(keys, sizeof(*keys), hdr.n_keys, out) != hdr.n_keys) {
+        fprintf(stderr, "Error writing index '%s'\n%s\n", fname,
+                strerror(errno));
+        fclose(out);
+        goto done;
+    }
+    ok = fclose(out) == 0;
+done:
+    km_free(marks);
+    km_free(keys);
+    return ok;
+}
+
+/* Map the index of tab from fname, or if fname is NULL from the table's
+ * name plus TABLE_INDEX_SUFFIX, in which case a missing index is not an
+ * error. Sets tab->index. Returns NULL if there is no usable index. */
+table_index_t *
+table_index_open (table_t *tab, const char *fname)
+{
+    table_index_t *idx = NULL;
+    index_header_t hdr;
+    struct stat st, tab_st;
+    int quiet = fname == NULL;
+    void *map = NULL;
+    int fd = -1;
+    if (fname == NULL) {
+        fname = index_default_fname(tab);
+    }
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        if (!quiet || errno != ENOENT) {
+            fprintf(stderr, "Could not open index '%s'\n%s\n", fname,
+                    strerror(errno));
+        }
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hdr) ||
+            pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            memcmp(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic)) != 0 ||
+            (uint64_t)st.st_size != sizeof(hdr) +
+                hdr.n_marks * sizeof(uint64_t) +
+                hdr.n_keys * sizeof(table_index_key_t)) {
+        fprintf(stderr, "'%s' is not a table index\n", fname);
+        close(fd);
+        return NULL;
+    }
+    if (fstat(fileno(tab->fp), &tab_st) != 0 ||
+            (uint64_t)tab_st.st_size != hdr.table_size ||
+            (uint64_t)tab_st.st_mtime != hdr.table_mtime) {
+        fprintf(stderr, "Index '%s' is out of date, ignoring it\n", fname);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map index '%s'\n%s\n", fname,
+                strerror(errno));
+        return NULL;
+    }
+    idx = arena_calloc(table_arena(tab), 1, sizeof(*idx));
+    idx->fname = arena_strdup(table_arena(tab), fname);
+    idx->stride = hdr.stride;
+    idx->n_rows = hdr.n_rows;
+    idx->skiprow = hdr.skiprow;
+    idx->skipcol = hdr.skipcol;
+    memcpy(idx->sep, hdr.sep, sizeof(idx->sep));
+    idx->sep[sizeof(idx->sep) - 1] = '\0';
+    idx->n_marks = hdr.n_marks;
+    idx->n_keys = hdr.n_keys;
+    idx->map = map;
+    idx->map_size = st.st_size;
+    idx->marks = (const uint64_t *)((char *)map + sizeof(hdr));
+    idx->keys = (const table_index_key_t *)(idx->marks + idx->n_marks);
+    tab->index = idx;
+    return idx;
+}
+
+/* The index struct itself lives in the table's arena */
+void
+table_index_close (table_index_t *idx)
+{
+    if (idx != NULL && idx->map != NULL) {
+        munmap(idx->map, idx->map_size);
+        idx->map = NULL;
+    }
+}
+
+/* File offset of the last indexed data row at or before row (from 0),
+ * with its number in *at. Past the last row, this is the end of input. */
+off_t
+table_index_offset (table_index_t *idx, uint64_t row, uint64_t *at)
+{
+    uint64_t mark = row / idx->stride;
+    if (row >= idx->n_rows || mark >= idx->n_marks) {
+        *at = idx->n_rows;
+        return (off_t)((index_header_t *)idx->map)->table_size;
+    }
+    *at = mark * idx->stride;
+    return (off_t)idx->marks[mark];
+}
+
+/* Look up the rows whose key hashes like key's. Sets *first to the first
+ * of them in idx->keys, and returns how many there are. Matches must be
+ * checked against the rows themselves, as hashes may collide. */
+size_t
+table_index_find (table_index_t *idx, table_t *tab, const char *key,
+        const table_index_key_t **first)
+{
+    uint64_t hash = sketch_row_hash(tab, key);
+    size_t lo = 0, hi = idx->n_keys;
+    size_t end;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->keys[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (end = lo; end < idx->n_keys && idx->keys[end].hash == hash; end++);
+    *first = &idx->keys[lo];
+    return end - lo;
+}
@@ -0,0 +1,160 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kkeyset.c
+ *
+ *    Description:  Sets of row keys, exact or as Bloom filters
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 20:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <errno.h>
+#include <math.h>
+
+#include "kkeyset.h"
+#include "ksketch.h"
+
+/* Step between a key's Bloom filter probes (double hashing) */
+static inline uint64_t
+bloom_step (uint64_t hash)
+{
+    return (((hash >> 32) | (hash << 32)) * 0x9e3779b97f4a7c15ull) | 1;
+}
+
+static void
+keyset_add (keyset_t *set, uint64_t hash)
+{
+    size_t slot;
+    if (set->bits != NULL) {
+        uint64_t step = bloom_step(hash);
+        unsigned int iii;
+        for (iii = 0; iii < set->n_hashes; iii++, hash += step) {
+            uint64_t bit = hash % set->n_bits;
+            set->bits[bit / 64] |= 1ull << (bit % 64);
+        }
+        return;
+    }
+    hash += hash == 0;
+    for (slot = hash & set->mask; set->slots[slot] != 0;
+            slot = (slot + 1) & set->mask) {
+        if (set->slots[slot] == hash) return;
+    }
+    set->slots[slot] = hash;
+}
+
+int
+keyset_has (const keyset_t *set, uint64_t hash)
+{
+    size_t slot;
+    if (set->bits != NULL) {
+        uint64_t step = bloom_step(hash);
+        unsigned int iii;
+        for (iii = 0; iii < set->n_hashes; iii++, hash += step) {
+            uint64_t bit = hash % set->n_bits;
+            if (!(set->bits[bit / 64] & (1ull << (bit % 64)))) return 0;
+        }
+        return 1;
+    }
+    hash += hash == 0;
+    for (slot = hash & set->mask; set->slots[slot] != 0;
+            slot = (slot + 1) & set->mask) {
+        if (set->slots[slot] == hash) return 1;
+    }
+    return 0;
+}
+
+/* Is line's row key (see table_row_key) in set? */
+int
+keyset_has_row (const keyset_t *set, table_t *tab, const char *line)
+{
+    return keyset_has(set, sketch_row_hash(tab, line));
+}
+
+/* Call fn on each key of spec: a comma-separated list, or "@FILE" with one
+ * key per line. Returns the number of keys, or -1 if FILE can't be read. */
+static ssize_t
+keyset_each (table_t *tab, keyset_t *set, const char *spec,
+        void (*fn)(table_t *, keyset_t *, const char *))
+{
+    ssize_t n = 0;
+    if (spec[0] == '@') {
+        FILE *fp = fopen(spec + 1, "r");
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t len = 0;
+        if (fp == NULL) {
+            fprintf(stderr, "Could not open key list '%s'\n%s\n", spec + 1,
+                    strerror(errno));
+            return -1;
+        }
+        while ((len = km_readline_realloc(&line, fp, &size,
+                        &km_onerr_print_exit)) > 0) {
+            while (len > 0 && (line[len - 1] == '\n' ||
+                        line[len - 1] == '\r')) {
+                line[--len] = '\0';
+            }
+            if (len == 0) continue;
+            if (fn != NULL) (*fn)(tab, set, line);
+            n++;
+        }
+        km_free(line);
+        fclose(fp);
+    } else {
+        char *keys = arena_strdup(table_arena(tab), spec);
+        char *np = NULL;
+        char *tok = NULL;
+        for (tok = strtok_r(keys, ",", &np); tok != NULL;
+                tok = strtok_r(NULL, ",", &np)) {
+            if (fn != NULL) (*fn)(tab, set, tok);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void
+keyset_add_key (table_t *tab, keyset_t *set, const char *key)
+{
+    keyset_add(set, sketch_row_hash(tab, key));
+}
+
+/* Load the keys of spec (see keyset_each) into a set sized for them, in
+ * tab's arena: a Bloom filter with false positive rate fpr if fpr > 0,
+ * else an exact set. Keys are hashed as rows of tab would be, so tab's
+ * separator and key columns must already be set. Returns NULL if there are
+ * no keys. */
+keyset_t *
+keyset_load (table_t *tab, const char *spec, double fpr)
+{
+    keyset_t *set = arena_calloc(table_arena(tab), 1, sizeof(*set));
+    ssize_t n = keyset_each(tab, set, spec, NULL);
+    if (n <= 0) {
+        return NULL;
+    }
+    set->n_keys = n;
+    if (fpr > 0.0 && fpr < 1.0) {
+        double bits = ceil(-(double)n * log(fpr) / (M_LN2 * M_LN2));
+        double hashes = round(bits / n * M_LN2);
+        set->n_bits = ((uint64_t)bits + 63) / 64 * 64;
+        set->n_hashes = hashes < 1.0 ? 1 :
+            hashes > KEYSET_MAX_HASHES ? KEYSET_MAX_HASHES :
+            (unsigned int)hashes;
+        set->bits = arena_alloc_pages(table_arena(tab), set->n_bits / 8,
+                tab->pages);
+    } else {
+        size_t slots = 2;
+        while (slots < 2 * (size_t)n) slots *= 2;
+        set->mask = slots - 1;
+        set->slots = arena_alloc_pages(table_arena(tab),
+                slots * sizeof(*set->slots), tab->pages);
+    }
+    keyset_each(tab, set, spec, &keyset_add_key);
+    return set;
+}
@@ -0,0 +1,56 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kkeyset.h
+ *
+ *    Description:  Sets of row keys, exact or as Bloom filters
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 20:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef KKEYSET_H
+#define KKEYSET_H
+
+#include <stdint.h>
+
+#include "ktable.h"
+
+/*
+ * A key set holds the 64-bit hashes of row keys (see table_row_key), in an
+ * open-addressing table with linear probing, kept at most half full. Two
+ * distinct keys share a hash with probability 2^-64, so for all purposes
+ * membership is exact, at 16 to 32 bytes per key.
+ *
+ * For very long lists, a Bloom filter instead takes about 1.44 log2(1/fpr)
+ * bits per key, e.g. 14.4 bits for fpr = 0.001, and claims a key not in
+ * the list is in it with probability fpr. Keys in the list are always
+ * found.
+ */
+
+/* Types */
+typedef struct _keyset {
+    size_t n_keys;
+    uint64_t *slots;            /* Hash set, 0 marking an empty slot */
+    size_t mask;
+    uint64_t *bits;             /* Bloom filter, instead of slots */
+    uint64_t n_bits;
+    unsigned int n_hashes;
+} keyset_t;
+
+#define KEYSET_BLOOM_FPR 0.001
+#define KEYSET_MAX_HASHES 16
+
+/* Function prototypes */
+extern keyset_t *keyset_load(table_t *tab, const char *spec, double fpr);
+extern int keyset_has(const keyset_t *set, uint64_t hash);
+extern int keyset_has_row(const keyset_t *set, table_t *tab,
+        const char *line);
+
+#endif /* KKEYSET_H */
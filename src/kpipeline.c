@@ -0,0 +1,767 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kpipeline.c
+ *
+ *    Description:  Chained row-processing stages over batches of table rows
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 10:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "kpipeline.h"
+#include "kprof.h"
+
+/* Never hold more than this many rows in one batch, however narrow */
+#define PIPELINE_MAX_BATCH_ROWS (1<<12)
+
+typedef struct _pipeline_worker {
+    pthread_t thread;
+    size_t id;
+    struct _pipeline_exec *ex;
+    scratch_t scratch;
+    void **partials;
+    double parse_secs;
+    double compute_secs;
+} pipeline_worker_t;
+
+typedef struct _pipeline_exec {
+    table_t *tab;
+    pipeline_t *pl;
+    arena_t *arena;
+    size_t n_stages;
+    size_t n_line_filters;
+    size_t n_workers;
+    pipeline_worker_t *workers;
+    reader_t *reader;
+    size_t first_row;           /* Lines before the row range */
+    size_t end_row;             /* Lines up to its end */
+    int stream;
+    scratch_t stream_scratch;
+    row_batch_t *batch;
+    uint64_t generation;
+    size_t pending;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finished;
+} pipeline_exec_t;
+
+pipeline_t *
+pipeline_new (void)
+{
+    return km_calloc(1, sizeof(pipeline_t), &km_onerr_print_exit);
+}
+
+void
+destroy_pipeline_t (pipeline_t *pl)
+{
+    if (pl != NULL) {
+        stage_t *stage = pl->stages;
+        while (stage != NULL) {
+            stage_t *next = stage->next;
+            free(stage);
+            stage = next;
+        }
+        free(pl);
+    }
+}
+
+static stage_t *
+pipeline_append (pipeline_t *pl, stage_kind_t kind, void *data)
+{
+    stage_t *stage = km_calloc(1, sizeof(*stage), &km_onerr_print_exit);
+    stage->kind = kind;
+    stage->data = data;
+    if (pl->last == NULL) {
+        pl->stages = stage;
+    } else {
+        pl->last->next = stage;
+    }
+    pl->last = stage;
+    return stage;
+}
+
+stage_t *
+pipeline_add_filter (pipeline_t *pl, stage_filter_fn fn, void *data)
+{
+    stage_t *stage = pipeline_append(pl, STAGE_FILTER, data);
+    stage->filter = fn;
+    return stage;
+}
+
+stage_t *
+pipeline_add_filter_local (pipeline_t *pl, stage_filter_fn fn, void *data,
+        void *(*init)(table_t *, void *))
+{
+    stage_t *stage = pipeline_append(pl, STAGE_FILTER, data);
+    stage->filter = fn;
+    stage->acc_init = init;
+    return stage;
+}
+
+stage_t *
+pipeline_add_line_filter (pipeline_t *pl, stage_filter_fn fn, void *data)
+{
+    stage_t *stage = pipeline_append(pl, STAGE_LINE_FILTER, data);
+    stage->filter = fn;
+    return stage;
+}
+
+stage_t *
+pipeline_add_transform (pipeline_t *pl, stage_row_fn fn, void *data)
+{
+    stage_t *stage = pipeline_append(pl, STAGE_TRANSFORM, data);
+    stage->fn = fn;
+    return stage;
+}
+
+stage_t *
+pipeline_add_accumulate (pipeline_t *pl, stage_row_fn fn, void *data,
+        void *(*acc_init)(table_t *, void *),
+        void (*acc_merge)(table_t *, void *, void *))
+{
+    stage_t *stage = pipeline_append(pl, STAGE_ACCUMULATE, data);
+    stage->fn = fn;
+    stage->acc_init = acc_init;
+    stage->acc_merge = acc_merge;
+    return stage;
+}
+
+stage_t *
+pipeline_add_sink (pipeline_t *pl, stage_row_fn fn, void *data)
+{
+    stage_t *stage = pipeline_append(pl, STAGE_SINK, data);
+    stage->fn = fn;
+    return stage;
+}
+
+static void
+init_row_batch (arena_t *arena, row_batch_t *batch, size_t cap, size_t cols,
+        size_t width)
+{
+    batch->rows = 0;
+    batch->cap = cap;
+    batch->cols = cols;
+    batch->width = width;
+    batch->cells = arena_calloc(arena, cap * (cols > 0 ? cols : 1),
+            sizeof(*batch->cells));
+    batch->lines = arena_calloc(arena, cap, sizeof(*batch->lines));
+    batch->line_sizes = arena_calloc(arena, cap, sizeof(*batch->line_sizes));
+    batch->offsets = arena_calloc(arena, cap, sizeof(*batch->offsets));
+    batch->lengths = arena_calloc(arena, cap, sizeof(*batch->lengths));
+    batch->keep = arena_calloc(arena, cap, sizeof(*batch->keep));
+}
+
+/* Line buffers are grown by km_readline_realloc or reader_getline, so are
+ * not arena memory */
+static void
+free_row_batch (row_batch_t *batch)
+{
+    size_t iii;
+    for (iii = 0; iii < batch->cap; iii++) {
+        km_free(batch->lines[iii]);
+    }
+}
+
+static ssize_t
+pipeline_getline (pipeline_exec_t *ex, char **line, size_t *size)
+{
+    ssize_t len = ex->reader != NULL ?
+        reader_getline(ex->reader, line, size) :
+        km_readline_realloc(line, ex->tab->fp, size, &km_onerr_print_exit);
+    if (len > 0 && ex->tab->stats != NULL) {
+        ex->tab->stats->bytes += len;
+    }
+    return len;
+}
+
+static void
+pipeline_header_row (pipeline_exec_t *ex, char *line, size_t *row)
+{
+    table_t *tab = ex->tab;
+    (*row)++;
+    if (*row == tab->skiprow && tab->select_names != NULL &&
+            tab->columns == NULL) {
+        /* Failure leaves tab->columns NULL for pipeline_run */
+        table_resolve_names(tab, line);
+    }
+    if (*row == tab->skiprow && tab->collapse != NULL &&
+            tab->group_of == NULL) {
+        /* Likewise tab->group_of */
+        table_resolve_groups(tab, line);
+    }
+    if (tab->skipped_row_fn) {
+        (*(tab->skipped_row_fn))(tab, line);
+    }
+}
+
+/* Read the next data line of the row range into *line, handing header rows
+ * to tab->skipped_row_fn on the way. */
+static ssize_t
+pipeline_next_line (pipeline_exec_t *ex, char **line, size_t *size,
+        size_t *row)
+{
+    table_t *tab = ex->tab;
+    ssize_t len = 0;
+    KPROF_DECL(mark);
+    KPROF_BEGIN(mark);
+    while (*row < ex->end_row && (len = pipeline_getline(ex, line, size)) > 0) {
+        KPROF_LAP(KPROF_READLINE, mark);
+        if (km_unlikely(*row < tab->skiprow)) {
+            pipeline_header_row(ex, *line, row);
+            KPROF_BEGIN(mark);
+            continue;
+        }
+        if (km_unlikely(*row < ex->first_row)) {
+            /* Before the row range */
+            (*row)++;
+            KPROF_BEGIN(mark);
+            continue;
+        }
+        (*row)++;
+        return len;
+    }
+    return len;
+}
+
+/* With a row range and an index, read the header rows, then start the
+ * reader at the indexed row nearest before the range */
+static int
+pipeline_seek_range (pipeline_exec_t *ex, size_t *row)
+{
+    table_t *tab = ex->tab;
+    table_index_t *idx = tab->index;
+    char *line = NULL;
+    size_t size = 0;
+    uint64_t at = 0;
+    off_t offset = 0;
+    if (idx->skiprow != tab->skiprow) {
+        fprintf(stderr, "Index '%s' was built skipping %zu rows, not %zu; "
+                "ignoring it\n", idx->fname, (size_t)idx->skiprow,
+                (size_t)tab->skiprow);
+        return 0;
+    }
+    while (*row < tab->skiprow && pipeline_getline(ex, &line, &size) > 0) {
+        pipeline_header_row(ex, line, row);
+    }
+    km_free(line);
+    offset = table_index_offset(idx, tab->range_first, &at);
+    if (ex->reader != NULL) {
+        /* The reader reads the descriptor; the FILE was never used */
+        destroy_reader_t(ex->reader);
+        if (lseek(fileno(tab->fp), offset, SEEK_SET) < 0) return -1;
+        ex->reader = reader_new(tab->fp, tab->io);
+    } else if (fseeko(tab->fp, offset, SEEK_SET) != 0) {
+        return -1;
+    }
+    *row = tab->skiprow + at;
+    return 0;
+}
+
+/* Fill batch from slot `from` onwards. Returns the number of rows held. */
+static size_t
+read_row_batch (pipeline_exec_t *ex, row_batch_t *batch, size_t from,
+        size_t *row, size_t line_hint)
+{
+    table_t *tab = ex->tab;
+    double start = tab->stats != NULL ? table_stats_now() : 0.0;
+    size_t iii;
+    if (ex->stream) {
+        /* Rows are parsed here as they are read */
+        for (iii = from; iii < batch->cap && *row < ex->end_row; iii++) {
+            ssize_t len = 0;
+            batch->offsets[iii] = ex->reader->offset;
+            len = stream_row(tab, ex->reader, &ex->stream_scratch,
+                    batch_row_cells(batch, iii), &batch->lines[iii],
+                    &batch->line_sizes[iii]);
+            if (len <= 0) break;
+            batch->lengths[iii] = len;
+            (*row)++;
+            if (tab->stats != NULL) {
+                tab->stats->bytes += len;
+            }
+        }
+        batch->rows = iii;
+        if (tab->stats != NULL) {
+            tab->stats->read_secs += table_stats_now() - start;
+        }
+        return iii;
+    }
+    for (iii = from; iii < batch->cap; iii++) {
+        if (batch->lines[iii] == NULL) {
+            batch->line_sizes[iii] = line_hint;
+            batch->lines[iii] = km_calloc(line_hint,
+                    sizeof(*batch->lines[iii]), &km_onerr_print_exit);
+        }
+        if (pipeline_next_line(ex, &batch->lines[iii],
+                    &batch->line_sizes[iii], row) <= 0) {
+            break;
+        }
+    }
+    batch->rows = iii;
+    if (tab->stats != NULL) {
+        tab->stats->read_secs += table_stats_now() - start;
+    }
+    return iii;
+}
+
+/* Fill batch with rows of cells cached by an earlier run */
+static size_t
+read_cell_batch (table_t *tab, FILE *fp, row_batch_t *batch)
+{
+    double start = tab->stats != NULL ? table_stats_now() : 0.0;
+    batch->rows = 0;
+    if (batch->cols > 0) {
+        batch->rows = fread(batch->cells, batch->cols * sizeof(cell_t),
+                batch->cap, fp);
+    }
+    if (tab->stats != NULL) {
+        tab->stats->bytes += batch->rows * batch->cols * sizeof(cell_t);
+        tab->stats->read_secs += table_stats_now() - start;
+    }
+    return batch->rows;
+}
+
+static size_t
+pipeline_read (pipeline_exec_t *ex, row_batch_t *batch, size_t *row,
+        size_t line_hint)
+{
+    if (ex->pl->cache_in != NULL) {
+        return read_cell_batch(ex->tab, ex->pl->cache_in, batch);
+    }
+    return read_row_batch(ex, batch, 0, row, line_hint);
+}
+
+static void
+pipeline_process (pipeline_exec_t *ex, pipeline_worker_t *w,
+        row_batch_t *batch, size_t from, size_t to)
+{
+    table_t *tab = ex->tab;
+    size_t rrr;
+    for (rrr = from; rrr < to; rrr++) {
+        char *line = batch->lines[rrr];
+        cell_t *cells = batch_row_cells(batch, rrr);
+        stage_t *stage = NULL;
+        size_t sss = 0;
+        double t0 = 0.0, t1 = 0.0;
+        KPROF_DECL(mark);
+        if (tab->stats != NULL) t0 = table_stats_now();
+        batch->keep[rrr] = 1;
+        if (ex->n_line_filters > 0 && line != NULL) {
+            for (stage = ex->pl->stages; stage != NULL && batch->keep[rrr];
+                    stage = stage->next) {
+                if (stage->kind == STAGE_LINE_FILTER) {
+                    batch->keep[rrr] = (*stage->filter)(tab, stage->data,
+                            line, NULL, batch->width) != 0;
+                }
+            }
+            if (!batch->keep[rrr]) {
+                if (tab->stats != NULL) {
+                    w->compute_secs += table_stats_now() - t0;
+                }
+                continue;
+            }
+        }
+        if (line != NULL && !ex->pl->lazy) {
+            if (!ex->stream) {
+                parse_row(tab, line, &w->scratch, cells);
+            }
+            if (tab->n_groups > 0) {
+                collapse_row(tab, cells);
+            }
+        }
+        if (tab->stats != NULL) t1 = table_stats_now();
+        KPROF_BEGIN(mark);
+        for (stage = ex->pl->stages; stage != NULL;
+                stage = stage->next, sss++) {
+            switch (stage->kind) {
+                case STAGE_FILTER:
+                    if (stage->acc_init == NULL) {
+                        batch->keep[rrr] = (*stage->filter)(tab,
+                                stage->data, line, cells, batch->width) != 0;
+                        break;
+                    }
+                    if (km_unlikely(w->partials[sss] == NULL)) {
+                        w->partials[sss] = (*stage->acc_init)(tab,
+                                stage->data);
+                    }
+                    batch->keep[rrr] = (*stage->filter)(tab,
+                            w->partials[sss], line, cells, batch->width) != 0;
+                    break;
+                case STAGE_TRANSFORM:
+                    (*stage->fn)(tab, stage->data, line, cells, batch->width);
+                    break;
+                case STAGE_ACCUMULATE:
+                    if (km_unlikely(w->partials[sss] == NULL)) {
+                        /* Made here so its pages are first touched by the
+                         * thread that will fill them */
+                        w->partials[sss] = (*stage->acc_init)(tab,
+                                stage->data);
+                    }
+                    (*stage->fn)(tab, w->partials[sss], line, cells,
+                            batch->width);
+                    break;
+                case STAGE_SINK:
+                case STAGE_LINE_FILTER:
+                    break;
+            }
+            if (!batch->keep[rrr]) break;
+        }
+        KPROF_LAP(KPROF_ROW_FN, mark);
+        if (tab->stats != NULL) {
+            w->parse_secs += t1 - t0;
+            w->compute_secs += table_stats_now() - t1;
+        }
+    }
+}
+
+/* Read a streamed row's whole line back from its offset in the input */
+static void
+reread_line (pipeline_exec_t *ex, row_batch_t *batch, size_t rrr)
+{
+    size_t len = batch->lengths[rrr];
+    size_t got = 0;
+    if (len + 1 > batch->line_sizes[rrr]) {
+        size_t newsz = len + 1;
+        newsz = kmroundupz(newsz);
+        batch->lines[rrr] = km_realloc(batch->lines[rrr], newsz,
+                &km_onerr_print_exit);
+        batch->line_sizes[rrr] = newsz;
+    }
+    while (got < len) {
+        ssize_t res = pread(ex->reader->fd, batch->lines[rrr] + got,
+                len - got, batch->offsets[rrr] + got);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) {
+            km_onerr_print_exit("Re-reading streamed row", __FILE__, __LINE__);
+        }
+        got += res;
+    }
+    batch->lines[rrr][len] = '\0';
+}
+
+static void
+pipeline_sink (pipeline_exec_t *ex, row_batch_t *batch)
+{
+    table_stats_t *stats = ex->tab->stats;
+    double start = stats != NULL ? table_stats_now() : 0.0;
+    size_t rrr;
+    KPROF_DECL(mark);
+    KPROF_BEGIN(mark);
+    for (rrr = 0; rrr < batch->rows; rrr++) {
+        stage_t *stage = NULL;
+        if (!batch->keep[rrr]) continue;
+        if (ex->stream && ex->pl->need_lines && batch->offsets[rrr] >= 0) {
+            reread_line(ex, batch, rrr);
+        }
+        for (stage = ex->pl->stages; stage != NULL; stage = stage->next) {
+            if (stage->kind == STAGE_SINK) {
+                (*stage->fn)(ex->tab, stage->data, batch->lines[rrr],
+                        batch_row_cells(batch, rrr), batch->width);
+            }
+        }
+        KPROF_LAP(KPROF_WRITE, mark);
+    }
+    if (ex->pl->cache_out != NULL && batch->width == batch->cols &&
+            batch->cols > 0) {
+        if (fwrite(batch->cells, batch->cols * sizeof(cell_t), batch->rows,
+                    ex->pl->cache_out) != batch->rows) {
+            km_onerr_print_exit("Writing cell cache", __FILE__, __LINE__);
+        }
+    } else if (ex->pl->cache_out != NULL && batch->width > 0) {
+        /* Collapsed rows are narrower than their slots */
+        for (rrr = 0; rrr < batch->rows; rrr++) {
+            if (fwrite(batch_row_cells(batch, rrr), sizeof(cell_t),
+                        batch->width, ex->pl->cache_out) != batch->width) {
+                km_onerr_print_exit("Writing cell cache", __FILE__,
+                        __LINE__);
+            }
+        }
+    }
+    ex->tab->rows += batch->rows;
+    if (stats != NULL) {
+        stats->write_secs += table_stats_now() - start;
+        table_stats_tick(ex->tab);
+    }
+}
+
+static void *
+pipeline_worker (void *arg)
+{
+    pipeline_worker_t *w = (pipeline_worker_t *)arg;
+    pipeline_exec_t *ex = w->ex;
+    uint64_t seen = 0;
+    for (;;) {
+        row_batch_t *batch = NULL;
+        size_t from, to;
+        pthread_mutex_lock(&ex->lock);
+        while (ex->generation == seen && !ex->done) {
+            pthread_cond_wait(&ex->start, &ex->lock);
+        }
+        if (ex->generation == seen) {
+            pthread_mutex_unlock(&ex->lock);
+            break;
+        }
+        seen = ex->generation;
+        batch = ex->batch;
+        pthread_mutex_unlock(&ex->lock);
+        from = (batch->rows * w->id) / ex->n_workers;
+        to = (batch->rows * (w->id + 1)) / ex->n_workers;
+        pipeline_process(ex, w, batch, from, to);
+        pthread_mutex_lock(&ex->lock);
+        if (--ex->pending == 0) {
+            pthread_cond_signal(&ex->finished);
+        }
+        pthread_mutex_unlock(&ex->lock);
+    }
+    return NULL;
+}
+
+static void
+pipeline_dispatch (pipeline_exec_t *ex, row_batch_t *batch)
+{
+    pthread_mutex_lock(&ex->lock);
+    ex->batch = batch;
+    ex->pending = ex->n_workers;
+    ex->generation++;
+    pthread_cond_broadcast(&ex->start);
+    pthread_mutex_unlock(&ex->lock);
+}
+
+static void
+pipeline_wait (pipeline_exec_t *ex)
+{
+    pthread_mutex_lock(&ex->lock);
+    while (ex->pending > 0) {
+        pthread_cond_wait(&ex->finished, &ex->lock);
+    }
+    pthread_mutex_unlock(&ex->lock);
+}
+
+static size_t
+pipeline_n_workers (table_t *tab, pipeline_t *pl)
+{
+    stage_t *stage = NULL;
+    if (tab->threads <= 1) return 1;
+    for (stage = pl->stages; stage != NULL; stage = stage->next) {
+        if (stage->kind == STAGE_ACCUMULATE && stage->acc_init == NULL) {
+            return 1;
+        }
+    }
+    return tab->threads;
+}
+
+int
+pipeline_run (table_t *tab, pipeline_t *pl)
+{
+    pipeline_exec_t ex;
+    row_batch_t batches[2];
+    stage_t *stage = NULL;
+    size_t cap = 0;
+    size_t width = 0;
+    size_t row = 0;
+    size_t line_size = 1<<15;
+    size_t iii, sss;
+    char *line = NULL;
+    ssize_t len = 0;
+    int cur = 0;
+
+    if (!table_is_valid(tab) || pl == NULL) {
+        return -1;
+    }
+    table_stats_start(tab);
+    memset(&ex, 0, sizeof(ex));
+    ex.tab = tab;
+    ex.pl = pl;
+    for (stage = pl->stages; stage != NULL; stage = stage->next) {
+        ex.n_stages++;
+        if (stage->kind == STAGE_LINE_FILTER) ex.n_line_filters++;
+    }
+    ex.first_row = tab->skiprow + tab->range_first;
+    ex.end_row = SIZE_MAX;
+    if (tab->range_rows > 0 && tab->range_rows < SIZE_MAX - ex.first_row) {
+        ex.end_row = ex.first_row + tab->range_rows;
+    }
+    if (pl->cache_in == NULL) {
+        ex.reader = reader_new(tab->fp, tab->io);
+        if (tab->index != NULL && tab->range_first > 0 &&
+                pipeline_seek_range(&ex, &row) != 0) {
+            fprintf(stderr, "Could not seek in %s\n%s\n", tab->fname,
+                    strerror(errno));
+            destroy_reader_t(ex.reader);
+            return -1;
+        }
+        line = km_calloc(line_size, sizeof(*line), &km_onerr_print_exit);
+        len = pipeline_next_line(&ex, &line, &line_size, &row);
+        if (len <= 0) {
+            destroy_reader_t(ex.reader);
+            km_free(line);
+            return 0;
+        }
+        /* The first data row fixes the number of data columns */
+        tab->cols = count_columns(line, tab->sep, len);
+        tab->cols = tab->cols > tab->skipcol ? tab->cols - tab->skipcol : 0;
+        if (tab->select_names != NULL && tab->columns == NULL) {
+            if (tab->skiprow == 0) {
+                fprintf(stderr, "Selecting samples by name needs a header "
+                        "row\n");
+            }
+            destroy_reader_t(ex.reader);
+            km_free(line);
+            return -1;
+        }
+        if (tab->columns != NULL) {
+            if (tab->columns[tab->n_columns - 1] >= tab->cols) {
+                fprintf(stderr, "Column %zu selected, but %s has only %zu "
+                        "data columns\n", tab->columns[tab->n_columns - 1] + 1,
+                        tab->fname, (size_t)tab->cols);
+                destroy_reader_t(ex.reader);
+                km_free(line);
+                return -1;
+            }
+            tab->cols = tab->n_columns;
+        }
+        if (tab->collapse != NULL && tab->group_of == NULL) {
+            if (tab->skiprow == 0) {
+                fprintf(stderr, "Collapsing samples needs a header row\n");
+            }
+            destroy_reader_t(ex.reader);
+            km_free(line);
+            return -1;
+        }
+    } else if (tab->cols == 0) {
+        return 0;
+    }
+    width = tab->n_groups > 0 ? tab->n_groups : tab->cols;
+    cap = pl->batch_rows;
+    if (cap == 0) {
+        cap = PIPELINE_BATCH_CELLS / (tab->cols > 0 ? tab->cols : 1);
+        if (cap > PIPELINE_MAX_BATCH_ROWS) cap = PIPELINE_MAX_BATCH_ROWS;
+        if (cap < 1) cap = 1;
+    }
+
+    /* Everything below but the line buffers lasts only for this run */
+    ex.arena = arena_new(0);
+    ex.n_workers = pipeline_n_workers(tab, pl);
+    ex.workers = arena_calloc(ex.arena, ex.n_workers, sizeof(*ex.workers));
+    for (iii = 0; iii < ex.n_workers; iii++) {
+        ex.workers[iii].id = iii;
+        ex.workers[iii].ex = &ex;
+        ex.workers[iii].scratch.arena = ex.arena;
+        ex.workers[iii].partials = arena_calloc(ex.arena, ex.n_stages,
+                sizeof(*ex.workers[iii].partials));
+    }
+    if (ex.n_workers == 1) {
+        /* Single worker accumulates straight into each stage's data */
+        for (stage = pl->stages, sss = 0; stage != NULL;
+                stage = stage->next, sss++) {
+            if (stage->kind == STAGE_ACCUMULATE) {
+                ex.workers[0].partials[sss] = stage->data;
+            }
+        }
+    }
+
+    /* Cached rows were collapsed before they were written */
+    init_row_batch(ex.arena, &batches[0], cap,
+            pl->cache_in != NULL ? width : tab->cols, width);
+    if (pl->cache_in == NULL) {
+        batches[0].lines[0] = line;
+        batches[0].line_sizes[0] = line_size;
+        batches[0].offsets[0] = -1;
+        line_size = (size_t)len + 1;
+        line_size = kmroundupz(line_size);
+        /* Stream the rest if rows are this wide, and lines needed by
+         * sinks can be read again later */
+        if (ex.reader != NULL && !pl->lazy &&
+                (size_t)len >= PIPELINE_STREAM_BYTES &&
+                (pl->need_lines == 0 ||
+                 (pl->need_lines == 1 && ex.reader->offset >= 0))) {
+            ex.stream = 1;
+            ex.stream_scratch.arena = ex.arena;
+            parse_row(tab, line, &ex.stream_scratch,
+                    batch_row_cells(&batches[0], 0));
+        }
+        read_row_batch(&ex, &batches[0], 1, &row, line_size);
+    } else {
+        read_cell_batch(tab, pl->cache_in, &batches[0]);
+    }
+
+    if (ex.n_workers == 1) {
+        /* Blocked executor: read, process and sink one batch at a time */
+        while (batches[0].rows > 0) {
+            pipeline_process(&ex, &ex.workers[0], &batches[0], 0,
+                    batches[0].rows);
+            pipeline_sink(&ex, &batches[0]);
+            if (batches[0].rows < batches[0].cap) break;
+            pipeline_read(&ex, &batches[0], &row, line_size);
+        }
+        free_row_batch(&batches[0]);
+    } else {
+        /* Threaded executor: workers parse and process one batch while
+         * this thread reads the next and sinks the previous one. */
+        init_row_batch(ex.arena, &batches[1], cap,
+                pl->cache_in != NULL ? width : tab->cols, width);
+        pthread_mutex_init(&ex.lock, NULL);
+        pthread_cond_init(&ex.start, NULL);
+        pthread_cond_init(&ex.finished, NULL);
+        for (iii = 0; iii < ex.n_workers; iii++) {
+            pthread_create(&ex.workers[iii].thread, NULL, &pipeline_worker,
+                    &ex.workers[iii]);
+        }
+        while (batches[cur].rows > 0) {
+            int eof = batches[cur].rows < batches[cur].cap;
+            pipeline_dispatch(&ex, &batches[cur]);
+            if (!eof) {
+                pipeline_read(&ex, &batches[!cur], &row, line_size);
+            } else {
+                batches[!cur].rows = 0;
+            }
+            pipeline_wait(&ex);
+            pipeline_sink(&ex, &batches[cur]);
+            cur = !cur;
+        }
+        pthread_mutex_lock(&ex.lock);
+        ex.done = 1;
+        pthread_cond_broadcast(&ex.start);
+        pthread_mutex_unlock(&ex.lock);
+        for (iii = 0; iii < ex.n_workers; iii++) {
+            pthread_join(ex.workers[iii].thread, NULL);
+        }
+        /* Fold each worker's partial state back in worker order */
+        for (stage = pl->stages, sss = 0; stage != NULL;
+                stage = stage->next, sss++) {
+            if (stage->kind != STAGE_ACCUMULATE) continue;
+            for (iii = 0; iii < ex.n_workers; iii++) {
+                if (ex.workers[iii].partials[sss] != NULL) {
+                    (*stage->acc_merge)(tab, stage->data,
+                            ex.workers[iii].partials[sss]);
+                }
+            }
+        }
+        pthread_cond_destroy(&ex.finished);
+        pthread_cond_destroy(&ex.start);
+        pthread_mutex_destroy(&ex.lock);
+        free_row_batch(&batches[0]);
+        free_row_batch(&batches[1]);
+    }
+    for (iii = 0; iii < ex.n_workers; iii++) {
+        if (tab->stats != NULL) {
+            tab->stats->parse_secs += ex.workers[iii].parse_secs;
+            tab->stats->compute_secs += ex.workers[iii].compute_secs;
+        }
+    }
+    destroy_reader_t(ex.reader);
+    destroy_arena_t(ex.arena);
+    return 0;
+}
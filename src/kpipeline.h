@@ -0,0 +1,135 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kpipeline.h
+ *
+ *    Description:  Chained row-processing stages over batches of table rows
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 10:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef KPIPELINE_H
+#define KPIPELINE_H
+
+#include "ktable.h"
+
+/*
+ * A pipeline is a chain of stages, each of which sees every row that the
+ * stages before it kept. Rows are read and parsed in batches; the executor
+ * runs filter, transform and accumulate stages over each batch (in parallel
+ * when tab->threads > 1), then runs sink stages serially in input order.
+ *
+ *   filter      Returns non-zero to keep a row. Dropped rows are not seen by
+ *               any later stage. Filters added with a local init are given
+ *               data made by it for each worker (on that worker's thread),
+ *               e.g. for scratch space, rather than the stage's data.
+ *   transform   Modifies a row's cells in place.
+ *   accumulate  Folds a row into some state. With more than one thread, each
+ *               worker folds into a private partial made by acc_init (called
+ *               on that worker's own thread), and partials are folded back
+ *               into the stage's data with acc_merge once input is exhausted.
+ *               Without acc_init, the stage's data is used directly and the
+ *               executor falls back to a single worker.
+ *   sink        Consumes kept rows in input order, e.g. to print them.
+ *   line filter Like a filter, but sees only the line (cells are NULL), and
+ *               runs before the row is parsed, ahead of every other stage.
+ *               Rows it drops are never parsed. Rows read back from a cell
+ *               cache have no line, and are always kept.
+ */
+
+/* Types */
+typedef enum _stage_kind {
+    STAGE_FILTER = 0,
+    STAGE_TRANSFORM = 1,
+    STAGE_ACCUMULATE = 2,
+    STAGE_SINK = 3,
+    STAGE_LINE_FILTER = 4,
+} stage_kind_t;
+
+typedef int (*stage_filter_fn)(table_t *, void *, char *, cell_t *, size_t);
+typedef void (*stage_row_fn)(table_t *, void *, char *, cell_t *, size_t);
+
+typedef struct _stage {
+    stage_kind_t kind;
+    void *data;
+    stage_filter_fn filter;
+    stage_row_fn fn;
+    void *(*acc_init)(table_t *, void *);     /* Or a filter's local init */
+    void (*acc_merge)(table_t *, void *, void *);
+    struct _stage *next;
+} stage_t;
+
+typedef struct _row_batch {
+    size_t rows;
+    size_t cap;
+    size_t cols;                /* Cells per row as parsed */
+    size_t width;               /* Cells per row seen by stages */
+    cell_t *cells;
+    char **lines;
+    size_t *line_sizes;
+    off_t *offsets;             /* Streamed rows' file offsets, else -1 */
+    size_t *lengths;
+    unsigned char *keep;
+} row_batch_t;
+
+/* For multi-pass tools, cache_out (if set) receives every row's cells as
+ * raw cell_t after the stages have run. A later run with cache_in set
+ * reads rows back from it instead of parsing the table again; stages then
+ * see a NULL line. With lazy set, rows are not parsed into cells at all:
+ * stages read only the tokens they need from the line, e.g. with a
+ * row_cursor_t, and their cells are not to be used.
+ *
+ * Rows of PIPELINE_STREAM_BYTES or more are parsed as they are read
+ * (see stream_row), without ever holding a whole line. Stages then see
+ * only the row's skipped (key) columns as its line. If need_lines is set,
+ * sinks still get whole lines, read again by offset for the rows they are
+ * given; input that cannot be re-read is then not streamed. Pipelines
+ * whose other stages need whole lines set it to 2, and are never
+ * streamed.
+ *
+ * If tab->collapse is set, each parsed row is summed into its sample groups
+ * (see collapse_row) before any stage but line filters sees it, and stages
+ * are given the number of groups as the row's cell count. */
+typedef struct _pipeline {
+    stage_t *stages;
+    stage_t *last;
+    size_t batch_rows;
+    FILE *cache_out;
+    FILE *cache_in;
+    int lazy;
+    int need_lines;             /* 0: keys, 1: sinks, 2: all stages */
+} pipeline_t;
+
+/* Upper bound on the number of cells parsed per batch */
+#define PIPELINE_BATCH_CELLS (1<<20)
+/* First rows at least this long switch the pipeline to streamed parsing */
+#define PIPELINE_STREAM_BYTES (1<<20)
+
+#define batch_row_cells(b, r) (&((b)->cells[(r) * (b)->cols]))
+
+/* Function prototypes */
+extern pipeline_t *pipeline_new(void);
+extern void destroy_pipeline_t(pipeline_t *pl);
+extern stage_t *pipeline_add_filter(pipeline_t *pl, stage_filter_fn fn,
+        void *data);
+extern stage_t *pipeline_add_filter_local(pipeline_t *pl,
+        stage_filter_fn fn, void *data, void *(*init)(table_t *, void *));
+extern stage_t *pipeline_add_line_filter(pipeline_t *pl, stage_filter_fn fn,
+        void *data);
+extern stage_t *pipeline_add_transform(pipeline_t *pl, stage_row_fn fn,
+        void *data);
+extern stage_t *pipeline_add_accumulate(pipeline_t *pl, stage_row_fn fn,
+        void *data, void *(*acc_init)(table_t *, void *),
+        void (*acc_merge)(table_t *, void *, void *));
+extern stage_t *pipeline_add_sink(pipeline_t *pl, stage_row_fn fn,
+        void *data);
+extern int pipeline_run(table_t *tab, pipeline_t *pl);
+
+#endif /* KPIPELINE_H */
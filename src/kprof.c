@@ -0,0 +1,265 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kprof.c
+ *
+ *    Description:  Compile-time optional phase profiling of table iteration
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 13:50:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include "kprof.h"
+
+#ifdef KTABLE_PROFILE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+#define KPROF_HAVE_PERF 1
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+typedef struct _kprof_counts {
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t cache_misses;
+    uint64_t branch_misses;
+} kprof_counts_t;
+
+typedef struct _kprof_thread {
+    kprof_counts_t phases[KPROF_N_PHASES];
+#ifdef KPROF_HAVE_PERF
+    struct perf_event_mmap_page *cache_pc;
+    struct perf_event_mmap_page *branch_pc;
+#endif
+    int have_counters;
+    struct _kprof_thread *next;
+} kprof_thread_t;
+
+static const char *kprof_phase_names[KPROF_N_PHASES] = {
+    "readline",
+    "tokenise",
+    "convert",
+    "row_fn",
+    "write",
+};
+
+static __thread kprof_thread_t *kprof_self = NULL;
+static kprof_thread_t *kprof_threads = NULL;
+static pthread_mutex_t kprof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t
+kprof_cycles (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    /* No cycle counter we can read cheaply; count nanoseconds instead */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+#ifdef KPROF_HAVE_PERF
+static struct perf_event_mmap_page *
+kprof_open_counter (uint64_t config)
+{
+    struct perf_event_attr attr;
+    struct perf_event_mmap_page *pc = NULL;
+    int fd = -1;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    /* This thread only, on any CPU */
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    pc = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pc == MAP_FAILED) {
+        return NULL;
+    }
+    if (!pc->cap_user_rdpmc || pc->index == 0) {
+        /* Counter exists, but reading it would need a syscall per mark */
+        munmap(pc, sysconf(_SC_PAGESIZE));
+        return NULL;
+    }
+    return pc;
+}
+
+/* Read a counter from user space, per the perf_event_mmap_page protocol */
+static inline uint64_t
+kprof_rdpmc (struct perf_event_mmap_page *pc)
+{
+    uint32_t seq, idx, lo, hi;
+    uint64_t count;
+    int64_t pmc;
+    do {
+        seq = pc->lock;
+        __asm__ __volatile__ ("" ::: "memory");
+        idx = pc->index;
+        count = pc->offset;
+        if (idx != 0) {
+            __asm__ __volatile__ ("rdpmc" : "=a" (lo), "=d" (hi)
+                    : "c" (idx - 1));
+            pmc = ((uint64_t)hi << 32) | lo;
+            pmc <<= 64 - pc->pmc_width;
+            pmc >>= 64 - pc->pmc_width;
+            count += pmc;
+        }
+        __asm__ __volatile__ ("" ::: "memory");
+    } while (pc->lock != seq);
+    return count;
+}
+#endif
+
+static void
+kprof_dump (void)
+{
+    kprof_counts_t totals[KPROF_N_PHASES];
+    kprof_thread_t *thr = NULL;
+    const char *fname = getenv("KTABLE_PROFILE");
+    FILE *fp = stderr;
+    size_t n_threads = 0;
+    int have_counters = 1;
+    int ppp;
+    memset(totals, 0, sizeof(totals));
+    pthread_mutex_lock(&kprof_lock);
+    for (thr = kprof_threads; thr != NULL; thr = thr->next) {
+        n_threads++;
+        have_counters &= thr->have_counters;
+        for (ppp = 0; ppp < KPROF_N_PHASES; ppp++) {
+            totals[ppp].calls += thr->phases[ppp].calls;
+            totals[ppp].cycles += thr->phases[ppp].cycles;
+            totals[ppp].cache_misses += thr->phases[ppp].cache_misses;
+            totals[ppp].branch_misses += thr->phases[ppp].branch_misses;
+        }
+    }
+    pthread_mutex_unlock(&kprof_lock);
+    if (fname != NULL && fname[0] != '\0') {
+        fp = fopen(fname, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Could not open profile output '%s'\n", fname);
+            fp = stderr;
+        }
+    }
+    fprintf(fp, "{\"threads\": %zu, \"cycle_unit\": \"%s\", \"phases\": {",
+            n_threads,
+#if defined(__x86_64__) || defined(__i386__)
+            "tsc"
+#else
+            "ns"
+#endif
+            );
+    for (ppp = 0; ppp < KPROF_N_PHASES; ppp++) {
+        fprintf(fp, "%s\n  \"%s\": {\"calls\": %llu, \"cycles\": %llu",
+                ppp > 0 ? "," : "", kprof_phase_names[ppp],
+                (unsigned long long)totals[ppp].calls,
+                (unsigned long long)totals[ppp].cycles);
+        if (have_counters && n_threads > 0) {
+            fprintf(fp, ", \"cache_misses\": %llu, \"branch_misses\": %llu",
+                    (unsigned long long)totals[ppp].cache_misses,
+                    (unsigned long long)totals[ppp].branch_misses);
+        } else {
+            fprintf(fp, ", \"cache_misses\": null, \"branch_misses\": null");
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n}}\n");
+    if (fp != stderr) {
+        fclose(fp);
+    }
+}
+
+static kprof_thread_t *
+kprof_thread_init (void)
+{
+    kprof_thread_t *thr = calloc(1, sizeof(*thr));
+    if (thr == NULL) {
+        fprintf(stderr, "Cannot allocate profiling state\n");
+        exit(EXIT_FAILURE);
+    }
+#ifdef KPROF_HAVE_PERF
+    thr->cache_pc = kprof_open_counter(PERF_COUNT_HW_CACHE_MISSES);
+    thr->branch_pc = kprof_open_counter(PERF_COUNT_HW_BRANCH_MISSES);
+    thr->have_counters = thr->cache_pc != NULL && thr->branch_pc != NULL;
+    if (!thr->have_counters) {
+        if (thr->cache_pc) munmap(thr->cache_pc, sysconf(_SC_PAGESIZE));
+        if (thr->branch_pc) munmap(thr->branch_pc, sysconf(_SC_PAGESIZE));
+    }
+#endif
+    pthread_mutex_lock(&kprof_lock);
+    if (kprof_threads == NULL) {
+        atexit(&kprof_dump);
+    }
+    thr->next = kprof_threads;
+    kprof_threads = thr;
+    pthread_mutex_unlock(&kprof_lock);
+    kprof_self = thr;
+    return thr;
+}
+
+static inline void
+kprof_read (kprof_thread_t *thr, kprof_mark_t *mark)
+{
+    mark->cycles = kprof_cycles();
+#ifdef KPROF_HAVE_PERF
+    if (thr->have_counters) {
+        mark->cache_misses = kprof_rdpmc(thr->cache_pc);
+        mark->branch_misses = kprof_rdpmc(thr->branch_pc);
+    }
+#endif
+}
+
+void
+kprof_begin (kprof_mark_t *mark)
+{
+    kprof_thread_t *thr = kprof_self;
+    if (thr == NULL) {
+        thr = kprof_thread_init();
+    }
+    memset(mark, 0, sizeof(*mark));
+    kprof_read(thr, mark);
+}
+
+void
+kprof_lap (kprof_phase_t phase, kprof_mark_t *mark)
+{
+    kprof_thread_t *thr = kprof_self;
+    kprof_counts_t *counts = NULL;
+    kprof_mark_t now;
+    if (thr == NULL) {
+        thr = kprof_thread_init();
+    }
+    memset(&now, 0, sizeof(now));
+    kprof_read(thr, &now);
+    counts = &thr->phases[phase];
+    counts->calls++;
+    counts->cycles += now.cycles - mark->cycles;
+    counts->cache_misses += now.cache_misses - mark->cache_misses;
+    counts->branch_misses += now.branch_misses - mark->branch_misses;
+    *mark = now;
+}
+
+#endif /* KTABLE_PROFILE */
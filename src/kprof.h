@@ -0,0 +1,73 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kprof.h
+ *
+ *    Description:  Compile-time optional phase profiling of table iteration
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 13:50:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef KPROF_H
+#define KPROF_H
+
+#include <stdint.h>
+
+/*
+ * Built with -DKTABLE_PROFILE (cmake -DKTABLE_PROFILE=ON), these hooks sum
+ * cycles per phase for each thread and, where perf_event_open and
+ * user-space rdpmc are permitted, cache misses and branch mispredicts too.
+ * Totals are written as JSON at exit, to the file named by the
+ * KTABLE_PROFILE environment variable or to stderr. Without the define,
+ * every hook compiles to nothing.
+ *
+ * Use as:
+ *     KPROF_DECL(mark);
+ *     KPROF_BEGIN(mark);
+ *     ... work ...
+ *     KPROF_LAP(KPROF_TOKENISE, mark);   (adds to phase, restarts mark)
+ */
+
+/* Types */
+typedef enum _kprof_phase {
+    KPROF_READLINE = 0,
+    KPROF_TOKENISE = 1,
+    KPROF_CONVERT = 2,
+    KPROF_ROW_FN = 3,
+    KPROF_WRITE = 4,
+    KPROF_N_PHASES = 5,
+} kprof_phase_t;
+
+typedef struct _kprof_mark {
+    uint64_t cycles;
+    uint64_t cache_misses;
+    uint64_t branch_misses;
+} kprof_mark_t;
+
+#ifdef KTABLE_PROFILE
+
+/* Function prototypes */
+extern void kprof_begin(kprof_mark_t *mark);
+extern void kprof_lap(kprof_phase_t phase, kprof_mark_t *mark);
+
+/* Macros */
+#define KPROF_DECL(m) kprof_mark_t m
+#define KPROF_BEGIN(m) kprof_begin(&(m))
+#define KPROF_LAP(phase, m) kprof_lap((phase), &(m))
+
+#else
+
+#define KPROF_DECL(m)
+#define KPROF_BEGIN(m)
+#define KPROF_LAP(phase, m)
+
+#endif /* KTABLE_PROFILE */
+
+#endif /* KPROF_H */
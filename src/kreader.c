@@ -0,0 +1,226 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kreader.c
+ *
+ *    Description:  Read-ahead line input for table iteration
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 18:40:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "kdm.h"
+#include "kreader.h"
+
+int
+reader_mode_from_str (reader_mode_t *mode, const char *str)
+{
+    if (strcmp(str, "thread") == 0) {
+        *mode = READER_THREAD;
+    } else if (strcmp(str, "sync") == 0) {
+        *mode = READER_SYNC;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Hand a filled buffer (len 0 marks the end of input) to the consumer */
+static void
+reader_publish (reader_t *reader, reader_buf_t *buf, size_t len)
+{
+    pthread_mutex_lock(&reader->lock);
+    buf->len = len;
+    buf->state = READER_BUF_READY;
+    pthread_cond_signal(&reader->ready);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+/* Wait until buf is free to fill. Returns 0 if the reader is stopping. */
+static int
+reader_wait_free (reader_t *reader, reader_buf_t *buf)
+{
+    int ok = 0;
+    pthread_mutex_lock(&reader->lock);
+    while (buf->state != READER_BUF_FREE && !reader->stop) {
+        pthread_cond_wait(&reader->freed, &reader->lock);
+    }
+    ok = !reader->stop;
+    pthread_mutex_unlock(&reader->lock);
+    return ok;
+}
+
+/* One read(2) per buffer, so input from a pipe is passed on as soon as it
+ * arrives. Cancellation is only allowed while blocked in read. */
+static void *
+reader_thread (void *arg)
+{
+    reader_t *reader = (reader_t *)arg;
+    size_t slot = 0;
+    int old = 0;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+    while (reader_wait_free(reader, &reader->bufs[slot])) {
+        reader_buf_t *buf = &reader->bufs[slot];
+        ssize_t got = 0;
+        do {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+            got = read(reader->fd, buf->data, reader->buf_size);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+        } while (got < 0 && errno == EINTR);
+        if (got < 0) {
+            reader->error = errno;
+            fprintf(stderr, "Error reading input\n%s\n", strerror(errno));
+        }
+        reader_publish(reader, buf, got > 0 ? got : 0);
+        if (got <= 0) {
+            break;
+        }
+        slot = (slot + 1) % reader->n_bufs;
+    }
+    return NULL;
+}
+
+/* Start reading ahead from fp. Returns NULL for READER_SYNC, in which case
+ * lines should be read from fp directly. */
+reader_t *
+reader_new (FILE *fp, reader_mode_t mode)
+{
+    reader_t *reader = NULL;
+    struct stat st;
+    size_t iii;
+    if (mode == READER_SYNC) {
+        return NULL;
+    }
+    reader = km_calloc(1, sizeof(*reader), &km_onerr_print_exit);
+    reader->fd = fileno(fp);
+    reader->mode = READER_THREAD;
+    reader->offset = -1;
+    if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        reader->offset = lseek(reader->fd, 0, SEEK_CUR);
+    }
+    reader->buf_size = READER_BUF_SIZE;
+    reader->n_bufs = READER_N_BUFS;
+    reader->bufs = km_calloc(reader->n_bufs, sizeof(*reader->bufs),
+            &km_onerr_print_exit);
+    for (iii = 0; iii < reader->n_bufs; iii++) {
+        reader->bufs[iii].data = km_malloc(reader->buf_size,
+                &km_onerr_print_exit);
+    }
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->ready, NULL);
+    pthread_cond_init(&reader->freed, NULL);
+    pthread_create(&reader->thread, NULL, &reader_thread, reader);
+    return reader;
+}
+
+void
+destroy_reader_t (reader_t *reader)
+{
+    size_t iii;
+    if (reader == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = 1;
+    pthread_cond_broadcast(&reader->freed);
+    pthread_mutex_unlock(&reader->lock);
+    /* Only takes effect if blocked in read(), e.g. on an idle pipe */
+    pthread_cancel(reader->thread);
+    pthread_join(reader->thread, NULL);
+    pthread_cond_destroy(&reader->freed);
+    pthread_cond_destroy(&reader->ready);
+    pthread_mutex_destroy(&reader->lock);
+    for (iii = 0; iii < reader->n_bufs; iii++) {
+        km_free(reader->bufs[iii].data);
+    }
+    km_free(reader->bufs);
+    km_free(reader);
+}
+
+/* Point *data at the unconsumed input in the current buffer, waiting for
+ * the reader to fill it if need be. Returns 0 at the end of input. */
+int
+reader_peek (reader_t *reader, const char **data, size_t *len)
+{
+    reader_buf_t *buf = &reader->bufs[reader->head];
+    if (reader->eof) {
+        return 0;
+    }
+    if (reader->pos == 0) {
+        /* Starting on a buffer: wait for the reader to fill it */
+        pthread_mutex_lock(&reader->lock);
+        while (buf->state != READER_BUF_READY) {
+            pthread_cond_wait(&reader->ready, &reader->lock);
+        }
+        pthread_mutex_unlock(&reader->lock);
+        if (buf->len == 0) {
+            reader->eof = 1;
+            return 0;
+        }
+    }
+    *data = buf->data + reader->pos;
+    *len = buf->len - reader->pos;
+    return 1;
+}
+
+/* Consume len bytes of what reader_peek returned, handing the buffer back
+ * to the reader once it is used up */
+void
+reader_advance (reader_t *reader, size_t len)
+{
+    reader_buf_t *buf = &reader->bufs[reader->head];
+    reader->pos += len;
+    if (reader->offset >= 0) {
+        reader->offset += len;
+    }
+    if (reader->pos == buf->len) {
+        pthread_mutex_lock(&reader->lock);
+        buf->state = READER_BUF_FREE;
+        pthread_cond_signal(&reader->freed);
+        pthread_mutex_unlock(&reader->lock);
+        reader->head = (reader->head + 1) % reader->n_bufs;
+        reader->pos = 0;
+    }
+}
+
+/* Like getline(3): read the next line, newline included, into *line,
+ * growing it as needed. Returns its length, or -1 at the end of input. */
+ssize_t
+reader_getline (reader_t *reader, char **line, size_t *size)
+{
+    const char *start = NULL;
+    size_t avail = 0;
+    size_t len = 0;
+    while (reader_peek(reader, &start, &avail)) {
+        const char *nl = memchr(start, '\n', avail);
+        size_t take = nl != NULL ? (size_t)(nl - start) + 1 : avail;
+        if (len + take + 1 > *size || *line == NULL) {
+            size_t newsz = len + take + 1;
+            newsz = kmroundupz(newsz);
+            *line = km_realloc(*line, newsz, &km_onerr_print_exit);
+            *size = newsz;
+        }
+        memcpy(*line + len, start, take);
+        len += take;
+        reader_advance(reader, take);
+        if (nl != NULL) {
+            break;
+        }
+    }
+    if (len == 0) {
+        return -1;
+    }
+    (*line)[len] = '\0';
+    return len;
+}
@@ -0,0 +1,88 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kreader.h
+ *
+ *    Description:  Read-ahead line input for table iteration
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 18:40:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef KREADER_H
+#define KREADER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+/*
+ * A reader thread fills a ring of large buffers from the input file
+ * descriptor ahead of the consumer, which splits lines out of them with
+ * reader_getline. The consumer only waits when every buffer has been
+ * consumed, i.e. when input is the bottleneck.
+ *
+ * The reader bypasses the FILE's own buffering, so nothing should have
+ * been read through the FILE beforehand; seeking it is fine.
+ *
+ * Instead of whole lines, consumers may also take input a buffer at a time
+ * with reader_peek and reader_advance. For regular files, reader->offset
+ * tracks the file offset of the next byte, so that a line can be read
+ * again later with pread(2).
+ */
+
+/* Types */
+typedef enum _reader_mode {
+    READER_THREAD = 0,          /* Reader thread doing read(2) */
+    READER_SYNC = 1,            /* No read-ahead: getline on the FILE */
+} reader_mode_t;
+
+typedef enum _reader_buf_state {
+    READER_BUF_FREE = 0,
+    READER_BUF_READY = 1,
+} reader_buf_state_t;
+
+typedef struct _reader_buf {
+    char *data;
+    size_t len;
+    reader_buf_state_t state;
+} reader_buf_t;
+
+typedef struct _reader {
+    int fd;
+    reader_mode_t mode;
+    size_t buf_size;
+    size_t n_bufs;
+    reader_buf_t *bufs;
+    size_t head;                /* Buffer being consumed */
+    size_t pos;                 /* Consumer's offset into it */
+    off_t offset;               /* File offset of the next byte, or -1 */
+    int eof;
+    int error;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t freed;
+} reader_t;
+
+#define READER_BUF_SIZE (1<<22)
+#define READER_N_BUFS 4
+
+/* Function prototypes */
+extern reader_t *reader_new(FILE *fp, reader_mode_t mode);
+extern void destroy_reader_t(reader_t *reader);
+extern ssize_t reader_getline(reader_t *reader, char **line, size_t *size);
+extern int reader_peek(reader_t *reader, const char **data, size_t *len);
+extern void reader_advance(reader_t *reader, size_t len);
+extern int reader_mode_from_str(reader_mode_t *mode, const char *str);
+
+#endif /* KREADER_H */
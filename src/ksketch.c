@@ -0,0 +1,174 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  ksketch.c
+ *
+ *    Description:  Bottom-k MinHash sketches of table columns
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 16:20:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <string.h>
+
+#include "ksketch.h"
+
+/* Give set an empty sketch for each of samples columns. set->k must be
+ * set beforehand. */
+void
+sketch_set_alloc (table_t *tab, sketch_set_t *set, size_t samples)
+{
+    if (set->k == 0) {
+        set->k = SKETCH_DEFAULT_K;
+    }
+    set->samples = samples;
+    set->hashes = arena_calloc(table_arena(tab), samples * set->k,
+            sizeof(*set->hashes));
+    set->counts = arena_calloc(table_arena(tab), samples,
+            sizeof(*set->counts));
+}
+
+/* Hash a row's key (see table_row_key). FNV-1a, then the splitmix64
+ * finaliser to spread the low bits. */
+uint64_t
+sketch_row_hash (table_t *tab, const char *line)
+{
+    size_t len = 0;
+    const char *pos = table_row_key(tab, line, &len);
+    const char *end = pos + len;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (; pos < end; pos++) {
+        hash ^= (unsigned char)*pos;
+        hash *= 0x100000001b3ull;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+static void
+sketch_sift_down (uint64_t *heap, size_t n, size_t iii)
+{
+    while (1) {
+        size_t big = iii;
+        size_t left = 2 * iii + 1;
+        size_t right = left + 1;
+        uint64_t tmp;
+        if (left < n && heap[left] > heap[big]) big = left;
+        if (right < n && heap[right] > heap[big]) big = right;
+        if (big == iii) break;
+        tmp = heap[iii];
+        heap[iii] = heap[big];
+        heap[big] = tmp;
+        iii = big;
+    }
+}
+
+/* Whether the first n hashes of heap include hash. Only hashes that would
+ * enter the heap are looked for, which is rare once it is full. */
+static int
+sketch_heap_has (const uint64_t *heap, size_t n, uint64_t hash)
+{
+    size_t iii;
+    for (iii = 0; iii < n; iii++) {
+        if (heap[iii] == hash) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Keep hash if it is among the k smallest distinct hashes seen for sample.
+ * Repeated row keys (e.g. from concatenated shards) give repeated hashes,
+ * which are kept once. */
+void
+sketch_add (sketch_set_t *set, size_t sample, uint64_t hash)
+{
+    uint64_t *heap = sketch_hashes(set, sample);
+    size_t *n = &set->counts[sample];
+    size_t iii;
+    if (*n < set->k) {
+        if (sketch_heap_has(heap, *n, hash)) {
+            return;
+        }
+        iii = (*n)++;
+        heap[iii] = hash;
+        while (iii > 0 && heap[(iii - 1) / 2] < heap[iii]) {
+            uint64_t tmp = heap[iii];
+            heap[iii] = heap[(iii - 1) / 2];
+            heap[(iii - 1) / 2] = tmp;
+            iii = (iii - 1) / 2;
+        }
+    } else if (hash < heap[0] && !sketch_heap_has(heap, *n, hash)) {
+        heap[0] = hash;
+        sketch_sift_down(heap, *n, 0);
+    }
+}
+
+/* Fold other's sketches into set's; both must still be heaps */
+void
+sketch_merge (sketch_set_t *set, sketch_set_t *other)
+{
+    size_t sss, iii;
+    for (sss = 0; sss < set->samples; sss++) {
+        uint64_t *heap = sketch_hashes(other, sss);
+        for (iii = 0; iii < other->counts[sss]; iii++) {
+            sketch_add(set, sss, heap[iii]);
+        }
+    }
+}
+
+static int
+sketch_cmp (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Sort each sketch, for comparison */
+void
+sketch_finish (sketch_set_t *set)
+{
+    size_t sss;
+    for (sss = 0; sss < set->samples; sss++) {
+        qsort(sketch_hashes(set, sss), set->counts[sss], sizeof(uint64_t),
+                &sketch_cmp);
+    }
+}
+
+/* Estimated Jaccard distance between samples a and b of a finished set */
+double
+sketch_jaccard_dist (sketch_set_t *set, size_t a, size_t b)
+{
+    uint64_t *ha = sketch_hashes(set, a);
+    uint64_t *hb = sketch_hashes(set, b);
+    size_t na = set->counts[a];
+    size_t nb = set->counts[b];
+    size_t iii = 0, jjj = 0, seen = 0, both = 0;
+    while (seen < set->k && (iii < na || jjj < nb)) {
+        if (jjj >= nb || (iii < na && ha[iii] < hb[jjj])) {
+            iii++;
+        } else if (iii >= na || hb[jjj] < ha[iii]) {
+            jjj++;
+        } else {
+            both++;
+            iii++;
+            jjj++;
+        }
+        seen++;
+    }
+    if (seen == 0) {
+        return 0.0;
+    }
+    return 1.0 - (double)both / seen;
+}
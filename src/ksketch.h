@@ -0,0 +1,54 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  ksketch.h
+ *
+ *    Description:  Bottom-k MinHash sketches of table columns
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 16:20:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#ifndef KSKETCH_H
+#define KSKETCH_H
+
+#include <stdint.h>
+
+#include "ktable.h"
+
+/*
+ * Each sample (column) is sketched as the k smallest hashes of the keys of
+ * the rows where it is non-zero. The Jaccard similarity J of two samples'
+ * row sets is estimated from the k smallest hashes of the union of their
+ * sketches, as the fraction of those found in both. The estimate is
+ * unbiased with standard error sqrt(J(1-J)/k), at most 1/(2 sqrt(k)):
+ * about 0.031 for k = 256 and 0.016 for k = 1024.
+ */
+
+/* Types */
+typedef struct _sketch_set {
+    size_t samples;
+    size_t k;
+    uint64_t *hashes;           /* samples * k; a max-heap per sample */
+    size_t *counts;
+} sketch_set_t;
+
+#define SKETCH_DEFAULT_K 256
+
+#define sketch_hashes(set, s) (&((set)->hashes[(s) * (set)->k]))
+
+/* Function prototypes */
+extern void sketch_set_alloc(table_t *tab, sketch_set_t *set, size_t samples);
+extern uint64_t sketch_row_hash(table_t *tab, const char *line);
+extern void sketch_add(sketch_set_t *set, size_t sample, uint64_t hash);
+extern void sketch_merge(sketch_set_t *set, sketch_set_t *other);
+extern void sketch_finish(sketch_set_t *set);
+extern double sketch_jaccard_dist(sketch_set_t *set, size_t a, size_t b);
+
+#endif /* KSKETCH_H */
@@ -0,0 +1,181 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kstats.c
+ *
+ *    Description:  Progress and throughput reporting for runs over tables
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 13:10:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "ktable.h"
+
+/* Seconds between progress reports */
+#define STATS_INTERVAL 2.0
+
+/* Attach stats to tab, with nothing reported until progress or summary
+ * are set */
+table_stats_t *
+table_stats_new (table_t *tab)
+{
+    table_stats_t *stats = arena_calloc(table_arena(tab), 1, sizeof(*stats));
+    stats->interval = STATS_INTERVAL;
+    tab->stats = stats;
+    return stats;
+}
+
+double
+table_stats_now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Start the clock, and find the input's size if it is a regular file */
+void
+table_stats_start (table_t *tab)
+{
+    table_stats_t *stats = tab->stats;
+    struct stat st;
+    if (stats == NULL || stats->start > 0.0) {
+        return;
+    }
+    stats->start = table_stats_now();
+    stats->last_report = stats->start;
+    if (tab->fp != NULL && fstat(fileno(tab->fp), &st) == 0 &&
+            S_ISREG(st.st_mode)) {
+        stats->total_bytes = st.st_size;
+    }
+}
+
+/* Start another pass over the input, which is then reported on its own
+ * (rows are counted afresh each pass). Set passes once it is known. */
+void
+table_stats_pass (table_t *tab)
+{
+    table_stats_t *stats = tab->stats;
+    if (stats == NULL) {
+        return;
+    }
+    stats->pass++;
+    stats->pass_bytes = stats->bytes;
+    stats->pass_start = table_stats_now();
+}
+
+static void
+table_stats_report (table_t *tab, double now)
+{
+    table_stats_t *stats = tab->stats;
+    double secs = now - (stats->pass > 0 ? stats->pass_start : stats->start);
+    uint64_t bytes = stats->bytes - stats->pass_bytes;
+    double mb = bytes / 1e6;
+    if (secs <= 0.0) {
+        secs = 1e-9;
+    }
+    fprintf(stderr, "[%s] ", tab->fname);
+    if (stats->pass > 0 && stats->passes > 0) {
+        fprintf(stderr, "pass %u/%u: ", stats->pass, stats->passes);
+    } else if (stats->pass > 0) {
+        fprintf(stderr, "pass %u: ", stats->pass);
+    }
+    fprintf(stderr, "%.1f MB", mb);
+    if (stats->total_bytes > 0) {
+        fprintf(stderr, " of %.1f MB (%.1f%%)", stats->total_bytes / 1e6,
+                100.0 * bytes / stats->total_bytes);
+    }
+    fprintf(stderr, ", %llu rows, %.0f rows/s, %.2f MB/s",
+            (unsigned long long)tab->rows, tab->rows / secs, mb / secs);
+    if (stats->total_bytes > 0 && bytes > 0 && (bytes < stats->total_bytes ||
+                stats->pass < stats->passes)) {
+        /* The rest of this pass, and any passes after it */
+        uint64_t left = bytes < stats->total_bytes ?
+            stats->total_bytes - bytes : 0;
+        unsigned long eta;
+        if (stats->pass < stats->passes) {
+            left += (uint64_t)(stats->passes - stats->pass) *
+                stats->total_bytes;
+        }
+        eta = left / (bytes / secs);
+        fprintf(stderr, ", ETA %lu:%02lu:%02lu", eta / 3600,
+                (eta / 60) % 60, eta % 60);
+    }
+    fprintf(stderr, "\n");
+    stats->last_report = now;
+}
+
+/* Report progress if it has been long enough since the last report */
+void
+table_stats_tick (table_t *tab)
+{
+    double now;
+    if (tab->stats == NULL || !tab->stats->progress) {
+        return;
+    }
+    now = table_stats_now();
+    if (now - tab->stats->last_report >= tab->stats->interval) {
+        table_stats_report(tab, now);
+    }
+}
+
+/* Write str as a JSON string, quoted and escaped */
+static void
+stats_json_string (FILE *fp, const char *str)
+{
+    const unsigned char *ppp;
+    fputc('"', fp);
+    for (ppp = (const unsigned char *)str; *ppp != '\0'; ppp++) {
+        if (*ppp == '"' || *ppp == '\\') {
+            fputc('\\', fp);
+            fputc(*ppp, fp);
+        } else if (*ppp < 0x20) {
+            fprintf(fp, "\\u%04x", *ppp);
+        } else {
+            fputc(*ppp, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/* Final progress line, then a one-line JSON summary for --stats */
+void
+table_stats_finish (table_t *tab)
+{
+    table_stats_t *stats = tab->stats;
+    double now, secs;
+    if (stats == NULL || stats->start <= 0.0) {
+        return;
+    }
+    now = table_stats_now();
+    secs = now - stats->start;
+    if (stats->progress) {
+        table_stats_report(tab, now);
+    }
+    if (stats->summary) {
+        fprintf(stderr, "{\"file\": ");
+        stats_json_string(stderr, tab->fname);
+        fprintf(stderr, ", \"bytes\": %llu, \"rows\": %llu, "
+                "\"cols\": %llu, \"threads\": %d, \"secs\": %.6f, "
+                "\"rows_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+                "\"read_secs\": %.6f, \"parse_secs\": %.6f, "
+                "\"compute_secs\": %.6f, \"write_secs\": %.6f}\n",
+                (unsigned long long)stats->bytes,
+                (unsigned long long)tab->rows, (unsigned long long)tab->cols,
+                tab->threads > 1 ? tab->threads : 1, secs,
+                secs > 0.0 ? tab->rows / secs : 0.0,
+                secs > 0.0 ? stats->bytes / secs / 1e6 : 0.0,
+                stats->read_secs, stats->parse_secs, stats->compute_secs,
+                stats->write_secs);
+    }
+}
@@ -16,25 +16,563 @@
  * ============================================================================
  */
 
+#include <errno.h>
+#include <ctype.h>
+
 #include "ktable.h"
+#include "kpipeline.h"
+#include "kprof.h"
 
+/* Count fields in the first len bytes of row the way strtok_r would see
+ * them, without taking a copy */
 size_t
 count_columns (const char *row, const char *delim, size_t len)
 {
     size_t cols = 0;
-    size_t bytes_used = 0;
-    char *tok_line = strdup(row);
-    char *tok_tmp = NULL;
-    char *tok = strtok_r(tok_line, delim, &tok_tmp);
-    while (tok != NULL && bytes_used < len) {
-        bytes_used = (tok - tok_line);
+    const char *pos = row;
+    const char *end = row + len;
+    while (pos < end && *pos != '\0') {
+        pos += strspn(pos, delim);
+        if (pos >= end || *pos == '\0') break;
         cols++;
-        tok = strtok_r(NULL, delim, &tok_tmp);
+        pos += strcspn(pos, delim);
     }
-    km_free(tok_line);
     return cols;
 }
 
+/* Parse a byte count like "512", "64K", "1.5G" (binary multiples).
+ * Returns 0 if str is not a size. */
+int
+strtosize (const char *str, size_t *size)
+{
+    char *end = NULL;
+    double val = strtod(str, &end);
+    if (end == str || val < 0.0) {
+        return 0;
+    }
+    switch (*end) {
+        case 'T': case 't':
+            val *= 1024.0;
+            /* fall through */
+        case 'G': case 'g':
+            val *= 1024.0;
+            /* fall through */
+        case 'M': case 'm':
+            val *= 1024.0;
+            /* fall through */
+        case 'K': case 'k':
+            val *= 1024.0;
+            end++;
+            break;
+        case '\0':
+            break;
+        default:
+            return 0;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    if (*end != '\0') {
+        return 0;
+    }
+    *size = (size_t)val;
+    return 1;
+}
+
+static int
+size_t_cmp (const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a;
+    size_t y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Parse spec, a comma-separated list of column numbers and ranges like
+ * "1,4-6" counted from 1, into a sorted, duplicate-free array of indices
+ * from 0 allocated in arena. Returns 0 if spec is malformed. */
+int
+parse_column_list (arena_t *arena, const char *spec, size_t **cols_out,
+        size_t *n_out)
+{
+    const char *pos = spec;
+    char *end = NULL;
+    size_t n = 0, cap = 16;
+    size_t iii, jjj;
+    size_t *cols = km_calloc(cap, sizeof(*cols), &km_onerr_print_exit);
+    while (*pos != '\0') {
+        unsigned long first = strtoul(pos, &end, 10);
+        unsigned long last = first;
+        if (end == pos || first == 0) goto fail;
+        pos = end;
+        if (*pos == '-') {
+            pos++;
+            last = strtoul(pos, &end, 10);
+            if (end == pos || last < first) goto fail;
+            pos = end;
+        }
+        for (; first <= last; first++) {
+            if (n == cap) {
+                cap *= 2;
+                cols = km_realloc(cols, cap * sizeof(*cols),
+                        &km_onerr_print_exit);
+            }
+            cols[n++] = first - 1;
+        }
+        if (*pos == ',') {
+            pos++;
+        } else if (*pos != '\0') {
+            goto fail;
+        }
+    }
+    if (n == 0) goto fail;
+    qsort(cols, n, sizeof(*cols), &size_t_cmp);
+    for (iii = jjj = 0; iii < n; iii++) {
+        if (jjj == 0 || cols[iii] != cols[jjj - 1]) {
+            cols[jjj++] = cols[iii];
+        }
+    }
+    *cols_out = arena_alloc(arena, jjj * sizeof(*cols));
+    memcpy(*cols_out, cols, jjj * sizeof(*cols));
+    *n_out = jjj;
+    km_free(cols);
+    return 1;
+fail:
+    km_free(cols);
+    return 0;
+}
+
+/* Restrict tab to the data columns in spec (see parse_column_list),
+ * counted after the skipped columns */
+int
+table_select_columns (table_t *tab, const char *spec)
+{
+    return parse_column_list(table_arena(tab), spec, &tab->columns,
+            &tab->n_columns);
+}
+
+static int
+name_cmp (const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Parse a comma-separated list of names or, given "@FILE", FILE with one
+ * name per line, into a sorted, duplicate-free array allocated in arena.
+ * Returns 0 if no names were given. */
+int
+parse_name_list (arena_t *arena, const char *spec, char ***names_out,
+        size_t *n_out)
+{
+    char *names = NULL;
+    char *tok = NULL;
+    char *np = NULL;
+    const char *delim = ",";
+    size_t cap = 16, n = 0;
+    size_t iii, jjj;
+    char **list = NULL;
+    if (spec[0] == '@') {
+        FILE *fp = fopen(spec + 1, "r");
+        size_t len = 0, size = 0;
+        ssize_t got = 0;
+        char buf[4096];
+        if (fp == NULL) {
+            fprintf(stderr, "Could not open name list '%s'\n%s\n",
+                    spec + 1, strerror(errno));
+            return 0;
+        }
+        while ((got = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            if (len + got + 1 > size) {
+                size_t newsz = 2 * (len + got + 1);
+                names = arena_grow(arena, names, size, newsz);
+                size = newsz;
+            }
+            memcpy(names + len, buf, got);
+            len += got;
+        }
+        fclose(fp);
+        if (names == NULL) {
+            return 0;
+        }
+        names[len] = '\0';
+        delim = "\r\n";
+    } else {
+        names = arena_strdup(arena, spec);
+    }
+    list = arena_calloc(arena, cap, sizeof(*list));
+    for (tok = strtok_r(names, delim, &np); tok != NULL;
+            tok = strtok_r(NULL, delim, &np)) {
+        if (n == cap) {
+            list = arena_grow(arena, list, cap * sizeof(*list),
+                    2 * cap * sizeof(*list));
+            cap *= 2;
+        }
+        list[n++] = tok;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    qsort(list, n, sizeof(*list), &name_cmp);
+    for (iii = jjj = 0; iii < n; iii++) {
+        if (jjj == 0 || strcmp(list[iii], list[jjj - 1]) != 0) {
+            list[jjj++] = list[iii];
+        }
+    }
+    *names_out = list;
+    *n_out = jjj;
+    return 1;
+}
+
+/* Select samples by name (see parse_name_list). The pipeline resolves
+ * them into tab->columns against the last skipped row, the header. Returns
+ * 0 if no names were given. */
+int
+table_select_names (table_t *tab, const char *spec)
+{
+    return parse_name_list(table_arena(tab), spec, &tab->select_names,
+            &tab->n_select_names);
+}
+
+/* Restrict tab to a range of data rows, "FIRST-LAST" counted from 1 with
+ * either end optional (e.g. "1000-", "-500"), "FIRST+COUNT" or a single
+ * row number. Rows
+ * before the range are skipped with tab->index if there is one, else
+ * read and dropped. Returns 0 if spec is malformed. */
+int
+table_select_range (table_t *tab, const char *spec)
+{
+    const char *pos = spec;
+    char *end = NULL;
+    unsigned long long first = 1, last = 0;
+    if (isdigit((unsigned char)*pos)) {
+        first = strtoull(pos, &end, 10);
+        if (first == 0) return 0;
+        pos = end;
+    }
+    if (*pos == '+') {
+        pos++;
+        if (!isdigit((unsigned char)*pos)) return 0;
+        tab->range_rows = strtoull(pos, &end, 10);
+        if (tab->range_rows == 0) return 0;
+        pos = end;
+    } else if (*pos == '-') {
+        pos++;
+        if (isdigit((unsigned char)*pos)) {
+            last = strtoull(pos, &end, 10);
+            if (last < first) return 0;
+            tab->range_rows = last - first + 1;
+            pos = end;
+        } else {
+            tab->range_rows = 0;
+        }
+    } else if (*pos == '\0' && pos != spec) {
+        tab->range_rows = 1;
+    } else {
+        return 0;
+    }
+    if (*pos != '\0') {
+        return 0;
+    }
+    tab->range_first = first - 1;
+    return 1;
+}
+
+/* Find a row's key: its leading tab->skipcol fields, or the whole line if
+ * there are none. Returns where it starts, with its length in *len. */
+const char *
+table_row_key (table_t *tab, const char *line, size_t *len)
+{
+    const char *end = line;
+    size_t col;
+    if (tab->skipcol > 0) {
+        for (col = 0; col < tab->skipcol && *end != '\0'; col++) {
+            end += strspn(end, tab->sep);
+            end += strcspn(end, tab->sep);
+        }
+    } else {
+        end = line + strcspn(line, "\r\n");
+    }
+    *len = end - line;
+    return line;
+}
+
+/* Resolve tab->select_names against a header row, setting tab->columns to
+ * the named samples in table order. Reports the first name missing from
+ * the header and returns 0 if any is. */
+int
+table_resolve_names (table_t *tab, const char *header)
+{
+    size_t len = strcspn(header, "\r\n");
+    size_t n = tab->n_select_names;
+    size_t col = 0, found = 0, iii;
+    size_t *cols = NULL;
+    char *copy = NULL;
+    char *tok = NULL;
+    char *np = NULL;
+    if (tab->select_names == NULL) {
+        return 1;
+    }
+    cols = km_calloc(n, sizeof(*cols), &km_onerr_print_exit);
+    for (iii = 0; iii < n; iii++) {
+        cols[iii] = SIZE_MAX;
+    }
+    copy = km_calloc(len + 1, 1, &km_onerr_print_exit);
+    memcpy(copy, header, len);
+    for (tok = strtok_r(copy, tab->sep, &np); tok != NULL;
+            tok = strtok_r(NULL, tab->sep, &np), col++) {
+        char **hit = NULL;
+        if (col < tab->skipcol) continue;
+        hit = bsearch(&tok, tab->select_names, n, sizeof(*hit), &name_cmp);
+        if (hit != NULL && cols[hit - tab->select_names] == SIZE_MAX) {
+            cols[hit - tab->select_names] = col - tab->skipcol;
+            found++;
+        }
+    }
+    km_free(copy);
+    if (found < n) {
+        for (iii = 0; iii < n; iii++) {
+            if (cols[iii] == SIZE_MAX) {
+                fprintf(stderr, "Sample '%s' is not in the header of %s\n",
+                        tab->select_names[iii], tab->fname);
+                break;
+            }
+        }
+        km_free(cols);
+        return 0;
+    }
+    qsort(cols, n, sizeof(*cols), &size_t_cmp);
+    tab->columns = arena_alloc(table_arena(tab), n * sizeof(*cols));
+    memcpy(tab->columns, cols, n * sizeof(*cols));
+    tab->n_columns = n;
+    km_free(cols);
+    return 1;
+}
+
+typedef struct _collapse_pair {
+    char *sample;
+    char *group;
+    size_t gid;                 /* Same for every sample of a group */
+} collapse_pair_t;
+
+static int
+collapse_pair_cmp (const void *a, const void *b)
+{
+    return strcmp(((const collapse_pair_t *)a)->sample,
+            ((const collapse_pair_t *)b)->sample);
+}
+
+static int
+collapse_group_cmp (const void *a, const void *b)
+{
+    return strcmp((*(collapse_pair_t * const *)a)->group,
+            (*(collapse_pair_t * const *)b)->group);
+}
+
+/* Sum samples into groups, given "GROUP=S1,S2;GROUP2=S3,S4" or, as
+ * "@FILE", FILE with a sample and its group on each line. The pipeline
+ * resolves the samples against the header; unlisted samples are groups of
+ * their own. Returns 0 if spec is malformed or repeats a sample. */
+int
+table_collapse_columns (table_t *tab, const char *spec)
+{
+    arena_t *arena = table_arena(tab);
+    collapse_pair_t *pairs = NULL;
+    collapse_pair_t **by_group = NULL;
+    size_t n = 0, cap = 0, n_gids = 0;
+    char *text = NULL;
+    char *entry = NULL;
+    char *ep = NULL;
+    size_t iii;
+    int from_file = spec[0] == '@';
+    if (from_file) {
+        char **lines = NULL;
+        if (!parse_name_list(arena, spec, &lines, &n)) {
+            return 0;
+        }
+        pairs = arena_calloc(arena, n, sizeof(*pairs));
+        for (iii = 0; iii < n; iii++) {
+            char *np = NULL;
+            pairs[iii].sample = strtok_r(lines[iii], " \t,", &np);
+            pairs[iii].group = strtok_r(NULL, " \t,", &np);
+            if (pairs[iii].group == NULL) {
+                fprintf(stderr, "No group for sample '%s'\n",
+                        pairs[iii].sample);
+                return 0;
+            }
+        }
+    } else {
+        text = arena_strdup(arena, spec);
+        for (entry = strtok_r(text, ";", &ep); entry != NULL;
+                entry = strtok_r(NULL, ";", &ep)) {
+            char *eq = strchr(entry, '=');
+            char *np = NULL;
+            char *tok = NULL;
+            if (eq == NULL || eq == entry) {
+                return 0;
+            }
+            *eq = '\0';
+            for (tok = strtok_r(eq + 1, ",", &np); tok != NULL;
+                    tok = strtok_r(NULL, ",", &np)) {
+                if (n == cap) {
+                    pairs = arena_grow(arena, pairs, cap * sizeof(*pairs),
+                            (cap > 0 ? 2 * cap : 16) * sizeof(*pairs));
+                    cap = cap > 0 ? 2 * cap : 16;
+                }
+                pairs[n].sample = tok;
+                pairs[n].group = entry;
+                n++;
+            }
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    qsort(pairs, n, sizeof(*pairs), &collapse_pair_cmp);
+    for (iii = 1; iii < n; iii++) {
+        if (strcmp(pairs[iii].sample, pairs[iii - 1].sample) == 0) {
+            fprintf(stderr, "Sample '%s' is in more than one group\n",
+                    pairs[iii].sample);
+            return 0;
+        }
+    }
+    /* Number the groups, through a copy of the pairs sorted by group */
+    by_group = km_calloc(n, sizeof(*by_group), &km_onerr_print_exit);
+    for (iii = 0; iii < n; iii++) {
+        by_group[iii] = &pairs[iii];
+    }
+    qsort(by_group, n, sizeof(*by_group), &collapse_group_cmp);
+    for (iii = 0; iii < n; iii++) {
+        if (iii > 0 && strcmp(by_group[iii]->group,
+                    by_group[iii - 1]->group) != 0) {
+            n_gids++;
+        }
+        by_group[iii]->gid = n_gids;
+    }
+    km_free(by_group);
+    tab->collapse = pairs;
+    tab->n_collapse = n;
+    return 1;
+}
+
+/* Resolve tab->collapse against a header row, numbering groups in order of
+ * their first column in use. Reports the first listed sample missing from
+ * the header and returns 0 if any is. */
+int
+table_resolve_groups (table_t *tab, const char *header)
+{
+    arena_t *arena = table_arena(tab);
+    collapse_pair_t *pairs = (collapse_pair_t *)tab->collapse;
+    size_t len = strcspn(header, "\r\n");
+    size_t n_cols = 0, col = 0, iii;
+    size_t *group_num = NULL;
+    unsigned char *seen = NULL;
+    char *copy = NULL;
+    char *tok = NULL;
+    char *np = NULL;
+    if (pairs == NULL) {
+        return 1;
+    }
+    copy = arena_alloc(arena, len + 1);
+    memcpy(copy, header, len);
+    copy[len] = '\0';
+    n_cols = count_columns(copy, tab->sep, len);
+    n_cols = n_cols > tab->skipcol ? n_cols - tab->skipcol : 0;
+    if (tab->columns != NULL) {
+        n_cols = tab->n_columns;
+    }
+    tab->group_of = arena_calloc(arena, n_cols > 0 ? n_cols : 1,
+            sizeof(*tab->group_of));
+    tab->group_first = arena_calloc(arena, n_cols > 0 ? n_cols : 1,
+            sizeof(*tab->group_first));
+    tab->group_names = arena_calloc(arena, n_cols > 0 ? n_cols : 1,
+            sizeof(*tab->group_names));
+    tab->n_groups = 0;
+    /* Number of each listed group once seen, by gid, and whether each
+     * listed sample has been */
+    group_num = km_calloc(tab->n_collapse, sizeof(*group_num),
+            &km_onerr_print_exit);
+    seen = km_calloc(tab->n_collapse, sizeof(*seen), &km_onerr_print_exit);
+    for (iii = 0; iii < tab->n_collapse; iii++) {
+        group_num[iii] = SIZE_MAX;
+    }
+    for (tok = strtok_r(copy, tab->sep, &np), iii = 0; tok != NULL;
+            tok = strtok_r(NULL, tab->sep, &np), col++) {
+        collapse_pair_t key = {tok, NULL, 0};
+        collapse_pair_t *hit = NULL;
+        size_t group = SIZE_MAX;
+        if (col < tab->skipcol) continue;
+        if (tab->columns != NULL && (iii >= tab->n_columns ||
+                    tab->columns[iii] != col - tab->skipcol)) continue;
+        hit = bsearch(&key, pairs, tab->n_collapse, sizeof(*pairs),
+                &collapse_pair_cmp);
+        if (hit != NULL) {
+            seen[hit - pairs] = 1;
+            group = group_num[hit->gid];
+        }
+        if (group == SIZE_MAX) {
+            group = tab->n_groups++;
+            tab->group_first[group] = iii;
+            tab->group_names[group] = hit != NULL ? hit->group : tok;
+            if (hit != NULL) {
+                group_num[hit->gid] = group;
+            }
+        }
+        tab->group_of[iii++] = group;
+    }
+    for (iii = 0; iii < tab->n_collapse && seen[iii]; iii++);
+    km_free(group_num);
+    km_free(seen);
+    if (iii < tab->n_collapse) {
+        fprintf(stderr, "Sample '%s' to collapse is not in the header of "
+                "%s\n", pairs[iii].sample, tab->fname);
+        tab->group_of = NULL;
+        tab->n_groups = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/* Sum a row's cells into its groups, in place: group g's total lands in
+ * cells[g]. Groups are numbered by their first column, so a group's slot
+ * never lies past a column still to be read. */
+void
+collapse_row (table_t *tab, cell_t *cells)
+{
+    const size_t *group_of = tab->group_of;
+    const size_t *first = tab->group_first;
+    size_t iii;
+    switch (tab->mode) {
+        case U64:
+            for (iii = 0; iii < tab->cols; iii++) {
+                size_t g = group_of[iii];
+                cells[g].u = first[g] == iii ? cells[iii].u :
+                    cells[g].u + cells[iii].u;
+            }
+            break;
+        case I64:
+            for (iii = 0; iii < tab->cols; iii++) {
+                size_t g = group_of[iii];
+                cells[g].i = first[g] == iii ? cells[iii].i :
+                    cells[g].i + cells[iii].i;
+            }
+            break;
+        case D64:
+            for (iii = 0; iii < tab->cols; iii++) {
+                size_t g = group_of[iii];
+                cells[g].d = first[g] == iii ? cells[iii].d :
+                    cells[g].d + cells[iii].d;
+            }
+            break;
+    }
+}
+
+/* The table's long-lived arena, made on first use */
+arena_t *
+table_arena (table_t *tab)
+{
+    if (tab->arena == NULL) {
+        tab->arena = arena_new(0);
+    }
+    return tab->arena;
+}
+
 inline void
 strtocellt (cell_t *cell, const char *str, char **saveptr, cell_mode_t mode)
 {
@@ -52,59 +590,287 @@ strtocellt (cell_t *cell, const char *str, char **saveptr, cell_mode_t mode)
 }
 
 
+/* Start walking line's data columns: those after tab->skipcol, limited to
+ * tab->columns if set, and to the tab->cols of the table's first row */
+void
+row_cursor_init (row_cursor_t *cur, table_t *tab, const char *line)
+{
+    cur->tab = tab;
+    cur->pos = line;
+    cur->col = 0;
+    cur->cell = 0;
+}
+
+/* The next data column's token, not NUL-terminated, or NULL at the end of
+ * the row. A trailing newline is not part of the last token. */
+const char *
+row_cursor_next (row_cursor_t *cur, size_t *len)
+{
+    table_t *tab = cur->tab;
+    while (cur->cell < tab->cols) {
+        const char *tok = NULL;
+        size_t n = 0;
+        cur->pos += strspn(cur->pos, tab->sep);
+        if (*cur->pos == '\0' || *cur->pos == '\n' || *cur->pos == '\r') {
+            return NULL;
+        }
+        tok = cur->pos;
+        n = strcspn(tok, tab->sep);
+        cur->pos += n;
+        if (cur->col++ < tab->skipcol) continue;
+        if (tab->columns != NULL &&
+                tab->columns[cur->cell] != cur->col - 1 - tab->skipcol) {
+            continue;
+        }
+        while (n > 0 && (tok[n - 1] == '\n' || tok[n - 1] == '\r')) n--;
+        cur->cell++;
+        *len = n;
+        return tok;
+    }
+    return NULL;
+}
+
+/* Whether a token would convert to a cell above zero in tab->mode. Plain
+ * zeros and numbers with a leading non-zero digit are decided without
+ * converting; anything else is converted. */
 int
-iter_table (table_t *tab)
+token_is_positive (table_t *tab, const char *tok, size_t len)
 {
-    if (!table_is_valid(tab)) {
-        return -1;
+    char buf[64];
+    cell_t cell;
+    size_t iii = 0;
+    if (len > 0 && tok[0] >= '1' && tok[0] <= '9') {
+        return 1;
     }
-    size_t buffsize = 1<<15;
-    char *line = km_calloc(buffsize, sizeof(*line), &km_onerr_print_exit);
-    cell_t *cells = NULL;
-    size_t row = 0;
-    ssize_t rowlen = 0;
-    int res = 0;
-    while ((rowlen = km_readline_realloc(&line, tab->fp, &buffsize,
-                                         &km_onerr_print_exit)) > 0) {
-        size_t col = 0;
-        size_t cell = 0;
-        char *tok_tmp = NULL;
-        char *token = NULL;
-        char *tok_line = NULL;
-        /* Skip rows we don't want */
-        if (km_unlikely(row < tab->skiprow)) {
-            row++;
-            if (tab->skipped_row_fn) {
-                (*(tab->skipped_row_fn))(tab, line);
+    if (len > 0 && (tok[0] == '-' || tok[0] == '+')) iii++;
+    while (iii < len && tok[iii] == '0') iii++;
+    if (iii < len && tok[iii] == '.') {
+        iii++;
+        while (iii < len && tok[iii] == '0') iii++;
+    }
+    if (iii == len) {
+        return 0;
+    }
+    if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+    memcpy(buf, tok, len);
+    buf[len] = '\0';
+    strtocellt(&cell, buf, NULL, tab->mode);
+    switch(tab->mode) {
+        case U64:
+            return cell.u > 0ull;
+        case I64:
+            return cell.i > 0ll;
+        case D64:
+            return cell.d > 0.0L;
+    }
+    return 0;
+}
+
+/* Grow scratch to hold at least size bytes, e.g. a copy of a row's cells */
+void *
+scratch_reserve (scratch_t *scratch, size_t size)
+{
+    if (scratch->size < size) {
+        size_t newsz = kmroundupz(size);
+        scratch->buf = arena_grow(scratch->arena, scratch->buf, scratch->size,
+                newsz);
+        scratch->size = newsz;
+    }
+    return scratch->buf;
+}
+
+/* Tokenise line into a copy held in scratch, converting the data columns
+ * (or just the selected ones) into cells. Cells the row is too short to
+ * fill are zeroed. */
+size_t
+parse_row (table_t *tab, const char *line, scratch_t *scratch, cell_t *cells)
+{
+    size_t len = strlen(line) + 1;
+    size_t col = 0;
+    size_t cell = 0;
+    char *tok_tmp = NULL;
+    char *token = NULL;
+    KPROF_DECL(mark);
+    KPROF_BEGIN(mark);
+    memcpy(scratch_reserve(scratch, len), line, len);
+    token = strtok_r(scratch->buf, tab->sep, &tok_tmp);
+    KPROF_LAP(KPROF_TOKENISE, mark);
+    while (token != NULL && cell < tab->cols) {
+        if (col++ < tab->skipcol) {
+            if (tab->skipped_col_fn) {
+                (*(tab->skipped_col_fn))(tab, token);
             }
+            token = strtok_r(NULL, tab->sep, &tok_tmp);
+            KPROF_LAP(KPROF_TOKENISE, mark);
+            continue;
+        }
+        if (tab->columns != NULL &&
+                tab->columns[cell] != col - 1 - tab->skipcol) {
+            /* Not selected: never converted */
+            token = strtok_r(NULL, tab->sep, &tok_tmp);
+            KPROF_LAP(KPROF_TOKENISE, mark);
             continue;
-        } else if (km_unlikely(cells == NULL)) {
-            /* Get the number of data columns */
-            tab->cols = count_columns(line, tab->sep, rowlen) - tab->skipcol;
-            cells = km_calloc(tab->cols, sizeof(*cells),
-                    &km_onerr_print_exit);
-        }
-        /* Tokenise the remainder of the line, reading in cells */
-        tok_line = strdup(line);
-        token = strtok_r(tok_line, tab->sep, &tok_tmp);
-        while (token != NULL && cell < tab->cols) {
-            if (col++ < tab->skipcol) {
-                if (tab->skipped_col_fn) {
-                    (*(tab->skipped_col_fn))(tab, token);
+        }
+        strtocellt(&(cells[cell++]), token, NULL, tab->mode);
+        KPROF_LAP(KPROF_CONVERT, mark);
+        token = strtok_r(NULL, tab->sep, &tok_tmp);
+        KPROF_LAP(KPROF_TOKENISE, mark);
+    }
+    if (cell < tab->cols) {
+        memset(&cells[cell], 0, (tab->cols - cell) * sizeof(*cells));
+    }
+    return cell;
+}
+
+/* Append n bytes to a growing buffer, keeping it NUL-terminated */
+static void
+stream_append (char **buf, size_t *size, size_t *len, const char *data,
+        size_t n)
+{
+    if (*len + n + 1 > *size || *buf == NULL) {
+        size_t newsz = *len + n + 1;
+        newsz = kmroundupz(newsz);
+        *buf = km_realloc(*buf, newsz, &km_onerr_print_exit);
+        *size = newsz;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+typedef struct _stream_state {
+    size_t col;
+    size_t cell;
+    size_t tok_len;
+    size_t key_len;
+} stream_state_t;
+
+/* Whether the token at st's column is kept, as part of the key or a cell */
+static inline int
+stream_wanted (table_t *tab, stream_state_t *st)
+{
+    if (st->col < tab->skipcol) {
+        return 1;
+    }
+    return st->cell < tab->cols && (tab->columns == NULL ||
+            tab->columns[st->cell] == st->col - tab->skipcol);
+}
+
+static void
+stream_token_end (table_t *tab, stream_state_t *st, scratch_t *scratch,
+        cell_t *cells, char **key, size_t *key_size)
+{
+    if (stream_wanted(tab, st)) {
+        char *token = scratch->buf;
+        token[st->tok_len] = '\0';
+        if (st->col < tab->skipcol) {
+            if (st->key_len > 0) {
+                stream_append(key, key_size, &st->key_len, tab->sep, 1);
+            }
+            stream_append(key, key_size, &st->key_len, token, st->tok_len);
+            if (tab->skipped_col_fn) {
+                (*(tab->skipped_col_fn))(tab, token);
+            }
+        } else {
+            strtocellt(&(cells[st->cell++]), token, NULL, tab->mode);
+        }
+    }
+    st->col++;
+    st->tok_len = 0;
+}
+
+/* Parse the next row straight out of reader's buffers, converting each
+ * cell as soon as its token is complete, so a row is never held whole.
+ * Only the skipped (key) columns are kept, joined by the separator, in
+ * *key. Returns the row's length in bytes, or -1 at the end of input. */
+ssize_t
+stream_row (table_t *tab, reader_t *reader, scratch_t *scratch,
+        cell_t *cells, char **key, size_t *key_size)
+{
+    unsigned char is_sep[256];
+    const unsigned char *sep = (const unsigned char *)tab->sep;
+    const char *data = NULL;
+    stream_state_t st = {0, 0, 0, 0};
+    size_t avail = 0;
+    size_t row_len = 0;
+    int in_token = 0;
+    int done = 0;
+    memset(is_sep, 0, sizeof(is_sep));
+    for (; *sep != '\0'; sep++) {
+        is_sep[*sep] = 1;
+    }
+    is_sep['\n'] = 1;
+    stream_append(key, key_size, &st.key_len, "", 0);
+    while (!done && reader_peek(reader, &data, &avail)) {
+        size_t iii = 0;
+        while (iii < avail && !done) {
+            unsigned char c = data[iii];
+            if (!is_sep[c]) {
+                /* Token bytes, possibly continuing from the last buffer */
+                size_t jjj = iii;
+                while (jjj < avail && !is_sep[(unsigned char)data[jjj]]) jjj++;
+                if (stream_wanted(tab, &st)) {
+                    size_t need = st.tok_len + (jjj - iii) + 1;
+                    if (need > scratch->size) {
+                        size_t newsz = need;
+                        newsz = kmroundupz(newsz);
+                        scratch->buf = arena_grow(scratch->arena,
+                                scratch->buf, scratch->size, newsz);
+                        scratch->size = newsz;
+                    }
+                    memcpy(scratch->buf + st.tok_len, data + iii, jjj - iii);
                 }
-                token = strtok_r(NULL, tab->sep, &tok_tmp);
-               continue;
+                st.tok_len += jjj - iii;
+                in_token = 1;
+                iii = jjj;
+                continue;
             }
-            strtocellt(&(cells[cell++]), token, NULL, D64);
-            token = strtok_r(NULL, tab->sep, &tok_tmp);
+            if (in_token) {
+                /* A separator or newline ends the token */
+                stream_token_end(tab, &st, scratch, cells, key, key_size);
+                in_token = 0;
+            }
+            done = c == '\n';
+            iii++;
         }
-        km_free(tok_line);
-        (*(tab->row_fn))(tab, line, cells, tab->cols);
-        row++;
-        tab->rows++;
+        row_len += iii;
+        reader_advance(reader, iii);
+    }
+    if (in_token) {
+        /* Last row, without a newline */
+        stream_token_end(tab, &st, scratch, cells, key, key_size);
+    }
+    if (row_len == 0) {
+        return -1;
     }
-    km_free(line);
-    km_free(cells);
+    if (st.cell < tab->cols) {
+        memset(&cells[st.cell], 0, (tab->cols - st.cell) * sizeof(*cells));
+    }
+    return row_len;
+}
+
+static void
+iter_table_row (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    (*(tab->row_fn))(tab, line, cells, count);
+}
+
+/* Run tab->row_fn over every data row. This is a pipeline with a single
+ * sink, so rows are still parsed in parallel when tab->threads > 1. */
+int
+iter_table (table_t *tab)
+{
+    pipeline_t *pl = NULL;
+    int res = 0;
+    if (!table_is_valid(tab) || tab->row_fn == NULL) {
+        return -1;
+    }
+    pl = pipeline_new();
+    pl->need_lines = 1;
+    pipeline_add_sink(pl, &iter_table_row, NULL);
+    res = pipeline_run(tab, pl);
+    destroy_pipeline_t(pl);
     return res;
 }
 
@@ -153,3 +919,49 @@ median(cell_t arr[], int n, cell_mode_t mode)
         high = hh - 1;
     }
 }
+
+/* Summarise a row: one pass for its sum, non-zero count and extremes, then
+ * median()'s selection for its median, which reorders cells */
+void
+row_summary (cell_t *cells, size_t n, cell_mode_t mode, row_summary_t *sum)
+{
+    size_t iii;
+    memset(sum, 0, sizeof(*sum));
+    if (n == 0) {
+        return;
+    }
+    sum->min = sum->max = cells[0];
+    switch (mode) {
+        case U64:
+            for (iii = 0; iii < n; iii++) {
+                uint64_t x = cells[iii].u;
+                sum->sum.u += x;
+                sum->nonzero += x != 0;
+                if (x < sum->min.u) sum->min.u = x;
+                if (x > sum->max.u) sum->max.u = x;
+            }
+            sum->mean = (double)sum->sum.u / n;
+            break;
+        case I64:
+            for (iii = 0; iii < n; iii++) {
+                int64_t x = cells[iii].i;
+                sum->sum.i += x;
+                sum->nonzero += x != 0;
+                if (x < sum->min.i) sum->min.i = x;
+                if (x > sum->max.i) sum->max.i = x;
+            }
+            sum->mean = (double)sum->sum.i / n;
+            break;
+        case D64:
+            for (iii = 0; iii < n; iii++) {
+                long double x = cells[iii].d;
+                sum->sum.d += x;
+                sum->nonzero += x != 0.0;
+                if (x < sum->min.d) sum->min.d = x;
+                if (x > sum->max.d) sum->max.d = x;
+            }
+            sum->mean = (double)(sum->sum.d / n);
+            break;
+    }
+    sum->median = median(cells, n, mode);
+}
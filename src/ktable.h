@@ -24,6 +24,8 @@
 #include <stdint.h>
 
 #include "kdm.h"
+#include "karena.h"
+#include "kreader.h"
 
 /* Types */
 typedef union _cell {
@@ -38,6 +40,49 @@ typedef enum _cell_mode {
     D64 = 2,
 } cell_mode_t;
 
+/* Progress and throughput of a run over a table. Phase times are summed
+ * over threads, so may exceed the wall time when tab->threads > 1. */
+typedef struct _table_stats {
+    int progress;
+    int summary;
+    double interval;
+    double start;
+    double last_report;
+    uint64_t bytes;
+    uint64_t total_bytes;       /* Of one pass over the input */
+    unsigned pass;              /* Of a run of several passes, or 0 */
+    unsigned passes;            /* In all, or 0 until known */
+    uint64_t pass_bytes;        /* Read before this pass */
+    double pass_start;
+    double read_secs;
+    double parse_secs;
+    double compute_secs;
+    double write_secs;
+} table_stats_t;
+
+/* Row key hashes of a table index, sorted by hash then row */
+typedef struct _table_index_key {
+    uint64_t hash;
+    uint64_t row;
+} table_index_key_t;
+
+/* A sidecar index of a table (see kindex.c), mapped read-only: the byte
+ * offset of every stride-th data row, and each data row's key hash */
+typedef struct _table_index {
+    char *fname;
+    uint64_t stride;
+    uint64_t n_rows;
+    uint64_t skiprow;
+    uint64_t skipcol;
+    char sep[8];
+    uint64_t n_marks;
+    uint64_t n_keys;
+    const uint64_t *marks;
+    const table_index_key_t *keys;
+    void *map;
+    size_t map_size;
+} table_index_t;
+
 typedef struct _table {
     FILE *fp;
     char *fname;
@@ -49,13 +94,60 @@ typedef struct _table {
     uint64_t skiprow;
     uint64_t skipcol;
     cell_mode_t mode;
+    int threads;
+    arena_pages_t pages;
+    reader_mode_t io;
+    size_t *columns;            /* Data columns to use, sorted, or NULL */
+    size_t n_columns;
+    char **select_names;        /* Samples to resolve into columns */
+    size_t n_select_names;
+    void *collapse;             /* Samples to sum into groups, by name */
+    size_t n_collapse;
+    size_t *group_of;           /* Group of each column in use */
+    size_t *group_first;        /* First column of each group */
+    char **group_names;
+    size_t n_groups;            /* Columns after collapsing, or 0 */
+    uint64_t range_first;       /* First data row to use, from 0 */
+    uint64_t range_rows;        /* Data rows to use, or 0 for all */
+    table_index_t *index;
+    table_stats_t *stats;
+    arena_t *arena;
     void *data;
     int (*skipped_row_fn)(struct _table *, char *);
     int (*skipped_col_fn)(struct _table *, char *);
     void (*row_fn)(struct _table *, char *, cell_t *, size_t);
 } table_t;
 
+/* Tokenisation scratch space, grown within an arena */
+typedef struct _scratch {
+    arena_t *arena;
+    char *buf;
+    size_t size;
+} scratch_t;
+
+/* Walks a line's data columns in place, without copying or converting */
+typedef struct _row_cursor {
+    table_t *tab;
+    const char *pos;
+    size_t col;
+    size_t cell;
+} row_cursor_t;
+
+/* Statistics of a row's cells, from row_summary */
+typedef struct _row_summary {
+    uint64_t nonzero;
+    cell_t sum;
+    cell_t min;
+    cell_t max;
+    cell_t median;
+    double mean;
+} row_summary_t;
+
+#define TABLE_INDEX_STRIDE 1024
+#define TABLE_INDEX_SUFFIX ".kti"
+
 /* Macros */
+/* tab->stats, tab->data and everything they point to live in tab->arena */
 #define	destroy_table_t(t) do {                                             \
     if ((t) != NULL) {                                                      \
         if ((t)->fname != NULL) free((t)->fname);                           \
@@ -63,7 +155,8 @@ typedef struct _table {
         if ((t)->sep != NULL) free((t)->sep);                               \
         if ((t)->fp != NULL) fclose((t)->fp);                               \
         if ((t)->outfp != NULL) fclose((t)->outfp);                         \
-        if ((t)->data != NULL) free((t)->data);                             \
+        table_index_close((t)->index);                                      \
+        destroy_arena_t((t)->arena);                                        \
         free((t));                                                          \
     }} while (0)
 
@@ -83,7 +176,43 @@ typedef struct _table {
 extern void strtocellt(cell_t *cell, const char *str, char **saveptr,
         cell_mode_t mode);
 extern size_t count_columns(const char *row, const char *delim, size_t len);
+extern int strtosize(const char *str, size_t *size);
+extern int parse_column_list(arena_t *arena, const char *spec,
+        size_t **cols, size_t *n);
+extern int table_select_columns(table_t *tab, const char *spec);
+extern int parse_name_list(arena_t *arena, const char *spec, char ***names,
+        size_t *n);
+extern int table_select_names(table_t *tab, const char *spec);
+extern int table_select_range(table_t *tab, const char *spec);
+extern const char *table_row_key(table_t *tab, const char *line, size_t *len);
+extern int table_resolve_names(table_t *tab, const char *header);
+extern int table_collapse_columns(table_t *tab, const char *spec);
+extern int table_resolve_groups(table_t *tab, const char *header);
+extern void collapse_row(table_t *tab, cell_t *cells);
+extern void row_cursor_init(row_cursor_t *cur, table_t *tab, const char *line);
+extern const char *row_cursor_next(row_cursor_t *cur, size_t *len);
+extern int token_is_positive(table_t *tab, const char *tok, size_t len);
+extern void *scratch_reserve(scratch_t *scratch, size_t size);
+extern size_t parse_row(table_t *tab, const char *line, scratch_t *scratch,
+        cell_t *cells);
+extern ssize_t stream_row(table_t *tab, reader_t *reader, scratch_t *scratch,
+        cell_t *cells, char **key, size_t *key_size);
+extern arena_t *table_arena(table_t *tab);
 int iter_table (table_t *tab);
+extern int table_index_build(table_t *tab, const char *fname,
+        uint64_t stride);
+extern table_index_t *table_index_open(table_t *tab, const char *fname);
+extern void table_index_close(table_index_t *idx);
+extern off_t table_index_offset(table_index_t *idx, uint64_t row,
+        uint64_t *at);
+extern size_t table_index_find(table_index_t *idx, table_t *tab,
+        const char *key, const table_index_key_t **first);
+extern table_stats_t *table_stats_new(table_t *tab);
+extern double table_stats_now(void);
+extern void table_stats_start(table_t *tab);
+extern void table_stats_tick(table_t *tab);
+extern void table_stats_pass(table_t *tab);
+extern void table_stats_finish(table_t *tab);
 
 /*
  *  This Quickselect routine is based on the algorithm described in
@@ -93,5 +222,7 @@ int iter_table (table_t *tab);
  */
 #define ELEM_SWAP(a,b) { register cell_t t=(a);(a)=(b);(b)=t; }
 extern cell_t median(cell_t arr[], int n, cell_mode_t mode);
+extern void row_summary(cell_t *cells, size_t n, cell_mode_t mode,
+        row_summary_t *sum);
 
 #endif /* TABLE_H */
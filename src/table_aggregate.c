@@ -0,0 +1,520 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  table_aggregate.c
+ *
+ *    Description:  tableAggregate: Merge rows of large tables sharing a key
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 21:10:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc 4.7+ or clang 3.2+
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "kdm.h"
+#include "ktable.h"
+#include "ksketch.h"
+
+/* Long options without a short equivalent */
+#define OPT_PROGRESS 256
+#define OPT_STATS 257
+#define OPT_IO 258
+#define OPT_SORTED 259
+#define OPT_MEMLIMIT 260
+
+/* Spilled rows are split into 2^TA_PART_BITS partitions per level, each
+ * level using the next bits of the key hash */
+#define TA_PART_BITS 4
+#define TA_PARTITIONS (1 << TA_PART_BITS)
+#define TA_MAX_LEVEL (32 / TA_PART_BITS)
+
+typedef enum _ta_op {
+    TA_SUM = 0,
+    TA_MAX = 1,
+    TA_MIN = 2,
+} ta_op_t;
+
+typedef struct _ta_group {
+    cell_t *cells;
+    char *key;
+    size_t key_len;
+    uint64_t hash;
+    struct _ta_group *next;     /* In order of first appearance */
+} ta_group_t;
+
+typedef struct _ta {
+    ta_op_t op;
+    int sorted;
+    size_t mem_limit;
+    /* Sorted input: the group being read */
+    char *key;
+    size_t key_size;
+    size_t key_len;
+    cell_t *cells;
+    size_t count;
+    size_t unsorted;
+    /* Hash aggregation: groups of this level, and partitions of rows whose
+     * keys arrived once the memory limit was reached */
+    arena_t *arena;
+    ta_group_t **slots;
+    size_t mask;
+    size_t n_groups;
+    ta_group_t *first;
+    ta_group_t *last;
+    size_t mem_used;
+    unsigned int level;
+    FILE **parts;
+} ta_t;
+
+#define TA_FOLD(acc, cell, op) do {                                         \
+        if ((op) == TA_SUM) (acc) += (cell);                                \
+        else if ((op) == TA_MAX ? (cell) > (acc) : (cell) < (acc))          \
+            (acc) = (cell);                                                 \
+    } while (0)
+
+static void
+ta_fold (ta_t *ta, cell_mode_t mode, cell_t *acc, const cell_t *cells,
+        size_t count)
+{
+    size_t iii;
+    switch (mode) {
+        case U64:
+            for (iii = 0; iii < count; iii++) {
+                TA_FOLD(acc[iii].u, cells[iii].u, ta->op);
+            }
+            break;
+        case I64:
+            for (iii = 0; iii < count; iii++) {
+                TA_FOLD(acc[iii].i, cells[iii].i, ta->op);
+            }
+            break;
+        case D64:
+            for (iii = 0; iii < count; iii++) {
+                TA_FOLD(acc[iii].d, cells[iii].d, ta->op);
+            }
+            break;
+    }
+}
+
+static void
+ta_print_row (table_t *tab, const char *key, size_t key_len,
+        const cell_t *cells, size_t count)
+{
+    size_t iii;
+    fwrite(key, 1, key_len, tab->outfp);
+    for (iii = 0; iii < count; iii++) {
+        fputs(tab->sep, tab->outfp);
+        switch (tab->mode) {
+            case U64:
+                fprintf(tab->outfp, "%"PRIu64, cells[iii].u);
+                break;
+            case I64:
+                fprintf(tab->outfp, "%"PRId64, cells[iii].i);
+                break;
+            case D64:
+                fprintf(tab->outfp, "%.17Lg", cells[iii].d);
+                break;
+        }
+    }
+    fputc('\n', tab->outfp);
+}
+
+/* Sorted input: fold each row into the current group until the key
+ * changes, so only one row is ever held */
+static void
+ta_sorted_row (table_t *tab, char *line, cell_t *cells, size_t count)
+{
+    ta_t *ta = (ta_t *)tab->data;
+    size_t key_len = 0;
+    const char *key = table_row_key(tab, line, &key_len);
+    if (ta->cells != NULL && key_len == ta->key_len &&
+            memcmp(key, ta->key, key_len) == 0) {
+        ta_fold(ta, tab->mode, ta->cells, cells, count);
+        return;
+    }
+    if (ta->cells == NULL) {
+        ta->count = count;
+        ta->cells = km_calloc(count > 0 ? count : 1, sizeof(*ta->cells),
+                &km_onerr_print_exit);
+    } else {
+        int cmp = memcmp(key, ta->key,
+                key_len < ta->key_len ? key_len : ta->key_len);
+        if (cmp < 0 || (cmp == 0 && key_len < ta->key_len)) {
+            ta->unsorted++;
+        }
+        ta_print_row(tab, ta->key, ta->key_len, ta->cells, ta->count);
+    }
+    if (key_len + 1 > ta->key_size) {
+        ta->key_size = kmroundupz(key_len + 1);
+        ta->key = km_realloc(ta->key, ta->key_size, &km_onerr_print_exit);
+    }
+    memcpy(ta->key, key, key_len);
+    ta->key_len = key_len;
+    memcpy(ta->cells, cells, count * sizeof(*cells));
+}
+
+static void
+ta_grow_slots (ta_t *ta)
+{
+    size_t n_slots = ta->slots == NULL ? 1024 : 2 * (ta->mask + 1);
+    ta_group_t **slots = km_calloc(n_slots, sizeof(*slots),
+            &km_onerr_print_exit);
+    ta_group_t *group = NULL;
+    ta->mem_used += (n_slots - (ta->slots == NULL ? 0 : ta->mask + 1)) *
+        sizeof(*slots);
+    for (group = ta->first; group != NULL; group = group->next) {
+        size_t slot = (group->hash >> 32) & (n_slots - 1);
+        while (slots[slot] != NULL) slot = (slot + 1) & (n_slots - 1);
+        slots[slot] = group;
+    }
+    km_free(ta->slots);
+    ta->slots = slots;
+    ta->mask = n_slots - 1;
+}
+
+/* Hash aggregation: fold the row into its key's group. Once the memory
+ * limit is reached, rows with keys not already held are written to a
+ * partition instead, to be aggregated after this pass. */
+static void
+ta_hash_row (table_t *tab, char *line, cell_t *cells, size_t count)
+{
+    ta_t *ta = (ta_t *)tab->data;
+    size_t key_len = 0;
+    const char *key = table_row_key(tab, line, &key_len);
+    uint64_t hash = sketch_row_hash(tab, line);
+    ta_group_t *group = NULL;
+    size_t slot;
+    if (ta->slots == NULL || 2 * (ta->n_groups + 1) > ta->mask + 1) {
+        ta_grow_slots(ta);
+    }
+    for (slot = (hash >> 32) & ta->mask; ta->slots[slot] != NULL;
+            slot = (slot + 1) & ta->mask) {
+        group = ta->slots[slot];
+        if (group->hash == hash && group->key_len == key_len &&
+                memcmp(group->key, key, key_len) == 0) {
+            ta_fold(ta, tab->mode, group->cells, cells, count);
+            return;
+        }
+    }
+    if (ta->mem_limit > 0 && ta->mem_used > ta->mem_limit &&
+            ta->level < TA_MAX_LEVEL) {
+        size_t part = (hash >> (ta->level * TA_PART_BITS)) &
+            (TA_PARTITIONS - 1);
+        if (ta->parts[part] == NULL) {
+            ta->parts[part] = tmpfile();
+            if (ta->parts[part] == NULL) {
+                km_onerr_print_exit("Creating partition", __FILE__,
+                        __LINE__);
+            }
+        }
+        fputs(line, ta->parts[part]);
+        return;
+    }
+    ta->count = count;
+    /* Cells follow the header at the arena's alignment, for cell_t */
+    group = arena_alloc(ta->arena, ARENA_ROUND(sizeof(*group)) +
+            count * sizeof(*cells) + key_len + 1);
+    group->cells = (cell_t *)((char *)group + ARENA_ROUND(sizeof(*group)));
+    group->key = (char *)(group->cells + count);
+    memcpy(group->cells, cells, count * sizeof(*cells));
+    memcpy(group->key, key, key_len);
+    group->key[key_len] = '\0';
+    group->key_len = key_len;
+    group->hash = hash;
+    group->next = NULL;
+    if (ta->last == NULL) {
+        ta->first = group;
+    } else {
+        ta->last->next = group;
+    }
+    ta->last = group;
+    ta->slots[slot] = group;
+    ta->n_groups++;
+    ta->mem_used += ARENA_ROUND(sizeof(*group)) + count * sizeof(*cells) +
+        key_len + 1;
+}
+
+/* Aggregate tab->fp at a level of partitioning, then each partition
+ * spilled from it at the next level */
+static int
+ta_hash_run (table_t *tab, ta_t *ta, unsigned int level)
+{
+    FILE *parts[TA_PARTITIONS];
+    FILE *fp = tab->fp;
+    ta_group_t *group = NULL;
+    size_t iii;
+    int res = 0;
+    memset(parts, 0, sizeof(parts));
+    ta->arena = arena_new(0);
+    ta->slots = NULL;
+    ta->mask = 0;
+    ta->n_groups = 0;
+    ta->first = ta->last = NULL;
+    ta->mem_used = 0;
+    ta->level = level;
+    ta->parts = parts;
+    res = iter_table(tab);
+    for (group = ta->first; group != NULL; group = group->next) {
+        ta_print_row(tab, group->key, group->key_len, group->cells,
+                ta->count);
+    }
+    km_free(ta->slots);
+    ta->slots = NULL;
+    destroy_arena_t(ta->arena);
+    ta->arena = NULL;
+    /* Partitions hold raw rows, without header rows */
+    tab->skiprow = 0;
+    tab->skipped_row_fn = NULL;
+    tab->range_first = tab->range_rows = 0;
+    for (iii = 0; iii < TA_PARTITIONS; iii++) {
+        if (parts[iii] == NULL) continue;
+        if (res == 0) {
+            if (fflush(parts[iii]) != 0) {
+                km_onerr_print_exit("Writing partition", __FILE__, __LINE__);
+            }
+            rewind(parts[iii]);
+            tab->fp = parts[iii];
+            res = ta_hash_run(tab, ta, level + 1);
+        }
+        fclose(parts[iii]);
+    }
+    tab->fp = fp;
+    return res;
+}
+
+int
+table_aggregate(table_t *tab)
+{
+    ta_t *ta = (ta_t *)tab->data;
+    int res = 0;
+    if (ta->sorted) {
+        tab->row_fn = &ta_sorted_row;
+        res = iter_table(tab);
+        if (ta->cells != NULL) {
+            ta_print_row(tab, ta->key, ta->key_len, ta->cells, ta->count);
+        }
+        km_free(ta->cells);
+        km_free(ta->key);
+        if (ta->unsorted > 0) {
+            fprintf(stderr, "%zu keys were out of order, so may be repeated "
+                    "in the output; sort input with LC_ALL=C sort, or drop "
+                    "--sorted\n", ta->unsorted);
+        }
+    } else {
+        tab->row_fn = &ta_hash_row;
+        res = ta_hash_run(tab, ta, 0);
+    }
+    table_stats_finish(tab);
+    return res == 0;
+}
+
+void
+print_usage()
+{
+    fprintf(stderr, "tableAggregate\n\n");
+    fprintf(stderr, "Merge the rows of a large table that share a key.\n\n");
+    fprintf(stderr, "USAGE:\n\n");
+    fprintf(stderr, "tableAggregate [-r ROWS -c COLS -i INFILE -o OUTFILE -s SEP -t THREADS -a OP -f --sorted --mem-limit=SIZE --io=MODE --progress --stats]\n");
+    fprintf(stderr, "tableAggregate -h\n\n");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "\t-a OP\t\tCombine cells with 'sum' (default), 'max' or 'min'.\n");
+    fprintf(stderr, "\t-f \t\tCells are decimal numbers, not integers.\n");
+    fprintf(stderr, "\t--sorted\tInput is sorted by key, so merge adjacent rows in\n");
+    fprintf(stderr, "\t\t\tconstant memory. Otherwise rows are grouped in a hash\n");
+    fprintf(stderr, "\t\t\ttable, and printed in order of first appearance.\n");
+    fprintf(stderr, "\t--mem-limit=SIZE\tHold at most about SIZE bytes (e.g. 512M, 4G) of\n");
+    fprintf(stderr, "\t\t\tgroups at once; rows of further keys are spilled to\n");
+    fprintf(stderr, "\t\t\ttemporary partitions and merged afterwards, so are\n");
+    fprintf(stderr, "\t\t\tprinted after every group held in memory.\n");
+    fprintf(stderr, "\t-r ROWS\t\tSkip ROWS rows from start of table.\n");
+    fprintf(stderr, "\t-c COLS\t\tUse the first COLS columns of each row as its key\n");
+    fprintf(stderr, "\t\t\t(default 1).\n");
+    fprintf(stderr, "\t-s SEP\t\tUse string SEP as field seperator, not \"\\t\".\n");
+    fprintf(stderr, "\t-i INFILE\tInput from INFILE, not stdin (or '-' for stdin).\n");
+    fprintf(stderr, "\t-o OUTFILE\tOutput to OUTFILE, not stdout (or '-' for stdout).\n");
+    fprintf(stderr, "\t-t THREADS\tUse THREADS worker threads (default 1).\n");
+    fprintf(stderr, "\t--io=MODE\tRead input with a read-ahead 'thread' (default) or in\n");
+    fprintf(stderr, "\t\t\t'sync' with parsing.\n");
+    fprintf(stderr, "\t--progress\tReport progress and throughput to stderr.\n");
+    fprintf(stderr, "\t--stats\t\tPrint a JSON run summary to stderr when done.\n");
+    fprintf(stderr, "\t-h \t\tPrint this help message.\n");
+}
+
+int
+print_header (table_t *tab, char *hdr)
+{
+    fprintf(tab->outfp, "%s", hdr);
+    return 1;
+}
+
+int
+parse_args (int argc, char *argv[], table_t *tab)
+{
+    assert(tab);
+    ta_t *ta = arena_calloc(table_arena(tab), 1, sizeof(*ta));
+    unsigned char haveflags = 0;
+    /*
+        1 1 1 1 1 1 1 1
+          | | | | | | \- op
+          | | | | | \--- out fname
+          | | | | \----- in fname
+    */
+    static struct option long_opts[] = {
+        {"progress", no_argument, NULL, OPT_PROGRESS},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"io", required_argument, NULL, OPT_IO},
+        {"sorted", no_argument, NULL, OPT_SORTED},
+        {"mem-limit", required_argument, NULL, OPT_MEMLIMIT},
+        {NULL, 0, NULL, 0}
+    };
+    int c = 0;
+    tab->data = ta;
+    tab->skipcol = 1;
+    while((c = getopt_long(argc, argv, "a:fr:c:o:i:s:t:h", long_opts, NULL)) >= 0) {
+        switch (c) {
+            case 'a':
+                haveflags |= 1;
+                if (strcmp(optarg, "sum") == 0) {
+                    ta->op = TA_SUM;
+                } else if (strcmp(optarg, "max") == 0) {
+                    ta->op = TA_MAX;
+                } else if (strcmp(optarg, "min") == 0) {
+                    ta->op = TA_MIN;
+                } else {
+                    fprintf(stderr, "Unknown operation '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'f':
+                tab->mode = D64;
+                break;
+            case 'o':
+                haveflags |= 2;
+                tab->outfname = strdup(optarg);
+                break;
+            case 'i':
+                haveflags |= 4;
+                tab->fname = strdup(optarg);
+                break;
+            case 'c':
+                tab->skipcol = atol(optarg);
+                break;
+            case 'r':
+                tab->skiprow = atol(optarg);
+                break;
+            case 's':
+                tab->sep = strdup(optarg);
+                break;
+            case 't':
+                tab->threads = atoi(optarg);
+                break;
+            case OPT_SORTED:
+                ta->sorted = 1;
+                break;
+            case OPT_MEMLIMIT:
+                if (!strtosize(optarg, &ta->mem_limit)) {
+                    fprintf(stderr, "Bad memory limit '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_PROGRESS:
+            case OPT_STATS:
+                if (tab->stats == NULL) {
+                    table_stats_new(tab);
+                }
+                if (c == OPT_PROGRESS) tab->stats->progress = 1;
+                else tab->stats->summary = 1;
+                break;
+            case OPT_IO:
+                if (!reader_mode_from_str(&tab->io, optarg)) {
+                    fprintf(stderr, "Unknown input mode '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'h':
+                print_usage();
+                destroy_table_t(tab);
+                exit(EXIT_SUCCESS);
+        }
+    }
+    if (tab->sep == NULL) {
+        tab->sep = strdup("\t");
+    }
+    if (tab->skipcol == 0) {
+        fprintf(stderr, "[parse_args] Rows need at least one key column\n");
+        return 0;
+    }
+    /* Setup input fp */
+    if ((!(haveflags & 4)) || tab->fname == NULL || \
+            strncmp(tab->fname, "-", 1) == 0) {
+        tab->fp = fdopen(fileno(stdin), "r");
+        tab->fname = strdup("stdin");
+        haveflags |= 4;
+    } else {
+        tab->fp = fopen(tab->fname, "r");
+    }
+    if (tab->fp == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n%s\n", tab->fname,
+                strerror(errno));
+        return 0;
+    }
+    /* Setup output fp */
+    if ((!(haveflags & 2)) || tab->outfname == NULL || \
+            strncmp(tab->outfname, "-", 1) == 0) {
+        tab->outfp = fdopen(fileno(stdout), "w");
+        tab->outfname = strdup("stdout");
+        haveflags |= 2;
+    } else {
+        tab->outfp = fopen(tab->outfname, "w");
+    }
+    if (tab->outfp == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n%s\n", tab->outfname,
+                strerror(errno));
+        return 0;
+    }
+    return 1; /* Successful */
+}
+
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  main
+ * =====================================================================================
+ */
+int
+main (int argc, char *argv[])
+{
+    if (argc == 1) {
+        print_usage();
+        exit(EXIT_SUCCESS);
+    }
+    table_t *tab = km_calloc(1, sizeof(*tab), &km_onerr_print_exit);
+    tab->skipped_row_fn = &print_header;
+    tab->skipped_col_fn = NULL;
+    if (!parse_args(argc, argv, tab)) {
+        destroy_table_t(tab);
+        fprintf(stderr, "Cannot parse arguments.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (!table_aggregate(tab)) {
+        destroy_table_t(tab);
+        fprintf(stderr, "Error during table aggregation.\n");
+        exit(EXIT_FAILURE);
+    }
+    destroy_table_t(tab);
+    return EXIT_SUCCESS;
+} /* ----------  end of function main  ---------- */
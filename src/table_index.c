@@ -0,0 +1,402 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  table_index.c
+ *
+ *    Description:  tableIndex: Index large tables for random row access
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 19:40:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc 4.7+ or clang 3.2+
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "kdm.h"
+#include "ktable.h"
+#include "kpipeline.h"
+
+/* Long options without a short equivalent */
+#define OPT_PROGRESS 256
+#define OPT_STATS 257
+#define OPT_IO 258
+#define OPT_RANGE 259
+
+typedef enum _ti_mode {
+    TI_BUILD = 0,
+    TI_LOOKUP = 1,
+    TI_RANGE = 2,
+    TI_COUNT = 3,
+} ti_mode_t;
+
+typedef struct _ti {
+    ti_mode_t mode;
+    uint64_t stride;
+    char *idxfname;
+    char **keys;
+    size_t n_keys;
+} ti_t;
+
+static int
+key_cmp (const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+row_cmp (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Print the header rows, then the rows with any of ti->keys, in table
+ * order. Candidate rows are visited in order, so nearby rows are read on
+ * from the last one rather than sought from their index mark. */
+static int
+lookup_keys (table_t *tab, ti_t *ti)
+{
+    table_index_t *idx = tab->index;
+    uint64_t *rows = NULL;
+    size_t n_rows = 0, cap = 0;
+    unsigned char *found = NULL;
+    size_t n_found = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len = 0;
+    uint64_t cur = 0;
+    size_t iii, jjj;
+    for (iii = 0; iii < ti->n_keys; iii++) {
+        const table_index_key_t *first = NULL;
+        size_t n = table_index_find(idx, tab, ti->keys[iii], &first);
+        for (jjj = 0; jjj < n; jjj++) {
+            if (n_rows == cap) {
+                cap = cap > 0 ? 2 * cap : 64;
+                rows = km_realloc(rows, cap * sizeof(*rows),
+                        &km_onerr_print_exit);
+            }
+            rows[n_rows++] = first[jjj].row;
+        }
+    }
+    qsort(rows, n_rows, sizeof(*rows), &row_cmp);
+    found = km_calloc(ti->n_keys, sizeof(*found), &km_onerr_print_exit);
+    for (iii = 0; iii < tab->skiprow; iii++) {
+        if (km_readline_realloc(&line, tab->fp, &size,
+                    &km_onerr_print_exit) <= 0) break;
+        fprintf(tab->outfp, "%s", line);
+    }
+    for (iii = 0; iii < n_rows; iii++) {
+        uint64_t row = rows[iii];
+        const char *key = NULL;
+        char **match = NULL;
+        size_t key_len = 0;
+        char save;
+        if (iii > 0 && row == rows[iii - 1]) continue;
+        if (row < cur || row - cur >= idx->stride) {
+            off_t offset = table_index_offset(idx, row, &cur);
+            if (fseeko(tab->fp, offset, SEEK_SET) != 0) {
+                fprintf(stderr, "Could not seek in %s\n%s\n", tab->fname,
+                        strerror(errno));
+                break;
+            }
+        }
+        while (cur <= row && (len = km_readline_realloc(&line, tab->fp,
+                        &size, &km_onerr_print_exit)) > 0) {
+            cur++;
+        }
+        if (cur <= row) break;
+        /* The hash matched; check the key itself */
+        key = table_row_key(tab, line, &key_len);
+        save = line[key_len];
+        line[key_len] = '\0';
+        match = bsearch(&key, ti->keys, ti->n_keys, sizeof(*ti->keys),
+                &key_cmp);
+        line[key_len] = save;
+        if (match != NULL) {
+            fprintf(tab->outfp, "%s", line);
+            if (!found[match - ti->keys]) {
+                found[match - ti->keys] = 1;
+                n_found++;
+            }
+        }
+    }
+    if (n_found < ti->n_keys) {
+        fprintf(stderr, "%zu of %zu keys not found\n",
+                ti->n_keys - n_found, ti->n_keys);
+    }
+    km_free(line);
+    km_free(found);
+    km_free(rows);
+    return 1;
+}
+
+static void
+ti_print_line (table_t *tab, void *data, char *line, cell_t *cells,
+        size_t count)
+{
+    fprintf(tab->outfp, "%s", line);
+}
+
+int
+print_header (table_t *tab, char *hdr)
+{
+    fprintf(tab->outfp, "%s", hdr);
+    return 1;
+}
+
+/* Print the header rows and the rows of tab's range */
+static int
+print_range (table_t *tab)
+{
+    pipeline_t *pl = pipeline_new();
+    int res = 0;
+    tab->skipped_row_fn = &print_header;
+    pl->lazy = 1;
+    pl->need_lines = 1;
+    pipeline_add_sink(pl, &ti_print_line, NULL);
+    res = pipeline_run(tab, pl);
+    destroy_pipeline_t(pl);
+    return res == 0;
+}
+
+int
+table_index(table_t *tab)
+{
+    ti_t *ti = (ti_t *)tab->data;
+    int res = 0;
+    if (ti->mode == TI_BUILD) {
+        res = table_index_build(tab, ti->idxfname, ti->stride);
+        table_stats_finish(tab);
+        return res;
+    }
+    if (table_index_open(tab, ti->idxfname) == NULL) {
+        if (ti->mode != TI_RANGE) {
+            fprintf(stderr, "No index of %s, make one with tableIndex -i %s\n",
+                    tab->fname, tab->fname);
+            return 0;
+        }
+    } else {
+        /* Rows and keys are as the index was built */
+        tab->skiprow = tab->index->skiprow;
+        tab->skipcol = tab->index->skipcol;
+        free(tab->sep);
+        tab->sep = strdup(tab->index->sep);
+    }
+    switch (ti->mode) {
+        case TI_COUNT:
+            fprintf(tab->outfp, "%zu\n", (size_t)tab->index->n_rows);
+            return 1;
+        case TI_LOOKUP:
+            if (tab->index->n_keys == 0) {
+                fprintf(stderr, "Index %s has no keys; build it with -c\n",
+                        tab->index->fname);
+                return 0;
+            }
+            return lookup_keys(tab, ti);
+        case TI_RANGE:
+            return print_range(tab);
+        default:
+            return 0;
+    }
+}
+
+void
+print_usage()
+{
+    fprintf(stderr, "tableIndex\n\n");
+    fprintf(stderr, "Index a large table, and fetch its rows by number or key.\n\n");
+    fprintf(stderr, "USAGE:\n\n");
+    fprintf(stderr, "tableIndex [-r ROWS -c COLS -s SEP -n STRIDE -x INDEX --io=MODE --progress --stats] -i INFILE\n");
+    fprintf(stderr, "tableIndex [-x INDEX -o OUTFILE] -i INFILE -k KEYS | --range=ROWS | -N\n");
+    fprintf(stderr, "tableIndex -h\n\n");
+    fprintf(stderr, "With none of -k, --range or -N, writes the index of INFILE to\n");
+    fprintf(stderr, "INFILE" TABLE_INDEX_SUFFIX ", where filterTable and tableDist look for it.\n\n");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "\t-r ROWS\t\tSkip ROWS rows from start of table.\n");
+    fprintf(stderr, "\t-c COLS\t\tUse the first COLS columns of each row as its key.\n");
+    fprintf(stderr, "\t\t\tWith -c 0, rows can only be found by number.\n");
+    fprintf(stderr, "\t-s SEP\t\tUse string SEP as field seperator, not \"\\t\".\n");
+    fprintf(stderr, "\t-n STRIDE\tRecord the offset of every STRIDE-th row (default %d).\n", TABLE_INDEX_STRIDE);
+    fprintf(stderr, "\t-x INDEX\tUse index file INDEX, not INFILE" TABLE_INDEX_SUFFIX ".\n");
+    fprintf(stderr, "\t-i INFILE\tInput from INFILE, which must be a regular file.\n");
+    fprintf(stderr, "\t-o OUTFILE\tOutput to OUTFILE, not stdout (or '-' for stdout).\n");
+    fprintf(stderr, "\t-k KEYS\t\tPrint the rows with keys in KEYS, a comma-separated list\n");
+    fprintf(stderr, "\t\t\tor @FILE with one key per line.\n");
+    fprintf(stderr, "\t--range=ROWS\tPrint data rows ROWS, e.g. 1001-2000 or 1001+1000,\n");
+    fprintf(stderr, "\t\t\tcounted from 1.\n");
+    fprintf(stderr, "\t-N\t\tPrint the number of data rows.\n");
+    fprintf(stderr, "\t--io=MODE\tRead input with a read-ahead 'thread' (default) or in\n");
+    fprintf(stderr, "\t\t\t'sync' with parsing.\n");
+    fprintf(stderr, "\t--progress\tReport progress and throughput to stderr.\n");
+    fprintf(stderr, "\t--stats\t\tPrint a JSON run summary to stderr when done.\n");
+    fprintf(stderr, "\t-h \t\tPrint this help message.\n");
+}
+
+int
+parse_args (int argc, char *argv[], table_t *tab)
+{
+    assert(tab);
+    ti_t *ti = arena_calloc(table_arena(tab), 1, sizeof(*ti));
+    unsigned char haveflags = 0;
+    /*
+        1 1 1 1 1 1 1 1
+          | | | | | | \- mode
+          | | | | | \--- out fname
+          | | | | \----- in fname
+    */
+    static struct option long_opts[] = {
+        {"progress", no_argument, NULL, OPT_PROGRESS},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"io", required_argument, NULL, OPT_IO},
+        {"range", required_argument, NULL, OPT_RANGE},
+        {NULL, 0, NULL, 0}
+    };
+    int c = 0;
+    tab->data = ti;
+    while((c = getopt_long(argc, argv, "k:Nn:x:r:c:o:i:s:h", long_opts, NULL)) >= 0) {
+        switch (c) {
+            case 'k':
+                if (haveflags & 1) goto modes;
+                haveflags |= 1;
+                ti->mode = TI_LOOKUP;
+                if (!parse_name_list(table_arena(tab), optarg, &ti->keys,
+                            &ti->n_keys)) {
+                    fprintf(stderr, "No keys in '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_RANGE:
+                if (haveflags & 1) goto modes;
+                haveflags |= 1;
+                ti->mode = TI_RANGE;
+                if (!table_select_range(tab, optarg)) {
+                    fprintf(stderr, "Bad row range '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'N':
+                if (haveflags & 1) goto modes;
+                haveflags |= 1;
+                ti->mode = TI_COUNT;
+                break;
+            case 'n':
+                ti->stride = strtoull(optarg, NULL, 10);
+                if (ti->stride == 0) {
+                    fprintf(stderr, "Bad stride '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'x':
+                ti->idxfname = arena_strdup(table_arena(tab), optarg);
+                break;
+            case 'o':
+                haveflags |= 2;
+                tab->outfname = strdup(optarg);
+                break;
+            case 'i':
+                haveflags |= 4;
+                tab->fname = strdup(optarg);
+                break;
+            case 'c':
+                tab->skipcol = atol(optarg);
+                break;
+            case 'r':
+                tab->skiprow = atol(optarg);
+                break;
+            case 's':
+                tab->sep = strdup(optarg);
+                break;
+            case OPT_PROGRESS:
+            case OPT_STATS:
+                if (tab->stats == NULL) {
+                    table_stats_new(tab);
+                }
+                if (c == OPT_PROGRESS) tab->stats->progress = 1;
+                else tab->stats->summary = 1;
+                break;
+            case OPT_IO:
+                if (!reader_mode_from_str(&tab->io, optarg)) {
+                    fprintf(stderr, "Unknown input mode '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'h':
+                print_usage();
+                destroy_table_t(tab);
+                exit(EXIT_SUCCESS);
+        }
+    }
+    if (tab->sep == NULL) {
+        tab->sep = strdup("\t");
+    }
+    if (!(haveflags & 4) || tab->fname == NULL ||
+            strcmp(tab->fname, "-") == 0) {
+        fprintf(stderr, "[parse_args] An input file is required\n");
+        return 0;
+    }
+    tab->fp = fopen(tab->fname, "r");
+    if (tab->fp == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n%s\n", tab->fname,
+                strerror(errno));
+        return 0;
+    }
+    /* Setup output fp */
+    if ((!(haveflags & 2)) || tab->outfname == NULL || \
+            strncmp(tab->outfname, "-", 1) == 0) {
+        tab->outfp = fdopen(fileno(stdout), "w");
+        tab->outfname = strdup("stdout");
+        haveflags |= 2;
+    } else {
+        tab->outfp = fopen(tab->outfname, "w");
+    }
+    if (tab->outfp == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n%s\n", tab->outfname,
+                strerror(errno));
+        return 0;
+    }
+    return 1; /* Successful */
+modes:
+    fprintf(stderr, "[parse_args] Give only one of -k, --range and -N\n");
+    return 0;
+}
+
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  main
+ * =====================================================================================
+ */
+int
+main (int argc, char *argv[])
+{
+    if (argc == 1) {
+        print_usage();
+        exit(EXIT_SUCCESS);
+    }
+    table_t *tab = km_calloc(1, sizeof(*tab), &km_onerr_print_exit);
+    if (!parse_args(argc, argv, tab)) {
+        destroy_table_t(tab);
+        fprintf(stderr, "Cannot parse arguments.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (!table_index(tab)) {
+        destroy_table_t(tab);
+        fprintf(stderr, "Error during table indexing.\n");
+        exit(EXIT_FAILURE);
+    }
+    destroy_table_t(tab);
+    return EXIT_SUCCESS;
+} /* ----------  end of function main  ---------- */
@@ -0,0 +1,559 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  table_merge.c
+ *
+ *    Description:  tableMerge: Merge sorted per-sample tables into one table
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 21:50:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc 4.7+ or clang 3.2+
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/resource.h>
+
+#include "kdm.h"
+#include "ktable.h"
+
+/* Long options without a short equivalent */
+#define OPT_FAN_IN 256
+#define OPT_BUFFER 257
+
+/* Input buffer per file, and descriptors kept back from the fan-in */
+#define TM_BUFFER (1<<18)
+#define TM_FD_RESERVE 16
+
+/* An input: a sorted file of key columns then one or more value columns,
+ * either given by the user or made by merging a group of other inputs */
+typedef struct _tm_input {
+    const char *fname;
+    FILE *fp;
+    char *buf;
+    char *line;
+    size_t size;
+    char *prev;                 /* Last line, to check the sort order */
+    size_t prev_size;
+    size_t prev_key_len;
+    const char *key;
+    size_t key_len;
+    const char *vals;
+    size_t vals_len;
+    size_t width;
+    char **names;
+    char *zeros;
+    size_t zeros_len;
+    uint64_t rows;
+    uint64_t stamp;             /* Last output row it had a value for */
+} tm_input_t;
+
+typedef struct _tm {
+    tm_input_t *inputs;
+    size_t n_inputs;
+    size_t fan_in;
+    size_t buffer;
+    int header;
+    const char *key_name;
+    arena_t *arena;
+} tm_t;
+
+static int
+tm_key_cmp (const tm_input_t *a, const tm_input_t *b)
+{
+    size_t len = a->key_len < b->key_len ? a->key_len : b->key_len;
+    int cmp = memcmp(a->key, b->key, len);
+    if (cmp != 0) return cmp;
+    return (a->key_len > b->key_len) - (a->key_len < b->key_len);
+}
+
+/* Read in's next data row. Returns 0 at the end of input, -1 if keys are
+ * out of order or repeated. */
+static int
+tm_advance (table_t *tab, tm_input_t *in)
+{
+    ssize_t len = 0;
+    char *tmp = NULL;
+    size_t tmp_size = 0;
+    /* Keep the last line for the order check */
+    tmp = in->prev;
+    tmp_size = in->prev_size;
+    in->prev = in->line;
+    in->prev_size = in->size;
+    in->prev_key_len = in->key_len;
+    in->line = tmp;
+    in->size = tmp_size;
+    do {
+        len = km_readline_realloc(&in->line, in->fp, &in->size,
+                &km_onerr_print_exit);
+        if (len <= 0) {
+            return 0;
+        }
+        while (len > 0 && (in->line[len - 1] == '\n' ||
+                    in->line[len - 1] == '\r')) {
+            in->line[--len] = '\0';
+        }
+    } while (len == 0);
+    in->key = table_row_key(tab, in->line, &in->key_len);
+    /* Skip the one separator after the key, so empty values keep their
+     * place */
+    in->vals = in->key + in->key_len;
+    if (strncmp(in->vals, tab->sep, strlen(tab->sep)) == 0) {
+        in->vals += strlen(tab->sep);
+    } else if (*in->vals != '\0') {
+        in->vals++;
+    }
+    in->vals_len = len - (in->vals - in->line);
+    if (in->rows++ > 0) {
+        tm_input_t last = *in;
+        last.key = in->prev;
+        last.key_len = in->prev_key_len;
+        if (tm_key_cmp(&last, in) >= 0) {
+            fprintf(stderr, "%s is not sorted by key, or repeats one, at "
+                    "'%.*s'. Sort it with LC_ALL=C sort, and merge repeated "
+                    "keys with tableAggregate.\n", in->fname,
+                    (int)in->key_len, in->key);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* Open a user's input and read its first row, naming its value columns
+ * after the file */
+static int
+tm_open (table_t *tab, tm_t *tm, tm_input_t *in)
+{
+    size_t iii;
+    if (in->fp == NULL) {
+        const char *base = strrchr(in->fname, '/');
+        size_t base_len = 0;
+        char *line = NULL;
+        size_t size = 0;
+        in->fp = fopen(in->fname, "r");
+        if (in->fp == NULL) {
+            fprintf(stderr, "Could not open file '%s'\n%s\n", in->fname,
+                    strerror(errno));
+            return -1;
+        }
+        in->buf = km_malloc(tm->buffer, &km_onerr_print_exit);
+        setvbuf(in->fp, in->buf, _IOFBF, tm->buffer);
+        for (iii = 0; iii < tab->skiprow; iii++) {
+            if (km_readline_realloc(&line, in->fp, &size,
+                        &km_onerr_print_exit) <= 0) break;
+        }
+        km_free(line);
+        if (tm_advance(tab, in) < 0) return -1;
+        in->width = in->rows > 0 ?
+            count_columns(in->vals, tab->sep, in->vals_len) : 1;
+        if (in->width == 0) in->width = 1;
+        base = base != NULL ? base + 1 : in->fname;
+        base_len = strcspn(base, ".");
+        in->names = arena_calloc(tm->arena, in->width, sizeof(*in->names));
+        for (iii = 0; iii < in->width; iii++) {
+            size_t name_size = base_len + 24;
+            in->names[iii] = arena_alloc(tm->arena, name_size);
+            if (in->width == 1) {
+                snprintf(in->names[iii], name_size, "%.*s", (int)base_len,
+                        base);
+            } else {
+                snprintf(in->names[iii], name_size, "%.*s.%zu",
+                        (int)base_len, base, iii + 1);
+            }
+        }
+    } else if (tm_advance(tab, in) < 0) {
+        return -1;
+    }
+    /* What a row without this input's key gets */
+    in->zeros_len = in->width + (in->width - 1) * strlen(tab->sep);
+    in->zeros = arena_alloc(tm->arena, in->zeros_len + 1);
+    strcpy(in->zeros, "0");
+    for (iii = 1; iii < in->width; iii++) {
+        strcat(in->zeros, tab->sep);
+        strcat(in->zeros, "0");
+    }
+    return 0;
+}
+
+static void
+tm_close (tm_input_t *in)
+{
+    if (in->fp != NULL) {
+        fclose(in->fp);
+        in->fp = NULL;
+    }
+    km_free(in->buf);
+    km_free(in->line);
+    km_free(in->prev);
+    in->buf = in->line = in->prev = NULL;
+    in->size = in->prev_size = 0;
+}
+
+static void
+tm_sift_down (tm_input_t **heap, size_t n, size_t iii)
+{
+    while (1) {
+        size_t small = iii;
+        size_t left = 2 * iii + 1;
+        size_t right = left + 1;
+        tm_input_t *tmp = NULL;
+        if (left < n && tm_key_cmp(heap[left], heap[small]) < 0) small = left;
+        if (right < n && tm_key_cmp(heap[right], heap[small]) < 0) {
+            small = right;
+        }
+        if (small == iii) break;
+        tmp = heap[iii];
+        heap[iii] = heap[small];
+        heap[small] = tmp;
+        iii = small;
+    }
+}
+
+/* Merge inputs into out in one pass, with a min-heap of the inputs by
+ * their current key. Each output row has every input's values, in input
+ * order, or zeros for inputs without its key. */
+static int
+tm_merge (table_t *tab, tm_t *tm, tm_input_t *inputs, size_t n, FILE *out,
+        int header)
+{
+    tm_input_t **heap = km_calloc(n > 0 ? n : 1, sizeof(*heap),
+            &km_onerr_print_exit);
+    tm_input_t **matched = km_calloc(n > 0 ? n : 1, sizeof(*matched),
+            &km_onerr_print_exit);
+    size_t n_heap = 0;
+    uint64_t row = 0;
+    size_t iii, jjj;
+    int res = 0;
+    for (iii = 0; iii < n; iii++) {
+        if (tm_open(tab, tm, &inputs[iii]) < 0) {
+            res = -1;
+            goto done;
+        }
+        if (inputs[iii].rows > 0) {
+            heap[n_heap++] = &inputs[iii];
+        }
+    }
+    if (header) {
+        fputs(tm->key_name, out);
+        for (iii = 0; iii < n; iii++) {
+            for (jjj = 0; jjj < inputs[iii].width; jjj++) {
+                fputs(tab->sep, out);
+                fputs(inputs[iii].names[jjj], out);
+            }
+        }
+        fputc('\n', out);
+    }
+    for (iii = n_heap; iii-- > 0;) {
+        tm_sift_down(heap, n_heap, iii);
+    }
+    while (n_heap > 0) {
+        size_t n_matched = 0;
+        tm_input_t *first = heap[0];
+        row++;
+        /* Take every input with the smallest key off the heap */
+        while (n_heap > 0 && (n_matched == 0 ||
+                    tm_key_cmp(heap[0], first) == 0)) {
+            matched[n_matched++] = heap[0];
+            heap[0]->stamp = row;
+            heap[0] = heap[--n_heap];
+            tm_sift_down(heap, n_heap, 0);
+        }
+        fwrite(first->key, 1, first->key_len, out);
+        for (iii = 0; iii < n; iii++) {
+            tm_input_t *in = &inputs[iii];
+            fputs(tab->sep, out);
+            if (in->stamp == row) {
+                fwrite(in->vals, 1, in->vals_len, out);
+            } else {
+                fwrite(in->zeros, 1, in->zeros_len, out);
+            }
+        }
+        fputc('\n', out);
+        for (iii = 0; iii < n_matched; iii++) {
+            int got = tm_advance(tab, matched[iii]);
+            if (got < 0) {
+                res = -1;
+                goto done;
+            }
+            if (got > 0) {
+                /* Sift the refilled input up into place */
+                size_t pos = n_heap++;
+                heap[pos] = matched[iii];
+                while (pos > 0 &&
+                        tm_key_cmp(heap[pos], heap[(pos - 1) / 2]) < 0) {
+                    tm_input_t *tmp = heap[pos];
+                    heap[pos] = heap[(pos - 1) / 2];
+                    heap[(pos - 1) / 2] = tmp;
+                    pos = (pos - 1) / 2;
+                }
+            }
+        }
+    }
+    if (fflush(out) != 0) {
+        fprintf(stderr, "Error writing output\n%s\n", strerror(errno));
+        res = -1;
+    }
+done:
+    for (iii = 0; iii < n; iii++) {
+        tm_close(&inputs[iii]);
+    }
+    km_free(heap);
+    km_free(matched);
+    return res;
+}
+
+/* Merge groups of at most tm->fan_in inputs into temporary files, which
+ * become the inputs of the next level, until one merge can take them all */
+int
+table_merge(table_t *tab)
+{
+    tm_t *tm = (tm_t *)tab->data;
+    tm_input_t *inputs = tm->inputs;
+    size_t n = tm->n_inputs;
+    size_t iii, jjj, kkk;
+    while (n > tm->fan_in) {
+        size_t n_groups = (n + tm->fan_in - 1) / tm->fan_in;
+        tm_input_t *groups = arena_calloc(tm->arena, n_groups,
+                sizeof(*groups));
+        for (iii = 0; iii < n_groups; iii++) {
+            tm_input_t *group = &groups[iii];
+            tm_input_t *first = &inputs[iii * tm->fan_in];
+            size_t size = iii + 1 < n_groups ? tm->fan_in :
+                n - iii * tm->fan_in;
+            group->fname = "temporary merge";
+            group->fp = tmpfile();
+            if (group->fp == NULL) {
+                fprintf(stderr, "Could not create temporary file\n%s\n",
+                        strerror(errno));
+                return 0;
+            }
+            if (tm_merge(tab, tm, first, size, group->fp, 0) != 0) {
+                return 0;
+            }
+            rewind(group->fp);
+            group->buf = km_malloc(tm->buffer, &km_onerr_print_exit);
+            setvbuf(group->fp, group->buf, _IOFBF, tm->buffer);
+            for (jjj = 0; jjj < size; jjj++) {
+                group->width += first[jjj].width;
+            }
+            group->names = arena_calloc(tm->arena, group->width,
+                    sizeof(*group->names));
+            for (jjj = 0, kkk = 0; jjj < size; jjj++) {
+                memcpy(&group->names[kkk], first[jjj].names,
+                        first[jjj].width * sizeof(*group->names));
+                kkk += first[jjj].width;
+            }
+        }
+        inputs = groups;
+        n = n_groups;
+    }
+    return tm_merge(tab, tm, inputs, n, tab->outfp, tm->header) == 0;
+}
+
+static int
+tm_add_input (tm_t *tm, const char *fname, size_t *cap)
+{
+    if (tm->n_inputs == *cap) {
+        size_t old = *cap;
+        *cap = *cap > 0 ? 2 * *cap : 64;
+        tm->inputs = arena_grow(tm->arena, tm->inputs,
+                old * sizeof(*tm->inputs), *cap * sizeof(*tm->inputs));
+        memset(&tm->inputs[old], 0, (*cap - old) * sizeof(*tm->inputs));
+    }
+    tm->inputs[tm->n_inputs++].fname = arena_strdup(tm->arena, fname);
+    return 1;
+}
+
+/* Add the inputs named one per line in fname */
+static int
+tm_add_list (tm_t *tm, const char *fname, size_t *cap)
+{
+    FILE *fp = fopen(fname, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len = 0;
+    if (fp == NULL) {
+        fprintf(stderr, "Could not open file list '%s'\n%s\n", fname,
+                strerror(errno));
+        return 0;
+    }
+    while ((len = km_readline_realloc(&line, fp, &size,
+                    &km_onerr_print_exit)) > 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            tm_add_input(tm, line, cap);
+        }
+    }
+    km_free(line);
+    fclose(fp);
+    return 1;
+}
+
+void
+print_usage()
+{
+    fprintf(stderr, "tableMerge\n\n");
+    fprintf(stderr, "Merge tables sorted by key, e.g. per-sample k-mer counts, into one table.\n\n");
+    fprintf(stderr, "USAGE:\n\n");
+    fprintf(stderr, "tableMerge [-r ROWS -c COLS -s SEP -o OUTFILE -l LIST -n NAME -H --fan-in=N --buffer=SIZE] FILE ...\n");
+    fprintf(stderr, "tableMerge -h\n\n");
+    fprintf(stderr, "Each FILE must be sorted by key (as by LC_ALL=C sort) without repeated keys.\n");
+    fprintf(stderr, "Its value columns are named after the file, up to the first '.', and\n");
+    fprintf(stderr, "are 0 in rows whose key it lacks.\n\n");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "\t-r ROWS\t\tSkip ROWS header rows from start of each FILE.\n");
+    fprintf(stderr, "\t-c COLS\t\tUse the first COLS columns of each row as its key (default 1).\n");
+    fprintf(stderr, "\t-s SEP\t\tUse string SEP as field seperator, not \"\\t\".\n");
+    fprintf(stderr, "\t-o OUTFILE\tOutput to OUTFILE, not stdout (or '-' for stdout).\n");
+    fprintf(stderr, "\t-l LIST\t\tAlso merge the files named in LIST, one per line.\n");
+    fprintf(stderr, "\t-n NAME\t\tName the key column NAME in the header (default Kmer).\n");
+    fprintf(stderr, "\t-H \t\tDon't write a header row.\n");
+    fprintf(stderr, "\t--fan-in=N\tMerge at most N files at once (default: half the open\n");
+    fprintf(stderr, "\t\t\tfile limit); more are merged in groups through temporary files.\n");
+    fprintf(stderr, "\t--buffer=SIZE\tRead each file through a SIZE byte buffer (default 256K).\n");
+    fprintf(stderr, "\t-h \t\tPrint this help message.\n");
+}
+
+int
+parse_args (int argc, char *argv[], table_t *tab)
+{
+    assert(tab);
+    tm_t *tm = arena_calloc(table_arena(tab), 1, sizeof(*tm));
+    static struct option long_opts[] = {
+        {"fan-in", required_argument, NULL, OPT_FAN_IN},
+        {"buffer", required_argument, NULL, OPT_BUFFER},
+        {NULL, 0, NULL, 0}
+    };
+    struct rlimit lim;
+    size_t cap = 0;
+    int c = 0;
+    tab->data = tm;
+    tab->skipcol = 1;
+    tm->arena = table_arena(tab);
+    tm->header = 1;
+    tm->key_name = "Kmer";
+    tm->buffer = TM_BUFFER;
+    while((c = getopt_long(argc, argv, "r:c:s:o:l:n:Hh", long_opts, NULL)) >= 0) {
+        switch (c) {
+            case 'r':
+                tab->skiprow = atol(optarg);
+                break;
+            case 'c':
+                tab->skipcol = atol(optarg);
+                break;
+            case 's':
+                tab->sep = strdup(optarg);
+                break;
+            case 'o':
+                tab->outfname = strdup(optarg);
+                break;
+            case 'l':
+                if (!tm_add_list(tm, optarg, &cap)) {
+                    return 0;
+                }
+                break;
+            case 'n':
+                tm->key_name = optarg;
+                break;
+            case 'H':
+                tm->header = 0;
+                break;
+            case OPT_FAN_IN:
+                tm->fan_in = strtoul(optarg, NULL, 10);
+                if (tm->fan_in < 2) {
+                    fprintf(stderr, "Fan-in must be at least 2\n");
+                    return 0;
+                }
+                break;
+            case OPT_BUFFER:
+                if (!strtosize(optarg, &tm->buffer) || tm->buffer == 0) {
+                    fprintf(stderr, "Bad buffer size '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'h':
+                print_usage();
+                destroy_table_t(tab);
+                exit(EXIT_SUCCESS);
+        }
+    }
+    for (; optind < argc; optind++) {
+        tm_add_input(tm, argv[optind], &cap);
+    }
+    if (tm->n_inputs == 0) {
+        fprintf(stderr, "[parse_args] No files to merge\n");
+        return 0;
+    }
+    if (tab->sep == NULL) {
+        tab->sep = strdup("\t");
+    }
+    if (tab->skipcol == 0) {
+        fprintf(stderr, "[parse_args] Rows need at least one key column\n");
+        return 0;
+    }
+    if (tm->fan_in == 0) {
+        /* Half, as the files of a finished level stay open */
+        tm->fan_in = 512;
+        if (getrlimit(RLIMIT_NOFILE, &lim) == 0 &&
+                lim.rlim_cur != RLIM_INFINITY) {
+            tm->fan_in = lim.rlim_cur > 2 * (TM_FD_RESERVE + 2) ?
+                (lim.rlim_cur - TM_FD_RESERVE) / 2 : 2;
+        }
+    }
+    /* Setup output fp */
+    if (tab->outfname == NULL || strncmp(tab->outfname, "-", 1) == 0) {
+        tab->outfp = fdopen(fileno(stdout), "w");
+        if (tab->outfname == NULL) {
+            tab->outfname = strdup("stdout");
+        }
+    } else {
+        tab->outfp = fopen(tab->outfname, "w");
+    }
+    if (tab->outfp == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n%s\n", tab->outfname,
+                strerror(errno));
+        return 0;
+    }
+    return 1; /* Successful */
+}
+
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  main
+ * =====================================================================================
+ */
+int
+main (int argc, char *argv[])
+{
+    if (argc == 1) {
+        print_usage();
+        exit(EXIT_SUCCESS);
+    }
+    table_t *tab = km_calloc(1, sizeof(*tab), &km_onerr_print_exit);
+    if (!parse_args(argc, argv, tab)) {
+        destroy_table_t(tab);
+        fprintf(stderr, "Cannot parse arguments.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (!table_merge(tab)) {
+        destroy_table_t(tab);
+        fprintf(stderr, "Error during table merging.\n");
+        exit(EXIT_FAILURE);
+    }
+    destroy_table_t(tab);
+    return EXIT_SUCCESS;
+} /* ----------  end of function main  ---------- */
@@ -0,0 +1,428 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  table_stats.c
+ *
+ *    Description:  tableStats: Per-sample statistics of large tables
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 22:30:00
+ *       Revision:  none
+ *        License:  GPLv3+
+ *       Compiler:  gcc 4.7+ or clang 3.2+
+ *
+ *         Author:  Kevin Murray, spam@kdmurray.id.au
+ *
+ * ============================================================================
+ */
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "kdm.h"
+#include "ktable.h"
+#include "kpipeline.h"
+#include "kcolstats.h"
+
+/* Long options without a short equivalent */
+#define OPT_PROGRESS 256
+#define OPT_STATS 257
+#define OPT_COLUMNS 258
+#define OPT_SAMPLES 259
+#define OPT_IO 260
+#define OPT_RANGE 261
+#define OPT_COLLAPSE 262
+
+#define TS_DEFAULT_QUANTILES "0.25,0.5,0.75"
+
+typedef struct _ts {
+    col_stats_t stats;
+    char **names;               /* Of the columns in use, from the header */
+    size_t n_names;
+    double *quantiles;
+    size_t n_quantiles;
+} ts_t;
+
+static void
+ts_row (table_t *tab, void *data, char *line, cell_t *cells, size_t count)
+{
+    col_stats_t *st = (col_stats_t *)data;
+    if (km_unlikely(st->n_cols == 0)) {
+        col_stats_alloc(tab, st, count);
+    }
+    col_stats_add(tab, st, cells);
+}
+
+static void *
+ts_partial_init (table_t *tab, void *data)
+{
+    col_stats_t *part = arena_calloc(table_arena(tab), 1, sizeof(*part));
+    part->k = ((col_stats_t *)data)->k;
+    return part;
+}
+
+static void
+ts_partial_merge (table_t *tab, void *data, void *partial)
+{
+    col_stats_merge(tab, (col_stats_t *)data, (col_stats_t *)partial);
+}
+
+static void
+ts_print_cell (table_t *tab, cell_t cell)
+{
+    switch (tab->mode) {
+        case U64:
+            fprintf(tab->outfp, "%"PRIu64, cell.u);
+            break;
+        case I64:
+            fprintf(tab->outfp, "%"PRId64, cell.i);
+            break;
+        case D64:
+            fprintf(tab->outfp, "%.17Lg", cell.d);
+            break;
+    }
+}
+
+/* One row per sample, with the columns given by the header */
+static void
+ts_print (table_t *tab, ts_t *ts)
+{
+    col_stats_t *st = &ts->stats;
+    size_t iii, jjj;
+    fprintf(tab->outfp, "sample\tsum\tnonzero\tmean\tvar\tmin\tmax");
+    for (jjj = 0; jjj < ts->n_quantiles; jjj++) {
+        fprintf(tab->outfp, "\tq%g", ts->quantiles[jjj] * 100.0);
+    }
+    fputc('\n', tab->outfp);
+    for (iii = 0; iii < st->n_cols; iii++) {
+        if (tab->group_names != NULL) {
+            fprintf(tab->outfp, "%s", tab->group_names[iii]);
+        } else if (iii < ts->n_names) {
+            fprintf(tab->outfp, "%s", ts->names[iii]);
+        } else {
+            fprintf(tab->outfp, "%zu", (tab->columns != NULL ?
+                        tab->columns[iii] : iii) + 1);
+        }
+        fputc('\t', tab->outfp);
+        ts_print_cell(tab, st->sum[iii]);
+        /* Enough digits for the data, not the rounding of merges */
+        fprintf(tab->outfp, "\t%"PRIu64"\t%.15Lg\t%.12g\t", st->nonzero[iii],
+                col_stats_mean(tab, st, iii), col_stats_var(st, iii));
+        ts_print_cell(tab, st->min[iii]);
+        fputc('\t', tab->outfp);
+        ts_print_cell(tab, st->max[iii]);
+        for (jjj = 0; jjj < ts->n_quantiles; jjj++) {
+            fprintf(tab->outfp, "\t%.15g",
+                    kll_quantile(&st->sketches[iii], ts->quantiles[jjj]));
+        }
+        fputc('\n', tab->outfp);
+    }
+}
+
+int
+table_stats(table_t *tab)
+{
+    ts_t *ts = (ts_t *)tab->data;
+    pipeline_t *pl = pipeline_new();
+    int res = 0;
+    pipeline_add_accumulate(pl, &ts_row, &ts->stats, &ts_partial_init,
+            &ts_partial_merge);
+    res = pipeline_run(tab, pl);
+    destroy_pipeline_t(pl);
+    if (res == 0 && ts->stats.n_cols > 0) {
+        double start = tab->stats != NULL ? table_stats_now() : 0.0;
+        ts_print(tab, ts);
+        if (tab->stats != NULL) {
+            tab->stats->write_secs += table_stats_now() - start;
+        }
+    }
+    col_stats_free(&ts->stats);
+    table_stats_finish(tab);
+    return res == 0;
+}
+
+/* Keep the names of the columns in use from the last header row */
+int
+ts_header (table_t *tab, char *line)
+{
+    ts_t *ts = (ts_t *)tab->data;
+    size_t len = strcspn(line, "\r\n");
+    size_t col = 0, cap = 16;
+    char *copy = arena_alloc(table_arena(tab), len + 1);
+    char *np = NULL;
+    char *tok = NULL;
+    memcpy(copy, line, len);
+    copy[len] = '\0';
+    ts->n_names = 0;
+    ts->names = arena_calloc(table_arena(tab), cap, sizeof(*ts->names));
+    for (tok = strtok_r(copy, tab->sep, &np); tok != NULL;
+            tok = strtok_r(NULL, tab->sep, &np), col++) {
+        if (col < tab->skipcol) continue;
+        if (tab->columns != NULL && (ts->n_names >= tab->n_columns ||
+                    tab->columns[ts->n_names] != col - tab->skipcol)) {
+            continue;
+        }
+        if (ts->n_names == cap) {
+            ts->names = arena_grow(table_arena(tab), ts->names,
+                    cap * sizeof(*ts->names), 2 * cap * sizeof(*ts->names));
+            cap *= 2;
+        }
+        ts->names[ts->n_names++] = tok;
+    }
+    return 1;
+}
+
+static int
+ts_parse_quantiles (table_t *tab, ts_t *ts, const char *spec)
+{
+    char *copy = arena_strdup(table_arena(tab), spec);
+    char *np = NULL;
+    char *tok = NULL;
+    char *end = NULL;
+    size_t cap = 8;
+    ts->n_quantiles = 0;
+    ts->quantiles = arena_calloc(table_arena(tab), cap,
+            sizeof(*ts->quantiles));
+    for (tok = strtok_r(copy, ",", &np); tok != NULL;
+            tok = strtok_r(NULL, ",", &np)) {
+        double q = strtod(tok, &end);
+        if (end == tok || *end != '\0' || q < 0.0 || q > 1.0) {
+            return 0;
+        }
+        if (ts->n_quantiles == cap) {
+            ts->quantiles = arena_grow(table_arena(tab), ts->quantiles,
+                    cap * sizeof(*ts->quantiles),
+                    2 * cap * sizeof(*ts->quantiles));
+            cap *= 2;
+        }
+        ts->quantiles[ts->n_quantiles++] = q;
+    }
+    return 1;
+}
+
+void
+print_usage()
+{
+    fprintf(stderr, "tableStats\n\n");
+    fprintf(stderr, "Summarise each sample (column) of a large table in one pass.\n\n");
+    fprintf(stderr, "USAGE:\n\n");
+    fprintf(stderr, "tableStats [-r ROWS -c COLS -i INFILE -o OUTFILE -s SEP -t THREADS -f -q QUANTILES -k K --columns=LIST --samples=NAMES --collapse=GROUPS --io=MODE --range=ROWS --progress --stats]\n");
+    fprintf(stderr, "tableStats -h\n\n");
+    fprintf(stderr, "Prints the sum, number of non-zero cells, mean, variance, minimum,\n");
+    fprintf(stderr, "maximum and approximate quantiles of each sample.\n\n");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "\t-q QUANTILES\tComma-separated quantiles to estimate (default\n");
+    fprintf(stderr, "\t\t\t%s), or '' for none.\n", TS_DEFAULT_QUANTILES);
+    fprintf(stderr, "\t-k K\t\tQuantile sketch size (default %d); ranks are within\n", KLL_DEFAULT_K);
+    fprintf(stderr, "\t\t\tabout 1.7/K of the number of rows.\n");
+    fprintf(stderr, "\t-f \t\tCells are decimal numbers, not integers.\n");
+    fprintf(stderr, "\t-r ROWS\t\tSkip ROWS rows from start of table. The last names the\n");
+    fprintf(stderr, "\t\t\tsamples.\n");
+    fprintf(stderr, "\t-c COLS\t\tSkip COLS columns from start of each row.\n");
+    fprintf(stderr, "\t-s SEP\t\tUse string SEP as field seperator, not \"\\t\".\n");
+    fprintf(stderr, "\t-i INFILE\tInput from INFILE, not stdin (or '-' for stdin).\n");
+    fprintf(stderr, "\t-o OUTFILE\tOutput to OUTFILE, not stdout (or '-' for stdout).\n");
+    fprintf(stderr, "\t-t THREADS\tUse THREADS worker threads (default 1).\n");
+    fprintf(stderr, "\t--columns=LIST\tOnly use the data columns in LIST, e.g. 1,4-6,\n");
+    fprintf(stderr, "\t\t\tcounted from 1 after the COLS skipped by -c.\n");
+    fprintf(stderr, "\t--samples=NAMES\tOnly use the samples named in NAMES, a comma-separated\n");
+    fprintf(stderr, "\t\t\tlist or @FILE with one name per line, as found in the\n");
+    fprintf(stderr, "\t\t\theader (the last row skipped by -r).\n");
+    fprintf(stderr, "\t--collapse=GROUPS\tSum samples into groups first, given as\n");
+    fprintf(stderr, "\t\t\t'G1=S1,S2;G2=S3,S4' or @FILE with a sample and its group\n");
+    fprintf(stderr, "\t\t\tper line, named as in the header.\n");
+    fprintf(stderr, "\t--io=MODE\tRead input with a read-ahead 'thread' (default) or in\n");
+    fprintf(stderr, "\t\t\t'sync' with parsing.\n");
+    fprintf(stderr, "\t--range=ROWS\tOnly use data rows ROWS, e.g. 1001-2000 or 1001+1000,\n");
+    fprintf(stderr, "\t\t\tcounted from 1. Uses INFILE" TABLE_INDEX_SUFFIX " from tableIndex if present.\n");
+    fprintf(stderr, "\t--progress\tReport progress and throughput to stderr.\n");
+    fprintf(stderr, "\t--stats\t\tPrint a JSON run summary to stderr when done.\n");
+    fprintf(stderr, "\t-h \t\tPrint this help message.\n");
+}
+
+int
+parse_args (int argc, char *argv[], table_t *tab)
+{
+    assert(tab);
+    ts_t *ts = arena_calloc(table_arena(tab), 1, sizeof(*ts));
+    const char *quantiles = TS_DEFAULT_QUANTILES;
+    unsigned char haveflags = 0;
+    /*
+        1 1 1 1 1 1 1 1
+          | | | | | | \- (unused)
+          | | | | | \--- out fname
+          | | | | \----- in fname
+    */
+    static struct option long_opts[] = {
+        {"progress", no_argument, NULL, OPT_PROGRESS},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"columns", required_argument, NULL, OPT_COLUMNS},
+        {"samples", required_argument, NULL, OPT_SAMPLES},
+        {"io", required_argument, NULL, OPT_IO},
+        {"range", required_argument, NULL, OPT_RANGE},
+        {"collapse", required_argument, NULL, OPT_COLLAPSE},
+        {NULL, 0, NULL, 0}
+    };
+    int c = 0;
+    tab->data = ts;
+    ts->stats.k = KLL_DEFAULT_K;
+    while((c = getopt_long(argc, argv, "q:k:fr:c:o:i:s:t:h", long_opts, NULL)) >= 0) {
+        switch (c) {
+            case 'q':
+                quantiles = optarg;
+                break;
+            case 'k':
+                ts->stats.k = atoi(optarg);
+                if (ts->stats.k < 2) {
+                    fprintf(stderr, "Bad sketch size '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'f':
+                tab->mode = D64;
+                break;
+            case 'o':
+                haveflags |= 2;
+                tab->outfname = strdup(optarg);
+                break;
+            case 'i':
+                haveflags |= 4;
+                tab->fname = strdup(optarg);
+                break;
+            case 'c':
+                tab->skipcol = atol(optarg);
+                break;
+            case 'r':
+                tab->skiprow = atol(optarg);
+                break;
+            case 's':
+                tab->sep = strdup(optarg);
+                break;
+            case 't':
+                tab->threads = atoi(optarg);
+                break;
+            case OPT_PROGRESS:
+            case OPT_STATS:
+                if (tab->stats == NULL) {
+                    table_stats_new(tab);
+                }
+                if (c == OPT_PROGRESS) tab->stats->progress = 1;
+                else tab->stats->summary = 1;
+                break;
+            case OPT_COLUMNS:
+                if (!table_select_columns(tab, optarg)) {
+                    fprintf(stderr, "Bad column list '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_SAMPLES:
+                if (!table_select_names(tab, optarg)) {
+                    fprintf(stderr, "No samples in '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_IO:
+                if (!reader_mode_from_str(&tab->io, optarg)) {
+                    fprintf(stderr, "Unknown input mode '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_RANGE:
+                if (!table_select_range(tab, optarg)) {
+                    fprintf(stderr, "Bad row range '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case OPT_COLLAPSE:
+                if (!table_collapse_columns(tab, optarg)) {
+                    fprintf(stderr, "Bad sample groups '%s'\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'h':
+                print_usage();
+                destroy_table_t(tab);
+                exit(EXIT_SUCCESS);
+        }
+    }
+    if (tab->sep == NULL) {
+        tab->sep = strdup("\t");
+    }
+    if (!ts_parse_quantiles(tab, ts, quantiles)) {
+        fprintf(stderr, "Bad quantiles '%s'\n", quantiles);
+        return 0;
+    }
+    if (ts->n_quantiles == 0) {
+        /* No sketches to keep */
+        ts->stats.k = 0;
+    }
+    /* Setup input fp */
+    if ((!(haveflags & 4)) || tab->fname == NULL || \
+            strncmp(tab->fname, "-", 1) == 0) {
+        tab->fp = fdopen(fileno(stdin), "r");
+        tab->fname = strdup("stdin");
+        haveflags |= 4;
+    } else {
+        tab->fp = fopen(tab->fname, "r");
+    }
+    if (tab->fp == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n%s\n", tab->fname,
+                strerror(errno));
+        return 0;
+    }
+    if (tab->range_first > 0) {
+        /* Jump to the range with the table's index, if it has one */
+        table_index_open(tab, NULL);
+    }
+    /* Setup output fp */
+    if ((!(haveflags & 2)) || tab->outfname == NULL || \
+            strncmp(tab->outfname, "-", 1) == 0) {
+        tab->outfp = fdopen(fileno(stdout), "w");
+        tab->outfname = strdup("stdout");
+        haveflags |= 2;
+    } else {
+        tab->outfp = fopen(tab->outfname, "w");
+    }
+    if (tab->outfp == NULL) {
+        fprintf(stderr, "Could not open file '%s'\n%s\n", tab->outfname,
+                strerror(errno));
+        return 0;
+    }
+    return 1; /* Successful */
+}
+
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  main
+ * =====================================================================================
+ */
+int
+main (int argc, char *argv[])
+{
+    if (argc == 1) {
+        print_usage();
+        exit(EXIT_SUCCESS);
+    }
+    table_t *tab = km_calloc(1, sizeof(*tab), &km_onerr_print_exit);
+    tab->skipped_row_fn = &ts_header;
+    tab->skipped_col_fn = NULL;
+    if (!parse_args(argc, argv, tab)) {
+        destroy_table_t(tab);
+        fprintf(stderr, "Cannot parse arguments.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (!table_stats(tab)) {
+        destroy_table_t(tab);
+        fprintf(stderr, "Error computing table statistics.\n");
+        exit(EXIT_FAILURE);
+    }
+    destroy_table_t(tab);
+    return EXIT_SUCCESS;
+} /* ----------  end of function main  ---------- */
@@ -1,6 +1,473 @@
 #!/bin/bash
 set -x
 set -e
-valgrind --leak-check=full bin/filterTable  -r 1 -c 1 -i data/small.tab -z 2 > data/out.tab
+# Run from the build directory. Leaks are checked where valgrind is installed.
+VALGRIND=""
+if command -v valgrind >/dev/null; then
+    VALGRIND="valgrind --leak-check=full"
+fi
+
+# Compare two tables cell by cell, numbers to within TOL of their value (and
+# a unit in the last printed place, which may round either way)
+near () {
+    awk -v tol="$3" '
+        function abs(x) { return x < 0 ? -x : x }
+        NR == FNR { nf[FNR] = NF; for (i = 1; i <= NF; i++) a[FNR, i] = $i;
+            n = FNR; next }
+        { if (NF != nf[FNR]) exit 1
+          for (i = 1; i <= NF; i++) {
+            x = a[FNR, i]
+            if (x == $i) continue
+            if (x !~ /^-?[0-9.]+$/ || $i !~ /^-?[0-9.]+$/) exit 1
+            if (abs(x - $i) > 1e-6 + tol * abs(x)) exit 1
+          } }
+        END { if (FNR != n) exit 1 }' "$1" "$2"
+}
+
+# A table's first column, as one line
+keys () {
+    cut -f 1 | paste -s -d ' '
+}
+$VALGRIND bin/filterTable  -r 1 -c 1 -i data/small.tab -z 2 > data/out.tab
 md5sum data/out.tab
 echo "sum should be ''"
+
+# --stats writes its summary as JSON, with quotes and backslashes in the
+# file name escaped
+cp data/small.tab 'data/a"b\c.tab'
+bin/filterTable -r 1 -c 1 -z 2 --stats -i 'data/a"b\c.tab' 2> data/err.txt \
+    > /dev/null
+grep -F '{"file": "data/a\"b\\c.tab", "bytes": ' data/err.txt
+rm 'data/a"b\c.tab'
+
+# Under --mem-limit, tableDist builds the same matrix in bands, one pass over
+# the table each, and reports progress pass by pass
+bin/tableDist -r 1 -c 1 -i data/wide50.tab -m > data/plain.tab
+bin/tableDist -r 1 -c 1 -i data/wide50.tab -m --mem-limit=400K --progress \
+    2> data/progress.txt | cmp - data/plain.tab
+tail -n 1 data/progress.txt | grep '\] pass \([0-9]*\)/\1: .* (100\.0%)'
+
+# tableDist --sketch=K, with K at least the number of distinct row keys,
+# gives exact Jaccard distances between the samples' sets of non-zero row
+# keys, though keys are repeated, with any number of threads
+(cat data/expr.tab; tail -n +2 data/expr.tab \
+    | awk -F '\t' -v OFS='\t' '{ t = $2; $2 = $7; $7 = t; print }') \
+    > data/out.tab
+awk -F '\t' 'NR == 1 { n = NF - 1; printf "."
+        for (i = 2; i <= NF; i++) printf "\t%s", $i; printf "\t\n"
+        for (i = 2; i <= NF; i++) name[i - 1] = $i; next }
+    { for (i = 2; i <= NF; i++) if ($i != 0) in_set[$1, i - 1] = 1
+      keys[$1] = 1 }
+    END { for (a = 1; a <= n; a++) { printf "%s", name[a]
+        for (b = 1; b <= n; b++) {
+            if (b < a) { printf "\t."; continue }
+            both = either = 0
+            for (k in keys) {
+                both += in_set[k, a] && in_set[k, b]
+                either += in_set[k, a] || in_set[k, b]
+            }
+            printf "\t%f", (either > 0 ? 1 - both / either : 0)
+        }
+        printf "\t\n" } }' data/out.tab > data/expect.tab
+for opts in "--sketch=8" "--sketch=16" "--sketch=8 -t 3"; do
+    bin/tableDist -r 1 -c 1 -i data/out.tab $opts | diff -u data/expect.tab -
+done
+
+# tableDist and filterTable on the samples picked by --samples (in any order,
+# or @FILE) or --columns give what they do on a table cut to those samples,
+# and unknown samples or columns past the last are rejected
+cut -f 1,3,6,8 data/counts.tab > data/out.tab
+printf 's5\ns7\ns2\n' > data/samples.txt
+sels="--samples=s7,s2,s5 --samples=@data/samples.txt --columns=2,5,7
+    --columns=7,2,5-5"
+for mode in "-m" "-C"; do
+    bin/tableDist -r 1 -c 1 $mode -i data/out.tab > data/plain.tab
+    for sel in $sels; do
+        bin/tableDist -r 1 -c 1 $mode $sel -i data/counts.tab \
+            | cmp - data/plain.tab
+    done
+done
+for mode in "-z 2" "-m 8"; do
+    bin/filterTable -r 1 -c 1 $mode -i data/out.tab | keys > data/plain.tab
+    for sel in $sels; do
+        bin/filterTable -r 1 -c 1 $mode $sel -i data/counts.tab | keys \
+            | cmp - data/plain.tab
+    done
+done
+! bin/tableDist -r 1 -c 1 -m --samples=s2,s11 -i data/counts.tab > /dev/null
+! bin/filterTable -r 1 -c 1 -z 2 --columns=2,11 -i data/counts.tab > /dev/null
+
+# filterTable -e: and binds tighter than or, not/! is told apart from !=,
+# groups may be defined after the expression, medians of even counts are
+# the lower middle value, threads agree, and syntax errors are fatal
+ft="bin/filterTable -r 1 -c 1 -i data/expr.tab"
+test "$($ft -e 'nonzero == 6 or sum >= 9 and max < 9' | keys)" \
+    = "key r3 r4 r6 r7 r8"
+test "$($ft -e '(nonzero == 6 or sum >= 9) and max < 9' | keys)" \
+    = "key r3 r4 r6 r8"
+for expr in 'sum != 0 and !(max > 5)' 'not sum == 0 and not max > 5' \
+        '!max>5&&sum!=0'; do
+    test "$($ft -e "$expr" | keys)" = "key r2 r3 r4 r6 r8"
+done
+test "$($ft -e 'sum(A) >= 6' -g A=1-3 | keys)" = "key r2 r5 r7"
+test "$($ft -e 'median == 1' | keys)" = "key r4 r6 r7"
+test "$($ft -e 'median(C) == 1' -g C=1-4 | keys)" = "key r2 r4 r7 r8"
+bin/filterTable -r 1 -c 1 -i data/wide50.tab -g A=1-20 \
+    -e 'median >= 2 and sum(A) > 200 or max(A) < 5' > data/plain.tab
+bin/filterTable -r 1 -c 1 -i data/wide50.tab -g A=1-20 -t 3 \
+    -e 'median >= 2 and sum(A) > 200 or max(A) < 5' | cmp - data/plain.tab
+if $ft -e 'sum >= ' > /dev/null 2> data/err.txt; then
+    false
+fi
+grep -q '^ *\^$' data/err.txt
+
+# Input read ahead on a thread, through a ring of 4 MiB buffers that big.tab
+# fills several times over, from a file or a pipe, gives the same results as
+# input read in line with parsing. Unknown --io modes are rejected.
+awk 'BEGIN { printf "key"
+    for (i = 1; i <= 10; i++) printf "\ts%d", i
+    printf "\n"
+    for (r = 1; r <= 500000; r++) { printf "row%d", r
+        for (i = 1; i <= 10; i++) printf "\t%d", (r * i * 7919) % 1000
+        printf "\n" } }' > data/big.tab
+bin/filterTable -r 1 -c 1 -m 500 --io=sync -i data/big.tab > data/plain.tab
+bin/tableDist -r 1 -c 1 -m --io=sync -i data/big.tab > data/dist.tab
+for io in "" "--io=thread"; do
+    bin/filterTable -r 1 -c 1 -m 500 $io -i data/big.tab | cmp - data/plain.tab
+    cat data/big.tab | bin/filterTable -r 1 -c 1 -m 500 $io | cmp - data/plain.tab
+    bin/tableDist -r 1 -c 1 -m $io -i data/big.tab | cmp - data/dist.tab
+    cat data/big.tab | bin/tableDist -r 1 -c 1 -m $io | cmp - data/dist.tab
+done
+! bin/filterTable -r 1 -c 1 -z 1 --io=uring -i data/small.tab > /dev/null
+
+# Rows of a MiB or more are parsed as they are read, and read again by
+# offset for output. Those of widerows.tab are, but not when lazy (-z) or, for
+# filterTable, from a pipe, which give the results to match.
+awk 'BEGIN { n = 450000; printf "key"
+    for (i = 1; i <= n; i++) printf "\ts%d", i
+    printf "\n"
+    for (r = 1; r <= 8; r++) { printf "r%d", r
+        for (i = 1; i <= n; i++)
+            printf "\t%d", (i * 7 + r * 13) % 11 < r + 2 ? (i * r) % 500 : 0
+        printf "\n" } }' > data/widerows.tab
+cut -f 1-41 data/widerows.tab > data/narrow.tab
+bin/tableDist -r 1 -c 1 -m -i data/narrow.tab > data/dist.tab
+for threads in 1 3; do
+    ft="bin/filterTable -r 1 -c 1 -t $threads"
+    $ft -z 200000 -i data/widerows.tab > data/plain.tab
+    test "$(keys < data/plain.tab)" = "key r3 r4 r5 r6 r7 r8"
+    $ft -e 'nonzero >= 200000' -i data/widerows.tab | cmp - data/plain.tab
+    $ft -e 'nonzero >= 200000' < data/widerows.tab | cmp - data/plain.tab
+    cat data/widerows.tab | $ft -m 100 > data/plain.tab
+    $ft -m 100 -i data/widerows.tab | cmp - data/plain.tab
+    $ft -m 100 < data/widerows.tab | cmp - data/plain.tab
+    td="bin/tableDist -r 1 -c 1 -m -t $threads --columns=1-40"
+    $td -i data/widerows.tab | cmp - data/dist.tab
+    cat data/widerows.tab | $td | cmp - data/dist.tab
+done
+
+# tableIndex fetches rows by number and key, and filterTable and tableDist
+# --range read the same rows with or without the index. A stride of 8 puts
+# ranges across several index entries.
+cp data/counts.tab data/index.tab
+rm -f data/index.tab.kti
+bin/filterTable -r 1 -c 1 -i data/index.tab --range=10+3 -z 0 > data/plain.tab
+bin/tableIndex -r 1 -c 1 -n 8 -i data/index.tab
+test "$(bin/tableIndex -i data/index.tab -N)" = 60
+bin/tableIndex -i data/index.tab --range=10-12 \
+    | diff -u <(sed -n '1p;11,13p' data/index.tab) -
+bin/tableIndex -i data/index.tab --range=59+5 \
+    | diff -u <(sed -n '1p;60,61p' data/index.tab) -
+bin/tableIndex -i data/index.tab -k r33,r1 \
+    | diff -u <(sed -n '1,2p;34p' data/index.tab) -
+bin/filterTable -r 1 -c 1 -i data/index.tab --range=10+3 -z 0 \
+    | diff -u data/plain.tab -
+diff -u <(sed -n '1p;11,13p' data/index.tab) data/plain.tab
+bin/tableDist -r 1 -c 1 -i data/index.tab --range=1-30 -m \
+    | diff -u <(head -n 31 data/index.tab | bin/tableDist -r 1 -c 1 -m) -
+
+# filterTable --keep-keys and --drop-keys take a comma list or @FILE and
+# split a table's rows between them, match keys of several columns, and
+# with --bloom still keep (or drop) every listed key
+awk 'BEGIN { print "key\ta\tb"
+    for (i = 1; i <= 2000; i++) print "k" i "\t" i % 7 "\t" i % 3 }' \
+    > data/keys.tab
+awk 'NR > 1 && NR % 3 == 0 { print $1 }' data/keys.tab > data/keys.txt
+ft="bin/filterTable -r 1 -c 1 -i data/keys.tab"
+test "$($ft --keep-keys=k17,k5,nokey | keys)" = "key k5 k17"
+test "$($ft --keep-keys=@data/keys.txt | tail -n +2 | cut -f 1)" \
+    = "$(cat data/keys.txt)"
+$ft --keep-keys=@data/keys.txt > data/out.tab
+$ft --drop-keys=@data/keys.txt | tail -n +2 >> data/out.tab
+sort data/out.tab | diff -u <(sort data/keys.tab) -
+$ft --keep-keys=@data/keys.txt --bloom=0.1 | tail -n +2 | cut -f 1 \
+    | sort > data/out.tab
+test -z "$(sort data/keys.txt | comm -23 - data/out.tab)"
+$ft --drop-keys=@data/keys.txt --bloom=0.1 | tail -n +2 | cut -f 1 \
+    | sort > data/out.tab
+test -z "$(sort data/keys.txt | comm -12 - data/out.tab)"
+printf 'chr\tpos\ta\nc1\t1\t1\nc1\t2\t2\nc2\t1\t3\nc2\t2\t4\n' > data/out.tab
+printf 'c1\t2\nc2\t1\n' > data/keys.txt
+test "$(bin/filterTable -r 1 -c 2 -i data/out.tab --keep-keys=@data/keys.txt \
+    | cut -f 3 | paste -s -d ' ')" = "a 2 3"
+test "$(bin/filterTable -r 1 -c 2 -i data/out.tab --drop-keys=@data/keys.txt \
+    | cut -f 3 | paste -s -d ' ')" = "a 1 4"
+
+# tableAggregate prints groups in order of first appearance, merges sorted
+# input as it streams, and gives the same groups when some are spilled
+cat > data/expect.tab <<'END'
+key	a	b
+k3	5	3
+k1	8	8
+k2	4	4
+k4	0	9
+END
+bin/tableAggregate -r 1 -i data/agg.tab | diff -u data/expect.tab -
+bin/tableAggregate -r 1 -i data/agg.tab -t 3 | diff -u data/expect.tab -
+tail -n +2 data/agg.tab | LC_ALL=C sort | bin/tableAggregate --sorted \
+    | diff -u <(tail -n +2 data/expect.tab | LC_ALL=C sort) -
+for opts in "--mem-limit=1" "--mem-limit=1 -t 3"; do
+    bin/tableAggregate -r 1 -i data/agg.tab $opts > data/out.tab
+    head -n 1 data/out.tab | diff -u <(head -n 1 data/expect.tab) -
+    LC_ALL=C sort data/out.tab | diff -u <(LC_ALL=C sort data/expect.tab) -
+done
+cat > data/expect.tab <<'END'
+key	a	b
+k3	4	2
+k1	5	7
+k2	3	3
+k4	0	9
+END
+bin/tableAggregate -r 1 -i data/agg.tab -a max | diff -u data/expect.tab -
+# A separator of several characters is written whole
+sed 's/\t/::/g' data/agg.tab > data/out.tab
+bin/tableAggregate -r 1 -s '::' -i data/out.tab -a max \
+    | diff -u <(sed 's/\t/::/g' data/expect.tab) -
+
+# tableMerge fills keys missing from a file with 0, the same whether files
+# are merged at once or in groups through temporary files
+cat > data/expect.tab <<'END'
+Kmer	s1	s2	s3
+AAA	3	0	1
+ACG	1	5	0
+CCC	0	4	2
+GGG	0	0	7
+TTT	2	0	1
+END
+bin/tableMerge data/s1.kmers data/s2.kmers data/s3.kmers \
+    | diff -u data/expect.tab -
+bin/tableMerge --fan-in=2 --buffer=4 data/s1.kmers data/s2.kmers \
+    data/s3.kmers | diff -u data/expect.tab -
+bin/tableMerge -n key data/s1.kmers data/s2.kmers data/s3.kmers \
+    | diff -u <(sed '1s/Kmer/key/' data/expect.tab) -
+bin/tableMerge -H data/s1.kmers data/s2.kmers data/s3.kmers \
+    | diff -u <(tail -n +2 data/expect.tab) -
+# A separator of several characters is written whole, also between zeros,
+# and an empty value after the key keeps its place
+printf 'AAA::1::2\nCCC::::4\n' > data/m1.kmers
+printf 'AAA::7\nBBB::8\n' > data/m2.kmers
+cat > data/expect.tab <<'END'
+Kmer::m1.1::m1.2::m2
+AAA::1::2::7
+BBB::0::0::8
+CCC::::4::0
+END
+bin/tableMerge -s '::' data/m1.kmers data/m2.kmers | diff -u data/expect.tab -
+cat > data/expect.tab <<'END'
+Kmer::m1.1::m1.2::m2::m1.1::m1.2
+AAA::1::2::7::1::2
+BBB::0::0::8::0::0
+CCC::::4::0::::4
+END
+bin/tableMerge -s '::' --fan-in=2 data/m1.kmers data/m2.kmers data/m1.kmers \
+    | diff -u data/expect.tab -
+
+# --collapse, as G=S1,S2;... or @FILE, sums each group into its first
+# sample's place, keeps other samples in place and renames the header, and
+# tableDist on the collapsed samples equals it on a table summed beforehand
+cat > data/expect.tab <<'END'
+key	GA	A2	GB	B3
+r1	0	0	0	0
+r2	4	2	0	0
+r3	0	0	10	5
+r4	2	1	2	1
+r5	9	0	0	0
+r6	1	4	2	3
+r7	10	1	2	1
+r8	1	3	5	0
+END
+printf 'A1\tGA\nA3\tGA\nB1\tGB\nB2\tGB\n' > data/groups.txt
+ft="bin/filterTable -r 1 -c 1 -i data/expr.tab -z 0"
+$ft --collapse='GA=A1,A3;GB=B1,B2' | diff -u data/expect.tab -
+$ft --collapse=@data/groups.txt | diff -u data/expect.tab -
+$ft --collapse=@data/groups.txt -t 3 | diff -u data/expect.tab -
+for metric in -m -C; do
+    bin/tableDist -r 1 -c 1 -i data/expect.tab $metric > data/plain.tab
+    bin/tableDist -r 1 -c 1 -i data/expr.tab $metric \
+        --collapse=@data/groups.txt | cmp - data/plain.tab
+done
+
+# tableStats, with quantiles exact for so few rows, and means that show
+# neither rounding noise nor the number of threads
+cat > data/expect.tab <<'END'
+sample	sum	nonzero	mean	var	min	max	q25	q50	q75
+a	17	7	2.125	2.98214285714	0	5	1	1	3
+b	24	7	3	10.5714285714	0	9	1	1	3
+END
+bin/tableStats -r 1 -c 1 -i data/agg.tab | diff -u data/expect.tab -
+bin/tableStats -r 1 -c 1 -i data/agg.tab -t 3 | diff -u data/expect.tab -
+printf 'key\tx\n' > data/out.tab
+for row in 1 2 3 4 5 6 7 8 9 10; do
+    printf 'r%s\t8.002\n' $row >> data/out.tab
+done
+cat > data/expect.tab <<'END'
+sample	sum	nonzero	mean	var	min	max
+x	80.02	10	8.002	0	8.002	8.002
+END
+bin/tableStats -r 1 -c 1 -f -q '' -i data/out.tab -t 3 \
+    | diff -u data/expect.tab -
+bin/tableStats -r 1 -c 1 -f -q '' -i data/counts.tab > data/plain.tab
+for threads in 2 3 7; do
+    bin/tableStats -r 1 -c 1 -f -q '' -i data/counts.tab -t $threads \
+        | cmp - data/plain.tab
+done
+# --samples and --columns summarise the same samples as a table cut to them
+cut -f 1,3,6,8 data/counts.tab | bin/tableStats -r 1 -c 1 > data/plain.tab
+bin/tableStats -r 1 -c 1 --samples=s7,s2,s5 -i data/counts.tab \
+    | cmp - data/plain.tab
+bin/tableStats -r 1 -c 1 --columns=2,5-5,7 -i data/counts.tab \
+    | cmp - data/plain.tab
+! bin/tableStats -r 1 -c 1 --samples=s2,s11 -i data/counts.tab > /dev/null
+# tableStats streams the wide rows too
+bin/tableStats -r 1 -c 1 -i data/narrow.tab > data/plain.tab
+bin/tableStats -r 1 -c 1 -q '' -i data/widerows.tab > data/stats.tab
+for threads in 1 3; do
+    ts="bin/tableStats -r 1 -c 1 -t $threads"
+    $ts --columns=1-40 -i data/widerows.tab | cmp - data/plain.tab
+    cat data/widerows.tab | $ts --columns=1-40 | cmp - data/plain.tab
+    $ts -q '' -i data/widerows.tab | cmp - data/stats.tab
+done
+# and reads input ahead like the other tools
+bin/tableStats -r 1 -c 1 --io=sync -i data/big.tab > data/stats.tab
+bin/tableStats -r 1 -c 1 -i data/big.tab | cmp - data/stats.tab
+cat data/big.tab | bin/tableStats -r 1 -c 1 | cmp - data/stats.tab
+
+# filterTable --annotate prints each kept row's key, non-zero count, sum,
+# min, max, lower median and mean, of its cells after collapsing, or six
+# 8-byte words per row in binary
+cat > data/expect.tab <<'END'
+key	nonzero	sum	min	max	median	mean
+r1	0	0	0	0	0	0
+r2	3	6	0	3	0	1
+r3	3	15	0	5	0	2.5
+r4	6	6	1	1	1	1
+r5	1	9	0	9	0	1.5
+r6	4	10	0	4	1	1.66666666666667
+r7	6	14	1	9	1	2.33333333333333
+r8	3	9	0	5	0	1.5
+END
+ft="bin/filterTable -r 1 -c 1 -i data/expr.tab"
+$ft --annotate | diff -u data/expect.tab -
+$ft --annotate -t 3 | diff -u data/expect.tab -
+cat > data/expect.tab <<'END'
+key	nonzero	sum	min	max	median	mean
+r3	2	15	0	10	0	3.75
+r5	1	9	0	9	0	2.25
+r6	4	10	1	4	2	2.5
+r7	4	14	1	10	1	3.5
+r8	3	9	0	5	1	2.25
+END
+$ft --annotate -e 'sum >= 9' --collapse='GA=A1,A3;GB=B1,B2' \
+    | diff -u data/expect.tab -
+test "$($ft --annotate=binary -z 6 | wc -c)" = $((2 * 6 * 8))
+
+# tableDist --normalize=relative gives the same matrix with totals from a
+# first pass over a file, from tableStats (looked up by name, in any order,
+# also under a comment row) and from a first pass over stdin's cell cache
+td="bin/tableDist -c 1 -m --normalize=relative"
+$td -r 1 -i data/wide50.tab > data/plain.tab
+bin/tableStats -r 1 -c 1 -q '' -i data/wide50.tab > data/totals.tab
+$td -r 1 -i data/wide50.tab --totals=data/totals.tab | cmp - data/plain.tab
+$td -r 1 < data/wide50.tab | cmp - data/plain.tab
+$td -r 1 --mem-limit=400K < data/wide50.tab | cmp - data/plain.tab
+(echo '# counts'; cat data/wide50.tab) > data/out.tab
+(head -n 1 data/totals.tab; tail -n +2 data/totals.tab | sort -r) \
+    > data/totals-sorted.tab
+$td -r 2 -i data/out.tab | cmp - data/plain.tab
+$td -r 2 -i data/out.tab --totals=data/totals-sorted.tab | cmp - data/plain.tab
+# It counts the totals pass as one of the passes it reports
+bin/tableDist -r 1 -c 1 -i data/wide50.tab -m --normalize=relative \
+    --mem-limit=400K --progress 2> data/progress.txt > /dev/null
+tail -n 1 data/progress.txt | grep '\] pass \([0-9]*\)/\1: .* (100\.0%)'
+# --normalize=hellinger, where a, b and c's square-rooted proportions are
+# (.6, .8, 0), (0, .6, .8) and (1, 0, 0)
+cat > data/expect.tab <<'END'
+.	a	b	c	
+a	0.000000	1.600000	1.200000	
+b	.	0.000000	2.400000	
+c	.	.	0.000000	
+END
+bin/tableDist -r 1 -c 1 -i data/hellinger.tab -m --normalize=hellinger \
+    | diff -u data/expect.tab -
+
+# tableDist --narrow gives exactly the plain Manhattan distances, though
+# counts.tab's batches widen to 2 and 4 bytes and some of its rows are
+# fractional, negative or too large to narrow
+for metric in "-m" "-M 1"; do
+    bin/tableDist -r 1 -c 1 -i data/counts.tab $metric > data/plain.tab
+    for opts in "" "-t 3" "--mem-limit=200"; do
+        bin/tableDist -r 1 -c 1 -i data/counts.tab $metric --narrow $opts \
+            | cmp - data/plain.tab
+    done
+done
+
+# tableDist --tiles gives the same matrices as one thread, for each kernel
+# and over several bands
+for metric in "-m" "-C" "-M 1" "-m --narrow"; do
+    bin/tableDist -r 1 -c 1 -i data/counts.tab $metric > data/plain.tab
+    for opts in "-t 3 --tiles" "-t 2 --tiles --mem-limit=200"; do
+        bin/tableDist -r 1 -c 1 -i data/counts.tab $metric $opts \
+            | cmp - data/plain.tab
+    done
+done
+
+# tableDist -C --sparse is within rows * 1e-15 of plain -C over sparse.tab's
+# 200 rows, also with threads and over several bands
+bin/tableDist -r 1 -c 1 -i data/sparse.tab -C > data/plain.tab
+for opts in "" "-t 3" "--mem-limit=200" "-t 3 --mem-limit=200"; do
+    bin/tableDist -r 1 -c 1 -i data/sparse.tab -C --sparse $opts \
+        > data/out.tab
+    near data/plain.tab data/out.tab 2e-13
+done
+
+# tableDist --knn=K gives each sample's K nearest others from the full
+# matrix, ties broken by sample order, and --cutoff=D alone gives each pair
+# closer than D once, whatever the bands and threads
+pairs () {
+    # Sample indices and names, and distance, of each pair of a matrix,
+    # both ways round
+    awk -F '\t' 'NR == 1 { for (i = 2; i < NF; i++) name[i - 1] = $i; next }
+        { for (j = NR; j < NF - 1; j++) {
+            print NR - 1 "\t" j "\t" name[NR - 1] "\t" name[j] "\t" $(j + 1)
+            print j "\t" NR - 1 "\t" name[j] "\t" name[NR - 1] "\t" $(j + 1)
+        } }' "$1"
+}
+for table in data/expr.tab data/counts.tab; do
+    bin/tableDist -r 1 -c 1 -i $table -m > data/plain.tab
+    pairs data/plain.tab | sort -t "$(printf '\t')" -k 1,1n -k 5,5g -k 2,2n \
+        | awk -F '\t' '++n[$1] <= 3 { print $3 "\t" $4 "\t" $5 }' \
+        > data/expect.tab
+    for opts in "" "--mem-limit=40" "-t 3" "-t 3 --tiles --mem-limit=40"; do
+        bin/tableDist -r 1 -c 1 -i $table -m --knn=3 $opts | tail -n +2 \
+            | diff -u data/expect.tab -
+    done
+    pairs data/plain.tab | awk -F '\t' '$1 < $2 && $5 < 3000 {
+        print $3 "\t" $4 "\t" $5 }' | sort > data/expect.tab
+    for opts in "" "--mem-limit=40" "-t 3"; do
+        bin/tableDist -r 1 -c 1 -i $table -m --cutoff=3000 $opts \
+            | tail -n +2 | sort | diff -u data/expect.tab -
+    done
+done
+if bin/tableDist -r 1 -c 1 -i data/expr.tab -m --knn=0 > /dev/null 2>&1; then
+    false
+fi